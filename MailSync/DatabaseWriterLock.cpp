@@ -0,0 +1,78 @@
+//
+//  DatabaseWriterLock.cpp
+//  MailSync
+//
+//  Copyright © 2017 Foundry 376. All rights reserved.
+//
+//  Use of this file is subject to the terms and conditions defined
+//  in 'LICENSE.md', which is part of the Mailspring-Sync package.
+//
+
+#include "DatabaseWriterLock.hpp"
+#include "spdlog/spdlog.h"
+
+using namespace std::chrono;
+
+#define WRITER_LOCK_REPORT_INTERVAL 60 * 5
+
+// Singleton Implementation
+
+shared_ptr<DatabaseWriterLock> _globalWriterLock = make_shared<DatabaseWriterLock>();
+
+shared_ptr<DatabaseWriterLock> SharedDatabaseWriterLock() {
+    return _globalWriterLock;
+}
+
+// DatabaseWriterLock
+
+DatabaseWriterLock::DatabaseWriterLock() :
+    held(false), interactiveWaiting(0), lastReport(system_clock::now())
+{
+}
+
+void DatabaseWriterLock::acquire(bool interactive) {
+    unique_lock<mutex> lock(mtx);
+    if (interactive) {
+        interactiveWaiting += 1;
+        cv.wait(lock, [this]() { return !held; });
+        interactiveWaiting -= 1;
+    } else {
+        cv.wait(lock, [this]() { return !held && interactiveWaiting == 0; });
+    }
+    held = true;
+}
+
+void DatabaseWriterLock::release() {
+    {
+        lock_guard<mutex> lock(mtx);
+        held = false;
+    }
+    cv.notify_all();
+}
+
+void DatabaseWriterLock::recordWait(string name, microseconds waited) {
+    lock_guard<mutex> lock(mtx);
+    auto & stats = waits[name];
+    stats.count += 1;
+    stats.total += waited;
+    if (waited > stats.max) {
+        stats.max = waited;
+    }
+    reportIfNecessary();
+}
+
+void DatabaseWriterLock::reportIfNecessary() {
+    auto now = system_clock::now();
+    if (now - lastReport < seconds(WRITER_LOCK_REPORT_INTERVAL)) {
+        return;
+    }
+    lastReport = now;
+
+    auto logger = spdlog::get("logger");
+    logger->info("Transaction wait times since last report:");
+    for (auto & pair : waits) {
+        auto & stats = pair.second;
+        logger->info("- {}: {} transactions, {}ms average, {}ms max", pair.first, stats.count, (stats.total.count() / stats.count) / 1000, stats.max.count() / 1000);
+    }
+    waits = {};
+}
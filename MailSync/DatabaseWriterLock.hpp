@@ -0,0 +1,66 @@
+//
+//  DatabaseWriterLock.hpp
+//  MailSync
+//
+//  Copyright © 2017 Foundry 376. All rights reserved.
+//
+//  Use of this file is subject to the terms and conditions defined
+//  in 'LICENSE.md', which is part of the Mailspring-Sync package.
+//
+
+/*
+ Each thread in the process has its own MailStore and SQLite connection, and
+ only one of them can hold a write transaction at a time. SQLite makes the
+ others poll with its busy handler, which is first-come-first-served at best.
+
+ The DatabaseWriterLock decides which MailStore begins its transaction next.
+ Interactive writers (tasks from the client and the foreground IDLE worker)
+ always go before background writers, so a background sync writing many small
+ transactions yields to them between transactions, and only when one is
+ actually waiting.
+
+ It also records how long each named transaction waited to begin, and logs a
+ summary periodically.
+*/
+#ifndef DatabaseWriterLock_hpp
+#define DatabaseWriterLock_hpp
+
+#include <stdio.h>
+#include <chrono>
+#include <condition_variable>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+
+using namespace std;
+
+struct DatabaseWriterWaitStats {
+    uint64_t count;
+    chrono::microseconds total;
+    chrono::microseconds max;
+};
+
+class DatabaseWriterLock {
+    mutex mtx;
+    condition_variable cv;
+    bool held;
+    int interactiveWaiting;
+
+    map<string, DatabaseWriterWaitStats> waits;
+    chrono::system_clock::time_point lastReport;
+
+    void reportIfNecessary();
+
+public:
+    DatabaseWriterLock();
+
+    void acquire(bool interactive);
+    void release();
+
+    void recordWait(string name, chrono::microseconds waited);
+};
+
+shared_ptr<DatabaseWriterLock> SharedDatabaseWriterLock();
+
+#endif /* DatabaseWriterLock_hpp */
@@ -14,21 +14,33 @@
 #include "StanfordCPPLib/exceptions.h"
 
 #include <iostream>
+#include <sstream>
 #include <stdio.h>
 #include <string.h>
 
 #ifndef _MSC_VER
 #include <unistd.h>
+#include <errno.h>
+#include <poll.h>
 #include <sys/socket.h>
 #include <sys/un.h>
 #endif
 
+#if defined(__linux__)
+#include <sys/epoll.h>
+#endif
+
 #include <stdlib.h>
 #include <functional>
 #include <chrono>
 #include <future>
 #include <cstdio>
 
+#if defined(_MSC_VER)
+#include <io.h>
+#include <fcntl.h>
+#endif
+
 using namespace nlohmann;
 
 // Singleton Implementation
@@ -44,8 +56,8 @@ shared_ptr<DeltaStream> SharedDeltaStream() {
 DeltaStreamItem::DeltaStreamItem(string type, string modelClass, vector<json> inJSONs) :
     type(type), modelClass(modelClass)
 {
-    for (const auto & itemJSON : inJSONs) {
-        upsertModelJSON(itemJSON);
+    for (auto & itemJSON : inJSONs) {
+        upsertModelJSON(std::move(itemJSON));
     }
 }
 
@@ -66,125 +78,464 @@ DeltaStreamItem::DeltaStreamItem(string type, vector<shared_ptr<MailModel>> & mo
     }
 }
 
-bool DeltaStreamItem::concatenate(const DeltaStreamItem & other) {
+// Note: `other` is only moved from if this returns true.
+bool DeltaStreamItem::concatenate(DeltaStreamItem && other) {
     if (other.type != type || other.modelClass != modelClass) {
         return false;
     }
-    for (const auto & modelJSON : other.modelJSONs) {
-        upsertModelJSON(modelJSON);
+    for (auto & modelJSON : other.modelJSONs) {
+        upsertModelJSON(std::move(modelJSON));
     }
     return true;
 }
 
-void DeltaStreamItem::upsertModelJSON(const json & item) {
+void DeltaStreamItem::upsertModelJSON(json item) {
     // scan and replace any instance of the object already available, or append.
     // It's important two back-to-back saves of the same object don't create two entries,
     // only the last one.
     string id = item["id"].get<string>();
 
-    if (idIndexes.count(id)) {
+    auto index = idIndexes.find(id);
+    if (index != idIndexes.end()) {
         // If we already have a delta for object X, merge the keys of `item` into X, replacing
         // existing keys. This ensures that if a previous delta included something extra (for
         // ex. message.body is conditionally emitted), we don't overwrite and remove it.
-        auto existing = modelJSONs[idIndexes[id]];
-        for (const auto &e : item.items()) {
-            existing[e.key()] = e.value();
+        json & existing = modelJSONs[index->second];
+        for (auto & e : item.items()) {
+            existing[e.key()] = std::move(e.value());
         }
-        modelJSONs[idIndexes[id]] = existing;
     } else {
-        idIndexes[id] = modelJSONs.size();
-        modelJSONs.push_back(item);
+        idIndexes.emplace(id, modelJSONs.size());
+        modelJSONs.push_back(std::move(item));
     }
 }
 
-string DeltaStreamItem::dump() const {
-    json j = {
+json DeltaStreamItem::toJSON() const {
+    return {
         {"type", type},
         {"modelJSONs", modelJSONs},
         {"modelClass", modelClass}
     };
-    return j.dump();
+}
+
+string DeltaStreamItem::dump() const {
+    return toJSON().dump();
+}
+
+// Serialization
+
+#define DELTA_STATS_REPORT_INTERVAL     60 * 5
+
+void appendJSONInFormat(string & out, const json & value, const string & format) {
+    if (format == DELTA_FORMAT_JSON) {
+        out += value.dump();
+        out += "\n";
+        return;
+    }
+
+    vector<uint8_t> bytes = (format == DELTA_FORMAT_CBOR) ? json::to_cbor(value) : json::to_msgpack(value);
+    uint32_t length = (uint32_t)bytes.size();
+    out += (char)((length >> 24) & 0xFF);
+    out += (char)((length >> 16) & 0xFF);
+    out += (char)((length >> 8) & 0xFF);
+    out += (char)(length & 0xFF);
+    out.append((const char *)bytes.data(), bytes.size());
+}
+
+void appendItemInFormat(string & out, const DeltaStreamItem & item, const string & format) {
+    appendJSONInFormat(out, item.toJSON(), format);
 }
 
 // Class
 
-DeltaStream::DeltaStream() : scheduled(false) {
+DeltaStream::DeltaStream() : bufferQueued(0), bufferQueueing(0), bufferEarlyFlushes(0), bufferDeferrals(0),
+    scheduled(false), connectionError(false), format(DELTA_FORMAT_JSON), patches(false), stats({}), lastReport(std::chrono::system_clock::now()),
+    dispatcher(nullptr), stopping(false), maxLatency(DELTA_DEFAULT_MAX_LATENCY_MS), maxBatchSize(DELTA_DEFAULT_MAX_BATCH_SIZE),
+    acking(false), bytesWritten(0), bytesAcked(0), lastFlushAt(std::chrono::system_clock::now()),
+    commandReader(nullptr), commandsClosed(false) {
 }
 
 
 DeltaStream::~DeltaStream() {
+    {
+        lock_guard<mutex> lock(bufferMtx);
+        stopping = true;
+    }
+    dispatcherCv.notify_all();
+
+    // Note: we don't join the dispatcher, because we're destroyed on exit and it may
+    // be blocked writing to a parent process that has stopped reading stdout.
+    if (dispatcher) {
+        dispatcher->detach();
+    }
+    if (commandReader) {
+        commandReader->detach();
+    }
 }
 
-json DeltaStream::waitForJSON() {
-    try {
-        string buffer;
-        cin.clear();
-        cin.sync();
-        getline(cin, buffer);
-        if (buffer.size() > 0) {
-            json j = json::parse(buffer);
-            return j;
+void DeltaStream::setDispatchLimits(int maxLatencyMs, size_t maxBatch) {
+    lock_guard<mutex> lock(bufferMtx);
+    maxLatency = maxLatencyMs;
+    maxBatchSize = maxBatch;
+    spdlog::get("logger")->info("Delta stream max latency: {}ms, max batch size: {}", maxLatency, maxBatchSize);
+}
+
+// Starts reading commands from stdin. Commands for which `fastPath` returns true are
+// handled entirely on the reader thread. The rest are queued for waitForCommand.
+void DeltaStream::startReadingCommands(std::function<bool(const json &)> fastPath) {
+    commandFastPath = fastPath;
+    commandReader = new std::thread([this]() {
+        SetThreadName("stdin");
+        runCommandReader();
+    });
+}
+
+void DeltaStream::runCommandReader() {
+    string pending;
+
+    // Note: anything cin read ahead of the account and identity JSON is still in its
+    // buffer, and won't be returned by read() below.
+    streamsize buffered = cin.rdbuf()->in_avail();
+    if (buffered > 0) {
+        pending.resize(buffered);
+        cin.read(&pending[0], buffered);
+    }
+
+#if defined(_MSC_VER)
+    string line;
+    if (pending.size() > 0) {
+        istringstream bufferedLines(pending);
+        while (getline(bufferedLines, line)) {
+            receiveCommandLine(line);
         }
-    } catch (char const * e) {
-        //
-    } catch (...) {
-        return {}; // ok
     }
-    return {};
+    while (getline(cin, line)) {
+        receiveCommandLine(line);
+    }
+#else
+    // Wait for stdin to become readable and then read whatever is available, so a burst
+    // of commands is split into lines and queued together.
+#if defined(__linux__)
+    int epollFd = epoll_create1(0);
+    struct epoll_event ev = {};
+    ev.events = EPOLLIN;
+    ev.data.fd = STDIN_FILENO;
+    bool useEpoll = epollFd != -1 && epoll_ctl(epollFd, EPOLL_CTL_ADD, STDIN_FILENO, &ev) == 0;
+#endif
+
+    char chunk[64 * 1024];
+    while (true) {
+        size_t start = 0;
+        size_t newline = 0;
+        while ((newline = pending.find('\n', start)) != string::npos) {
+            receiveCommandLine(pending.substr(start, newline - start));
+            start = newline + 1;
+        }
+        pending.erase(0, start);
+
+        int ready = 0;
+#if defined(__linux__)
+        if (useEpoll) {
+            struct epoll_event event;
+            ready = epoll_wait(epollFd, &event, 1, -1);
+        } else
+#endif
+        {
+            struct pollfd pfd = {STDIN_FILENO, POLLIN, 0};
+            ready = poll(&pfd, 1, -1);
+        }
+        if (ready < 0) {
+            // We're interrupted when the debugger attaches, and that's ok.
+            if (errno == EINTR) {
+                continue;
+            }
+            break;
+        }
+
+        ssize_t len = read(STDIN_FILENO, chunk, sizeof(chunk));
+        if (len < 0 && (errno == EINTR || errno == EAGAIN)) {
+            continue;
+        }
+        if (len <= 0) {
+            break;
+        }
+        pending.append(chunk, len);
+    }
+
+#if defined(__linux__)
+    if (epollFd != -1) {
+        close(epollFd);
+    }
+#endif
+#endif
+
+    spdlog::get("logger")->info("stdin closed.");
+    {
+        lock_guard<mutex> lock(commandsMtx);
+        commandsClosed = true;
+    }
+    commandsCv.notify_all();
 }
 
-void DeltaStream::flushBuffer() {
+void DeltaStream::receiveCommandLine(const string & line) {
+    if (line.find_first_not_of(" \t\r") == string::npos) {
+        return;
+    }
+
+    DeltaStreamCommand command;
+    command.receivedAt = chrono::system_clock::now();
+    try {
+        command.packet = json::parse(line);
+    } catch (json::exception & ex) {
+        spdlog::get("logger")->error("Could not parse command from stdin: {}", ex.what());
+        return;
+    }
+
+    if (commandFastPath && commandFastPath(command.packet)) {
+        return;
+    }
+    {
+        lock_guard<mutex> lock(commandsMtx);
+        commands.push_back(std::move(command));
+    }
+    commandsCv.notify_one();
+}
+
+// Blocks until a command is available. Returns false once stdin has been closed and
+// every command read before that has been returned.
+bool DeltaStream::waitForCommand(DeltaStreamCommand & command) {
+    unique_lock<mutex> lock(commandsMtx);
+    commandsCv.wait(lock, [this]() { return commandsClosed || commands.size() > 0; });
+    if (commands.size() == 0) {
+        return false;
+    }
+    command = std::move(commands.front());
+    commands.pop_front();
+    return true;
+}
+
+// Returns the next queued command without waiting, if it's of the given type.
+bool DeltaStream::nextQueuedCommand(string type, DeltaStreamCommand & command) {
+    lock_guard<mutex> lock(commandsMtx);
+    if (commands.size() == 0) {
+        return false;
+    }
+    json & packet = commands.front().packet;
+    if (!packet.count("type") || packet["type"] != type) {
+        return false;
+    }
+    command = std::move(commands.front());
+    commands.pop_front();
+    return true;
+}
+
+// Switches the format of everything written after this call. Anything already buffered
+// is written in the old format, followed by a confirmation of the change that is also
+// framed in the old format, so the client knows exactly where the new format begins.
+//
+// Models loaded before patches are enabled have no snapshot to diff against, so the
+// client keeps receiving full persist deltas for them until they're next loaded.
+void DeltaStream::setFormat(string newFormat, bool newPatches) {
+    if (newFormat != DELTA_FORMAT_JSON && newFormat != DELTA_FORMAT_CBOR && newFormat != DELTA_FORMAT_MSGPACK) {
+        spdlog::get("logger")->warn("Ignoring unsupported delta format {}", newFormat);
+        return;
+    }
+    flushBuffer();
+
+    lock_guard<mutex> lock(outputMtx);
+    json confirmation = {{"type", "delta-format"}, {"format", newFormat}, {"patches", newPatches}};
+    string out;
+    appendJSONInFormat(out, confirmation, format);
+    cout.write(out.data(), out.size());
+    cout << flush;
+    bytesWritten += out.size();
+
+#if defined(_MSC_VER)
+    // Binary frames must not have their newline bytes translated, JSON lines should be
+    _setmode(_fileno(stdout), newFormat == DELTA_FORMAT_JSON ? _O_TEXT : _O_BINARY);
+#endif
+
+    format = newFormat;
+    patches = newPatches;
+    spdlog::get("logger")->info("Delta stream format is now {} (patches: {})", format, newPatches);
+}
+
+bool DeltaStream::patchesEnabled() {
+    return patches;
+}
+
+// The client reports the total number of bytes of deltas it has read and processed.
+void DeltaStream::acknowledge(uint64_t bytes) {
     lock_guard<mutex> lock(bufferMtx);
-    for (const auto & it : buffer) {
-        for (const auto & item : it.second) {
-            cout << item.dump() + "\n";
-            cout << flush;
-        }
+    if (!acking) {
+        spdlog::get("logger")->info("Delta stream: client acknowledges output, enabling flow control.");
+        acking = true;
+    }
+    if (bytes > bytesAcked) {
+        bytesAcked = bytes;
+    }
+    dispatcherCv.notify_one();
+}
+
+bool DeltaStream::isBackpressured() {
+    return acking && bytesWritten > bytesAcked && bytesWritten - bytesAcked > DELTA_UNACKED_BYTES_WATERMARK;
+}
+
+void DeltaStream::flushBuffer() {
+    // Note: outputMtx keeps flushes in order. The buffer is swapped out so that threads
+    // emitting deltas only wait for the swap, not for serialization and the write.
+    lock_guard<mutex> outputLock(outputMtx);
+    vector<DeltaStreamItem> items;
+    chrono::system_clock::time_point firstQueuedAt;
+    {
+        lock_guard<mutex> lock(bufferMtx);
+        items.swap(buffer);
+        firstQueuedAt = bufferFirstQueuedAt;
+        bufferOpenItems = {};
+        scheduled = false;
+        stats.queued += bufferQueued;
+        stats.queueing += bufferQueueing;
+        stats.maxDepth = max(stats.maxDepth, bufferQueued);
+        stats.earlyFlushes += bufferEarlyFlushes;
+        stats.deferrals += bufferDeferrals;
+        bufferQueued = 0;
+        bufferEarlyFlushes = 0;
+        bufferDeferrals = 0;
+        lastFlushAt = chrono::system_clock::now();
+        bufferQueueing = chrono::microseconds(0);
+    }
+    if (items.size() == 0) {
+        return;
+    }
+
+    // Serialize the entire buffer and write it with a single flush
+    auto start = chrono::system_clock::now();
+    string out;
+    for (const auto & item : items) {
+        appendItemInFormat(out, item, format);
+    }
+    auto serializing = chrono::duration_cast<chrono::microseconds>(chrono::system_clock::now() - start);
+
+    cout.write(out.data(), out.size());
+    cout << flush;
+    bytesWritten += out.size();
+
+    auto latency = chrono::duration_cast<chrono::microseconds>(chrono::system_clock::now() - firstQueuedAt);
+    stats.latency += latency;
+    stats.maxLatency = max(stats.maxLatency, latency);
+
+    stats.flushes += 1;
+    stats.items += items.size();
+    stats.bytes += out.size();
+    stats.serializing += serializing;
+
+    reportIfNecessary();
+}
+
+void DeltaStream::reportIfNecessary() {
+    auto now = chrono::system_clock::now();
+    if (now - lastReport < chrono::seconds(DELTA_STATS_REPORT_INTERVAL)) {
+        return;
+    }
+    lastReport = now;
+
+    auto logger = spdlog::get("logger");
+    logger->info("Delta stream ({}): {} flushes, {} items, {}KB written, {}ms serializing",
+                 format, stats.flushes, stats.items, stats.bytes / 1024, stats.serializing.count() / 1000);
+    logger->info("- {} deltas queued, {}ms holding the buffer lock", stats.queued, stats.queueing.count() / 1000);
+    if (stats.flushes > 0) {
+        logger->info("- Queue depth: {} avg, {} max. Flush latency: {}ms avg, {}ms max. {} flushed early at max batch size.",
+                     stats.queued / stats.flushes, stats.maxDepth, stats.latency.count() / stats.flushes / 1000,
+                     stats.maxLatency.count() / 1000, stats.earlyFlushes);
     }
-    buffer = {};
-    scheduled = false;
+    if (acking) {
+        logger->info("- {}KB unacknowledged by the client, flushes deferred {} times by backpressure.",
+                     (bytesWritten - min(bytesWritten.load(), bytesAcked.load())) / 1024, stats.deferrals);
+    }
+    stats = {};
 }
 
 void DeltaStream::flushWithin(int ms) {
     std::chrono::system_clock::time_point desiredTime = std::chrono::system_clock::now();
-    desiredTime += chrono::milliseconds(ms);
     lock_guard<mutex> lock(bufferMtx);
+    desiredTime += chrono::milliseconds(min(ms, maxLatency));
 
-    if (!scheduled) {
+    if (!dispatcher) {
+        dispatcher = new std::thread([this]() {
+            SetThreadName("DeltaStreamFlush");
+            runDispatcher();
+        });
+    }
+    if (!scheduled || desiredTime < scheduledTime) {
         scheduledTime = desiredTime;
         scheduled = true;
+        dispatcherCv.notify_one();
+    }
+}
 
-        std::thread([this]() {
-            SetThreadName("DeltaStreamFlush");
-            std::unique_lock<std::mutex> lck(bufferFlushMtx);
-            bufferFlushCv.wait_until(lck, this->scheduledTime);
-            this->flushBuffer();
-        }).detach();
-    } else if (scheduled && (desiredTime < scheduledTime)) {
-        std::unique_lock<std::mutex> lck(bufferFlushMtx);
-        bufferFlushCv.notify_one();
+void DeltaStream::runDispatcher() {
+    unique_lock<mutex> lock(bufferMtx);
+    while (!stopping) {
+        if (!scheduled) {
+            dispatcherCv.wait(lock);
+            continue;
+        }
+        bool full = bufferQueued >= maxBatchSize;
+        if (!full && chrono::system_clock::now() < scheduledTime) {
+            // Note: flushWithin and queueDeltaForDelivery notify us if the deadline
+            // moves earlier or the buffer fills, so we re-check after every wakeup.
+            dispatcherCv.wait_until(lock, scheduledTime);
+            continue;
+        }
+        if (isBackpressured()) {
+            // The client is behind. Keep coalescing deltas into the buffer rather than
+            // blocking on a full stdout pipe, until it catches up or the max stall passes.
+            auto resumeAt = lastFlushAt + chrono::seconds(DELTA_BACKPRESSURE_MAX_STALL);
+            if (chrono::system_clock::now() < resumeAt) {
+                bufferDeferrals += 1;
+                dispatcherCv.wait_until(lock, resumeAt);
+                continue;
+            }
+        }
+        if (full) {
+            bufferEarlyFlushes += 1;
+        }
+        lock.unlock();
+        flushBuffer();
+        lock.lock();
     }
 }
 
-void DeltaStream::queueDeltaForDelivery(DeltaStreamItem item) {
+void DeltaStream::queueDeltaForDelivery(DeltaStreamItem && item) {
     lock_guard<mutex> lock(bufferMtx);
+    auto start = chrono::system_clock::now();
 
-    if (!buffer.count(item.modelClass)) {
-        buffer[item.modelClass] = {};
+    if (bufferQueued == 0) {
+        bufferFirstQueuedAt = start;
     }
-    if (buffer[item.modelClass].size() == 0 || !buffer[item.modelClass].back().concatenate(item)) {
-        buffer[item.modelClass].push_back(item);
+
+    auto open = bufferOpenItems.find(item.modelClass);
+    if (open == bufferOpenItems.end() || !buffer[open->second].concatenate(std::move(item))) {
+        bufferOpenItems[item.modelClass] = buffer.size();
+        buffer.push_back(std::move(item));
+    }
+
+    bufferQueued += 1;
+    bufferQueueing += chrono::duration_cast<chrono::microseconds>(chrono::system_clock::now() - start);
+
+    if (bufferQueued == maxBatchSize) {
+        dispatcherCv.notify_one();
     }
 }
 
-void DeltaStream::emit(DeltaStreamItem item, int maxDeliveryDelay) {
-    queueDeltaForDelivery(item);
+void DeltaStream::emit(DeltaStreamItem && item, int maxDeliveryDelay) {
+    queueDeltaForDelivery(std::move(item));
     flushWithin(maxDeliveryDelay);
 }
 
-void DeltaStream::emit(vector<DeltaStreamItem> items, int maxDeliveryDelay) {
-    for (const auto item : items) {
-        queueDeltaForDelivery(item);
+void DeltaStream::emit(vector<DeltaStreamItem> && items, int maxDeliveryDelay) {
+    for (auto & item : items) {
+        queueDeltaForDelivery(std::move(item));
     }
     flushWithin(maxDeliveryDelay);
 }
@@ -193,7 +544,7 @@ void DeltaStream::beginConnectionError(string accountId) {
     connectionError = true;
     vector<json> items {};
     items.push_back({{"accountId", accountId}, {"id", accountId}, {"connectionError", connectionError}});
-    emit(DeltaStreamItem("persist", "ProcessState", items), 0);
+    emit(DeltaStreamItem("persist", "ProcessState", std::move(items)), 0);
 }
 
 void DeltaStream::endConnectionError(string accountId) {
@@ -201,6 +552,6 @@ void DeltaStream::endConnectionError(string accountId) {
         connectionError = false;
         vector<json> items {};
         items.push_back({{"accountId", accountId}, {"id", accountId}, {"connectionError", connectionError}});
-        emit(DeltaStreamItem("persist", "ProcessState", items), 0);
+        emit(DeltaStreamItem("persist", "ProcessState", std::move(items)), 0);
     }
 }
@@ -19,8 +19,14 @@
 #define DeltaStream_hpp
 
 #include <stdio.h>
+#include <atomic>
+#include <chrono>
 #include <mutex>
 #include <condition_variable>
+#include <deque>
+#include <functional>
+#include <thread>
+#include <unordered_map>
 #include "MailModel.hpp"
 #include "json.hpp"
 #include "spdlog/spdlog.h"
@@ -32,45 +38,141 @@ using namespace std;
 #define DELTA_TYPE_PERSIST              "persist"
 #define DELTA_TYPE_UNPERSIST            "unpersist"
 
+// Patches contain only the keys of each model that changed since the client was last
+// sent it, plus id, aid, v and __cls. They're only emitted if the client opts in.
+#define DELTA_TYPE_PATCH                "patch"
+
+// Output formats the client can select with the `set-delta-format` command. JSON
+// writes one item per line. The binary formats write each item as a 4-byte
+// big-endian length followed by the item encoded as CBOR or MessagePack.
+#define DELTA_FORMAT_JSON               "json"
+#define DELTA_FORMAT_CBOR               "cbor"
+#define DELTA_FORMAT_MSGPACK            "msgpack"
+
+// Defaults for the dispatcher, which can be overridden with the DELTA_MAX_LATENCY_MS
+// and DELTA_MAX_BATCH_SIZE environment variables. No delta waits longer than the max
+// latency, and the buffer is flushed early once this many deltas have been queued.
+#define DELTA_DEFAULT_MAX_LATENCY_MS    1000
+#define DELTA_DEFAULT_MAX_BATCH_SIZE    2000
+
+// Once the client has acknowledged any output with `ack-deltas`, it's expected to keep
+// doing so. While more than this many bytes are unacknowledged, flushes are deferred
+// and new deltas are coalesced into the buffer, for at most the max stall.
+#define DELTA_UNACKED_BYTES_WATERMARK   1024 * 1024 * 4
+#define DELTA_BACKPRESSURE_MAX_STALL    10
+
 class DeltaStreamItem {
 public:
     string type;
     vector<json> modelJSONs;
     string modelClass;
-    map<string, size_t> idIndexes;
+    unordered_map<string, size_t> idIndexes;
     
     DeltaStreamItem(string type, string modelClass, vector<json> modelJSONs);
     DeltaStreamItem(string type, vector<shared_ptr<MailModel>> & models);
     DeltaStreamItem(string type, MailModel * model);
     
-    bool concatenate(const DeltaStreamItem & other);
-    void upsertModelJSON(const json & modelJSON);
+    bool concatenate(DeltaStreamItem && other);
+    void upsertModelJSON(json modelJSON);
+    json toJSON() const;
     string dump() const;
 };
 
+struct DeltaStreamStats {
+    uint64_t flushes;
+    uint64_t items;
+    uint64_t bytes;
+    chrono::microseconds serializing;
+    uint64_t queued;
+    chrono::microseconds queueing;
+    uint64_t maxDepth;
+    uint64_t earlyFlushes;
+    uint64_t deferrals;
+    chrono::microseconds latency;
+    chrono::microseconds maxLatency;
+};
+
+struct DeltaStreamCommand {
+    json packet;
+    std::chrono::system_clock::time_point receivedAt;
+};
+
 class DeltaStream  {
     mutex bufferMtx;
-    map<string, vector<DeltaStreamItem>> buffer;
+    mutex outputMtx;
+
+    // Items are kept in the order they were queued. New deltas are merged into the last
+    // item for their model class if it has the same type, so the client sees the same
+    // sequence of persists and unpersists, with repeated saves collapsed.
+    vector<DeltaStreamItem> buffer;
+    unordered_map<string, size_t> bufferOpenItems;
+    uint64_t bufferQueued;
+    chrono::microseconds bufferQueueing;
+    uint64_t bufferEarlyFlushes;
+    uint64_t bufferDeferrals;
+    std::chrono::system_clock::time_point bufferFirstQueuedAt;
 
     bool scheduled;
     bool connectionError;
+    string format;
+    atomic<bool> patches;
+    DeltaStreamStats stats;
+    std::chrono::system_clock::time_point lastReport;
     std::chrono::system_clock::time_point scheduledTime;
-    std::mutex bufferFlushMtx;
-    std::condition_variable bufferFlushCv;
+
+    // A single dispatcher thread sleeps until the earliest requested deadline (or until
+    // the buffer reaches maxBatchSize) and flushes. It's guarded by bufferMtx.
+    std::thread * dispatcher;
+    std::condition_variable dispatcherCv;
+    bool stopping;
+    int maxLatency;
+    size_t maxBatchSize;
+
+    // Flow control. Byte counts are cumulative since launch, so a lost or reordered
+    // ack can't leave the stream stalled.
+    atomic<bool> acking;
+    atomic<uint64_t> bytesWritten;
+    atomic<uint64_t> bytesAcked;
+    std::chrono::system_clock::time_point lastFlushAt;
+
+    bool isBackpressured();
+
+    // Commands from the client are read from stdin on a separate thread, so that the
+    // main thread can be busy running tasks without commands piling up in the pipe.
+    std::thread * commandReader;
+    std::function<bool(const json &)> commandFastPath;
+    mutex commandsMtx;
+    condition_variable commandsCv;
+    deque<DeltaStreamCommand> commands;
+    bool commandsClosed;
+
+    void runCommandReader();
+    void receiveCommandLine(const string & line);
+
+    void runDispatcher();
+    void reportIfNecessary();
 
 public:
     DeltaStream();
     ~DeltaStream();
 
-    json waitForJSON();
+    void startReadingCommands(std::function<bool(const json &)> fastPath);
+    bool waitForCommand(DeltaStreamCommand & command);
+    bool nextQueuedCommand(string type, DeltaStreamCommand & command);
+
+    void setDispatchLimits(int maxLatencyMs, size_t maxBatchSize);
+    void setFormat(string format, bool patches);
+    bool patchesEnabled();
+
+    void acknowledge(uint64_t bytes);
 
     void flushBuffer();
     void flushWithin(int ms);
     
-    void queueDeltaForDelivery(DeltaStreamItem item);
+    void queueDeltaForDelivery(DeltaStreamItem && item);
 
-    void emit(DeltaStreamItem item, int maxDeliveryDelay);
-    void emit(vector<DeltaStreamItem> items, int maxDeliveryDelay);
+    void emit(DeltaStreamItem && item, int maxDeliveryDelay);
+    void emit(vector<DeltaStreamItem> && items, int maxDeliveryDelay);
     
     void beginConnectionError(string accountId);
     void endConnectionError(string accountId);
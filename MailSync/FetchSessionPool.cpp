@@ -0,0 +1,144 @@
+//
+//  FetchSessionPool.cpp
+//  MailSync
+//
+//  Copyright © 2017 Foundry 376. All rights reserved.
+//
+//  Use of this file is subject to the terms and conditions defined
+//  in 'LICENSE.md', which is part of the Mailspring-Sync package.
+//
+
+#include "FetchSessionPool.hpp"
+#include "MailUtils.hpp"
+#include "ProgressCollectors.hpp"
+#include "SyncException.hpp"
+#include "constants.h"
+
+using namespace std::chrono;
+
+// FetchPoolJob
+
+FetchPoolJob::FetchPoolJob(string path, IndexSet * uids, IMAPMessagesRequestKind kind) :
+    path(path), uids(uids), kind(kind), done(false), messages(nullptr), err(ErrorNone)
+{
+    uids->retain();
+}
+
+FetchPoolJob::~FetchPoolJob() {
+    MC_SAFE_RELEASE(uids);
+    MC_SAFE_RELEASE(messages);
+}
+
+// FetchSessionPool
+
+FetchSessionPool::FetchSessionPool(shared_ptr<Account> account, int size) :
+    account(account), logger(spdlog::get("logger")), stopping(false)
+{
+    for (int ii = 0; ii < size; ii ++) {
+        threads.push_back(new std::thread([this, ii]() {
+            runWorker(ii);
+        }));
+    }
+    logger->info("Fetching with {} additional IMAP connections.", size);
+}
+
+FetchSessionPool::~FetchSessionPool() {
+    {
+        lock_guard<mutex> lock(mtx);
+        stopping = true;
+        pending = {};
+    }
+    jobsCv.notify_all();
+    for (auto thread : threads) {
+        thread->join();
+        delete thread;
+    }
+}
+
+int FetchSessionPool::size() {
+    return (int)threads.size();
+}
+
+shared_ptr<FetchPoolJob> FetchSessionPool::enqueue(string path, IndexSet * uids, IMAPMessagesRequestKind kind) {
+    auto job = make_shared<FetchPoolJob>(path, uids, kind);
+    {
+        lock_guard<mutex> lock(mtx);
+        pending.push_back(job);
+    }
+    jobsCv.notify_one();
+    return job;
+}
+
+// Blocks until the job has been fetched and returns the messages, autoreleased on
+// the calling thread. If the fetch failed, err is set and the result is nullptr.
+Array * FetchSessionPool::waitFor(shared_ptr<FetchPoolJob> job, ErrorCode * err) {
+    unique_lock<mutex> lock(mtx);
+    resultsCv.wait(lock, [job]() { return job->done; });
+    *err = job->err;
+    if (job->messages == nullptr) {
+        return nullptr;
+    }
+    job->messages->retain();
+    job->messages->autorelease();
+    return job->messages;
+}
+
+void FetchSessionPool::runWorker(int index) {
+    IMAPSession session;
+    bool configured = false;
+
+    while (true) {
+        shared_ptr<FetchPoolJob> job = nullptr;
+        {
+            unique_lock<mutex> lock(mtx);
+            jobsCv.wait(lock, [this]() { return stopping || pending.size() > 0; });
+            if (stopping) {
+                return;
+            }
+            job = pending.front();
+            pending.pop_front();
+        }
+
+        // Note: if the caller has given up on the job (eg: it failed to fetch an
+        // earlier chunk and threw), we hold the only reference. Skip it.
+        if (job.use_count() == 1) {
+            continue;
+        }
+
+        AutoreleasePool pool;
+        ErrorCode err = ErrorNone;
+        Array * messages = nullptr;
+        auto start = system_clock::now();
+
+        try {
+            // Note: for XOAuth2 accounts this refreshes the access token if it has expired,
+            // so we run it before each fetch, just as the SyncWorker does each sync loop.
+            if (!configured || account->refreshToken() != "") {
+                MailUtils::configureSessionForAccount(session, account);
+                configured = true;
+            }
+            IMAPProgress cb;
+            String path(AS_MCSTR(job->path));
+            messages = session.fetchMessagesByUID(&path, job->kind, job->uids, &cb, &err);
+        } catch (SyncException & ex) {
+            logger->error("FetchSessionPool: connection {} could not be configured: {} {}", index, ex.key, ex.debuginfo);
+            err = ErrorConnection;
+        }
+
+        if (err == ErrorNone) {
+            long long ms = duration_cast<milliseconds>(system_clock::now() - start).count();
+            logger->info("FetchSessionPool: connection {} fetched {} messages from {} in {}ms", index, messages->count(), job->path, ms);
+        } else {
+            messages = nullptr;
+        }
+
+        {
+            lock_guard<mutex> lock(mtx);
+            job->err = err;
+            job->messages = messages;
+            MC_SAFE_RETAIN(job->messages);
+            job->done = true;
+        }
+        resultsCv.notify_all();
+    }
+}
@@ -0,0 +1,79 @@
+//
+//  FetchSessionPool.hpp
+//  MailSync
+//
+//  Copyright © 2017 Foundry 376. All rights reserved.
+//
+//  Use of this file is subject to the terms and conditions defined
+//  in 'LICENSE.md', which is part of the Mailspring-Sync package.
+//
+
+/*
+ The FetchSessionPool runs a fixed number of additional IMAP connections for an
+ account, each on its own thread, which fetch message headers on behalf of the
+ background SyncWorker. This is opt-in via the account's `imap_fetch_connections`
+ setting, because some servers limit the number of simultaneous connections.
+
+ The pool never touches the MailStore. The SyncWorker enqueues fetches and then
+ waits for the results in order, so all writes still happen on its own thread
+ while the remaining connections keep fetching.
+*/
+#ifndef FetchSessionPool_hpp
+#define FetchSessionPool_hpp
+
+#include <stdio.h>
+#include <condition_variable>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <MailCore/MailCore.h>
+
+#include "Account.hpp"
+#include "spdlog/spdlog.h"
+
+using namespace mailcore;
+using namespace std;
+
+class FetchPoolJob {
+public:
+    string path;
+    IndexSet * uids;
+    IMAPMessagesRequestKind kind;
+
+    bool done;
+    Array * messages;
+    ErrorCode err;
+
+    FetchPoolJob(string path, IndexSet * uids, IMAPMessagesRequestKind kind);
+    ~FetchPoolJob();
+};
+
+class FetchSessionPool {
+    shared_ptr<Account> account;
+    shared_ptr<spdlog::logger> logger;
+
+    vector<std::thread *> threads;
+    mutex mtx;
+    condition_variable jobsCv;
+    condition_variable resultsCv;
+    deque<shared_ptr<FetchPoolJob>> pending;
+    bool stopping;
+
+    void runWorker(int index);
+
+public:
+    FetchSessionPool(shared_ptr<Account> account, int size);
+    ~FetchSessionPool();
+
+    int size();
+
+    shared_ptr<FetchPoolJob> enqueue(string path, IndexSet * uids, IMAPMessagesRequestKind kind);
+
+    Array * waitFor(shared_ptr<FetchPoolJob> job, ErrorCode * err);
+};
+
+#endif /* FetchSessionPool_hpp */
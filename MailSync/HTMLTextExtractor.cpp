@@ -0,0 +1,459 @@
+//
+//  HTMLTextExtractor.cpp
+//  MailSync
+//
+//  Copyright © 2017 Foundry 376. All rights reserved.
+//
+//  Use of this file is subject to the terms and conditions defined
+//  in 'LICENSE.md', which is part of the Mailspring-Sync package.
+//
+
+#include "HTMLTextExtractor.hpp"
+
+#include <string.h>
+#include <unordered_map>
+#include <unordered_set>
+
+// Elements that flattenHTML separates from the surrounding text with a line break.
+static const unordered_set<string> BREAKING_TAGS = {
+    "address", "article", "aside", "blockquote", "br", "center", "col", "colgroup", "dd",
+    "div", "dl", "dt", "footer", "form", "h1", "h2", "h3", "h4", "h5", "h6", "header", "hr",
+    "li", "main", "nav", "ol", "p", "pre", "section", "table", "tbody", "td", "tfoot", "th",
+    "thead", "tr", "ul",
+};
+
+// Elements whose content is never visible. (flattenHTML skips the whole <head>, but the
+// only other things found there produce no text.)
+static const unordered_set<string> HIDDEN_TAGS = {
+    "script", "style", "title",
+};
+
+static const unordered_map<string, uint32_t> NAMED_ENTITIES = {
+    {"nbsp", 160}, {"amp", 38}, {"lt", 60}, {"gt", 62}, {"quot", 34}, {"apos", 39},
+    {"copy", 169}, {"reg", 174}, {"trade", 8482}, {"mdash", 8212}, {"ndash", 8211},
+    {"hellip", 8230}, {"lsquo", 8216}, {"rsquo", 8217}, {"ldquo", 8220}, {"rdquo", 8221},
+    {"sbquo", 8218}, {"bdquo", 8222}, {"laquo", 171}, {"raquo", 187}, {"bull", 8226},
+    {"middot", 183}, {"euro", 8364}, {"pound", 163}, {"yen", 165}, {"cent", 162},
+    {"deg", 176}, {"times", 215}, {"divide", 247}, {"plusmn", 177}, {"sect", 167},
+    {"para", 182}, {"iexcl", 161}, {"iquest", 191}, {"frac12", 189}, {"frac14", 188},
+    {"frac34", 190}, {"ensp", 8194}, {"emsp", 8195}, {"thinsp", 8201}, {"zwnj", 8204},
+    {"zwj", 8205}, {"shy", 173}, {"rarr", 8594}, {"larr", 8592}, {"hearts", 9829},
+    {"Agrave", 192}, {"Aacute", 193}, {"Acirc", 194}, {"Atilde", 195}, {"Auml", 196},
+    {"Aring", 197}, {"AElig", 198}, {"Ccedil", 199}, {"Egrave", 200}, {"Eacute", 201},
+    {"Ecirc", 202}, {"Euml", 203}, {"Igrave", 204}, {"Iacute", 205}, {"Icirc", 206},
+    {"Iuml", 207}, {"Ntilde", 209}, {"Ograve", 210}, {"Oacute", 211}, {"Ocirc", 212},
+    {"Otilde", 213}, {"Ouml", 214}, {"Oslash", 216}, {"Ugrave", 217}, {"Uacute", 218},
+    {"Ucirc", 219}, {"Uuml", 220}, {"Yacute", 221}, {"szlig", 223}, {"agrave", 224},
+    {"aacute", 225}, {"acirc", 226}, {"atilde", 227}, {"auml", 228}, {"aring", 229},
+    {"aelig", 230}, {"ccedil", 231}, {"egrave", 232}, {"eacute", 233}, {"ecirc", 234},
+    {"euml", 235}, {"igrave", 236}, {"iacute", 237}, {"icirc", 238}, {"iuml", 239},
+    {"ntilde", 241}, {"ograve", 242}, {"oacute", 243}, {"ocirc", 244}, {"otilde", 245},
+    {"ouml", 246}, {"oslash", 248}, {"ugrave", 249}, {"uacute", 250}, {"ucirc", 251},
+    {"uuml", 252}, {"yacute", 253}, {"yuml", 255},
+};
+
+static bool isAlpha(char c) {
+    return (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z');
+}
+
+static bool isAlnum(char c) {
+    return isAlpha(c) || (c >= '0' && c <= '9');
+}
+
+static bool isSpace(char c) {
+    return c == ' ' || c == '\t' || c == '\n' || c == '\r' || c == '\f';
+}
+
+static char lower(char c) {
+    return (c >= 'A' && c <= 'Z') ? (c - 'A' + 'a') : c;
+}
+
+// Decodes the UTF-8 sequence at p, returning its length. Invalid sequences are
+// consumed one byte at a time and decode to U+FFFD.
+static size_t decodeUTF8(const char * p, const char * end, uint32_t * codepoint) {
+    unsigned char c = (unsigned char)p[0];
+    size_t len = 0;
+    uint32_t cp = 0;
+    uint32_t min = 0;
+
+    if (c < 0x80) {
+        *codepoint = c;
+        return 1;
+    } else if ((c & 0xE0) == 0xC0) {
+        len = 2; cp = c & 0x1F; min = 0x80;
+    } else if ((c & 0xF0) == 0xE0) {
+        len = 3; cp = c & 0x0F; min = 0x800;
+    } else if ((c & 0xF8) == 0xF0) {
+        len = 4; cp = c & 0x07; min = 0x10000;
+    }
+    if (len == 0 || (size_t)(end - p) < len) {
+        *codepoint = 0xFFFD;
+        return 1;
+    }
+    for (size_t ii = 1; ii < len; ii ++) {
+        unsigned char cc = (unsigned char)p[ii];
+        if ((cc & 0xC0) != 0x80) {
+            *codepoint = 0xFFFD;
+            return 1;
+        }
+        cp = (cp << 6) | (cc & 0x3F);
+    }
+    if (cp < min || cp > 0x10FFFF || (cp >= 0xD800 && cp <= 0xDFFF)) {
+        *codepoint = 0xFFFD;
+        return 1;
+    }
+    *codepoint = cp;
+    return len;
+}
+
+HTMLTextExtractor::HTMLTextExtractor(const string & input, size_t maxLength) :
+    pos(input.data()), end(input.data() + input.size()), maxLength(maxLength), length(0), pendingSpace(false)
+{
+    result.reserve(min(input.size(), maxLength * 2));
+}
+
+string HTMLTextExtractor::textFromHTML(const string & html, size_t maxLength) {
+    HTMLTextExtractor extractor{html, maxLength};
+    extractor.extractHTML();
+    return extractor.result;
+}
+
+string HTMLTextExtractor::textFromPlaintext(const string & text, size_t maxLength) {
+    HTMLTextExtractor extractor{text, maxLength};
+    extractor.extractPlaintext();
+    return extractor.result;
+}
+
+bool HTMLTextExtractor::full() {
+    return length >= maxLength;
+}
+
+void HTMLTextExtractor::appendSpace() {
+    // Note: the space is only written when it's followed by more text, which
+    // trims whitespace from both ends of the result.
+    if (result.size() > 0) {
+        pendingSpace = true;
+    }
+}
+
+void HTMLTextExtractor::appendUTF8(const char * bytes, size_t count) {
+    if (full()) {
+        return;
+    }
+    if (pendingSpace) {
+        pendingSpace = false;
+        if (length + 1 >= maxLength) {
+            length = maxLength;
+            return;
+        }
+        result.push_back(' ');
+        length ++;
+    }
+    result.append(bytes, count);
+    length ++;
+}
+
+void HTMLTextExtractor::appendCodepoint(uint32_t c) {
+    // Note: this is the set of characters stripWhitespace turns into spaces.
+    if (c == ' ' || c == '\t' || c == '\n' || c == '\r' || c == '\f' || c == '\v' || c == 0x85 || c == 0xA0 || c == 0x2028 || c == 0x2029) {
+        appendSpace();
+        return;
+    }
+    // Drop control characters and the invisible characters marketing emails use to pad
+    // their preview text, which would otherwise fill the snippet with nothing.
+    if (c < 0x20 || c == 0x7F || c == 0xAD || c == 0x34F || (c >= 0x200B && c <= 0x200F) || c == 0x2060 || c == 0xFEFF) {
+        return;
+    }
+
+    char buf[4];
+    size_t count;
+    if (c < 0x80) {
+        buf[0] = (char)c;
+        count = 1;
+    } else if (c < 0x800) {
+        buf[0] = (char)(0xC0 | (c >> 6));
+        buf[1] = (char)(0x80 | (c & 0x3F));
+        count = 2;
+    } else if (c < 0x10000) {
+        buf[0] = (char)(0xE0 | (c >> 12));
+        buf[1] = (char)(0x80 | ((c >> 6) & 0x3F));
+        buf[2] = (char)(0x80 | (c & 0x3F));
+        count = 3;
+    } else {
+        buf[0] = (char)(0xF0 | (c >> 18));
+        buf[1] = (char)(0x80 | ((c >> 12) & 0x3F));
+        buf[2] = (char)(0x80 | ((c >> 6) & 0x3F));
+        buf[3] = (char)(0x80 | (c & 0x3F));
+        count = 4;
+    }
+    appendUTF8(buf, count);
+}
+
+void HTMLTextExtractor::appendText(const string & text) {
+    const char * p = text.data();
+    const char * e = text.data() + text.size();
+    while (p < e && !full()) {
+        uint32_t c;
+        p += decodeUTF8(p, e, &c);
+        appendCodepoint(c);
+    }
+}
+
+// Decodes the character reference at p (which points to the '&') and advances p past
+// it. Returns false and leaves p alone if it isn't a complete reference we recognize.
+bool HTMLTextExtractor::readEntity(const char *& p, uint32_t * codepoint) {
+    const char * q = p + 1;
+
+    if (q < end && *q == '#') {
+        q ++;
+        bool hex = (q < end && (*q == 'x' || *q == 'X'));
+        if (hex) {
+            q ++;
+        }
+        // Note: all of the digits are consumed, however many there are. Once the value is
+        // out of range we stop accumulating it, and the reference decodes to U+FFFD.
+        uint32_t value = 0;
+        int digits = 0;
+        while (q < end) {
+            char c = *q;
+            uint32_t digit;
+            if (c >= '0' && c <= '9') {
+                digit = c - '0';
+            } else if (hex && lower(c) >= 'a' && lower(c) <= 'f') {
+                digit = lower(c) - 'a' + 10;
+            } else {
+                break;
+            }
+            if (value <= 0x10FFFF) {
+                value = value * (hex ? 16 : 10) + digit;
+            }
+            digits ++;
+            q ++;
+        }
+        if (digits == 0) {
+            return false;
+        }
+        if (q < end && *q == ';') {
+            q ++;
+        }
+        if (value == 0 || value > 0x10FFFF || (value >= 0xD800 && value <= 0xDFFF)) {
+            value = 0xFFFD;
+        }
+        *codepoint = value;
+        p = q;
+        return true;
+    }
+
+    const char * nameStart = q;
+    while (q < end && isAlnum(*q) && q - nameStart < 10) {
+        q ++;
+    }
+    if (q == nameStart || q >= end || *q != ';') {
+        return false;
+    }
+    auto it = NAMED_ENTITIES.find(string(nameStart, q - nameStart));
+    if (it == NAMED_ENTITIES.end()) {
+        return false;
+    }
+    *codepoint = it->second;
+    p = q + 1;
+    return true;
+}
+
+// Reads the tag at pos (which points to the '<') and advances pos past it, skipping
+// the content of hidden elements and keeping track of links.
+void HTMLTextExtractor::readTag() {
+    const char * p = pos + 1;
+
+    if (p < end && (*p == '!' || *p == '?')) {
+        if (end - p >= 3 && p[1] == '-' && p[2] == '-') {
+            const char * close = p + 3;
+            while (close + 2 < end && !(close[0] == '-' && close[1] == '-' && close[2] == '>')) {
+                close ++;
+            }
+            pos = (close + 2 < end) ? close + 3 : end;
+        } else {
+            const char * close = (const char *)memchr(p, '>', end - p);
+            pos = close ? close + 1 : end;
+        }
+        return;
+    }
+
+    bool closing = false;
+    if (p < end && *p == '/') {
+        closing = true;
+        p ++;
+    }
+    if (p >= end || !isAlpha(*p)) {
+        // Not a tag, just a "<" in the text.
+        appendCodepoint('<');
+        pos ++;
+        return;
+    }
+
+    string name;
+    while (p < end && (isAlnum(*p) || *p == ':' || *p == '-')) {
+        name.push_back(lower(*p));
+        p ++;
+    }
+
+    // Find the end of the tag. A ">" inside a quoted attribute value doesn't count.
+    const char * attrs = p;
+    char quote = 0;
+    char last = 0;
+    while (p < end && (quote || *p != '>')) {
+        if (quote) {
+            if (*p == quote) {
+                quote = 0;
+            }
+        } else if ((*p == '"' || *p == '\'') && last == '=') {
+            quote = *p;
+        }
+        if (!isSpace(*p)) {
+            last = *p;
+        }
+        p ++;
+    }
+    const char * attrsEnd = p;
+    pos = (p < end) ? p + 1 : end;
+
+    if (HIDDEN_TAGS.count(name)) {
+        if (!closing) {
+            skipToClosingTag(name);
+        }
+        return;
+    }
+
+    if (name == "a") {
+        if (!closing) {
+            links.push_back({hrefOf(attrs, attrsEnd), result.size()});
+        } else if (links.size() > 0) {
+            auto link = links.back();
+            links.pop_back();
+
+            // Like flattenHTML, append the target unless the link had no text or its text
+            // was the target itself.
+            string & href = link.first;
+            bool hadText = result.size() != link.second;
+            bool endsWithHref = result.size() >= href.size() && result.compare(result.size() - href.size(), href.size(), href) == 0;
+            if (href.size() > 0 && hadText && !endsWithHref) {
+                appendSpace();
+                appendCodepoint('(');
+                appendText(href);
+                appendCodepoint(')');
+                appendSpace();
+            }
+        }
+        return;
+    }
+
+    if (BREAKING_TAGS.count(name)) {
+        appendSpace();
+    }
+}
+
+// Returns the decoded value of the href attribute in the tag attributes [p, e).
+string HTMLTextExtractor::hrefOf(const char * p, const char * e) {
+    while (p + 4 <= e) {
+        // Note: p[-1] is always safe to read, since the attributes follow the tag name.
+        bool match = isSpace(p[-1]) && lower(p[0]) == 'h' && lower(p[1]) == 'r' && lower(p[2]) == 'e' && lower(p[3]) == 'f';
+        if (!match) {
+            p ++;
+            continue;
+        }
+        const char * q = p + 4;
+        while (q < e && isSpace(*q)) {
+            q ++;
+        }
+        if (q >= e || *q != '=') {
+            p ++;
+            continue;
+        }
+        q ++;
+        while (q < e && isSpace(*q)) {
+            q ++;
+        }
+        const char * valueEnd;
+        if (q < e && (*q == '"' || *q == '\'')) {
+            char quote = *q;
+            q ++;
+            valueEnd = q;
+            while (valueEnd < e && *valueEnd != quote) {
+                valueEnd ++;
+            }
+        } else {
+            // Unquoted values end at whitespace or the end of the tag.
+            valueEnd = q;
+            while (valueEnd < e && !isSpace(*valueEnd) && *valueEnd != '>') {
+                valueEnd ++;
+            }
+        }
+
+        string value;
+        while (q < valueEnd) {
+            uint32_t c;
+            if (*q == '&' && readEntity(q, &c) && c < 0x80) {
+                value.push_back((char)c);
+            } else {
+                value.push_back(*q);
+                q ++;
+            }
+        }
+        return value;
+    }
+    return "";
+}
+
+void HTMLTextExtractor::skipToClosingTag(const string & name) {
+    const char * p = pos;
+    while (p < end) {
+        p = (const char *)memchr(p, '<', end - p);
+        if (p == nullptr) {
+            break;
+        }
+        if ((size_t)(end - p) > name.size() + 2 && p[1] == '/') {
+            bool match = true;
+            for (size_t ii = 0; ii < name.size(); ii ++) {
+                if (lower(p[2 + ii]) != name[ii]) {
+                    match = false;
+                    break;
+                }
+            }
+            if (match && !isAlnum(p[2 + name.size()])) {
+                pos = p;
+                return;
+            }
+        }
+        p ++;
+    }
+    // Note: like a browser, an unclosed <script> or <style> hides the rest of the document.
+    pos = end;
+}
+
+void HTMLTextExtractor::extractHTML() {
+    while (pos < end && !full()) {
+        char c = *pos;
+        if (c == '<') {
+            readTag();
+        } else if (c == '&') {
+            uint32_t codepoint;
+            if (!readEntity(pos, &codepoint)) {
+                codepoint = '&';
+                pos ++;
+            }
+            appendCodepoint(codepoint);
+        } else {
+            uint32_t codepoint;
+            pos += decodeUTF8(pos, end, &codepoint);
+            appendCodepoint(codepoint);
+        }
+    }
+}
+
+void HTMLTextExtractor::extractPlaintext() {
+    while (pos < end && !full()) {
+        uint32_t codepoint;
+        pos += decodeUTF8(pos, end, &codepoint);
+        appendCodepoint(codepoint);
+    }
+}
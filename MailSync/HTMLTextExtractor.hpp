@@ -0,0 +1,68 @@
+//
+//  HTMLTextExtractor.hpp
+//  MailSync
+//
+//  Copyright © 2017 Foundry 376. All rights reserved.
+//
+//  Use of this file is subject to the terms and conditions defined
+//  in 'LICENSE.md', which is part of the Mailspring-Sync package.
+//
+
+/*
+ The HTMLTextExtractor produces the plain text of a message body for its snippet
+ and its search index entry. It replaces `String::flattenHTML()->stripWhitespace()`,
+ which cleans the entire document with tidy, parses it with libxml and converts it
+ to and from UTF-16 - even though we only want the first few hundred characters.
+
+ The extractor makes a single pass over the UTF-8 bytes and stops as soon as it has
+ `maxLength` characters. It doesn't build a DOM: tags are skipped, <style>, <script>
+ and <title> are skipped to their closing tag, block elements and <br> become spaces,
+ entities are decoded and runs of whitespace are collapsed, which matches the output
+ of flattenHTML + stripWhitespace for the markup found in email. As with flattenHTML,
+ the target of a link is appended after its text, eg: "Unsubscribe (https://...)".
+*/
+#ifndef HTMLTextExtractor_hpp
+#define HTMLTextExtractor_hpp
+
+#include <stdio.h>
+#include <stdint.h>
+#include <string>
+#include <vector>
+
+using namespace std;
+
+class HTMLTextExtractor {
+    const char * pos;
+    const char * end;
+    size_t maxLength;
+
+    string result;
+    size_t length;
+    bool pendingSpace;
+    vector<pair<string, size_t>> links;
+
+    HTMLTextExtractor(const string & input, size_t maxLength);
+
+    bool full();
+    void appendSpace();
+    void appendCodepoint(uint32_t c);
+    void appendUTF8(const char * bytes, size_t count);
+    void appendText(const string & text);
+
+    bool readEntity(const char *& p, uint32_t * codepoint);
+    void readTag();
+    string hrefOf(const char * attrs, const char * attrsEnd);
+    void skipToClosingTag(const string & name);
+
+    void extractHTML();
+    void extractPlaintext();
+
+public:
+    // Returns up to `maxLength` characters of the visible text of `html`.
+    static string textFromHTML(const string & html, size_t maxLength);
+
+    // Returns up to `maxLength` characters of `text` with whitespace collapsed.
+    static string textFromPlaintext(const string & text, size_t maxLength);
+};
+
+#endif /* HTMLTextExtractor_hpp */
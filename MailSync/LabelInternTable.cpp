@@ -0,0 +1,93 @@
+//
+//  LabelInternTable.cpp
+//  MailSync
+//
+//  Copyright © 2017 Foundry 376. All rights reserved.
+//
+//  Use of this file is subject to the terms and conditions defined
+//  in 'LICENSE.md', which is part of the Mailspring-Sync package.
+//
+
+#include "LabelInternTable.hpp"
+#include "MailUtils.hpp"
+
+#include <algorithm>
+#include <map>
+
+// Singleton Implementation
+
+mutex _globalLabelTablesMtx;
+map<string, shared_ptr<LabelInternTable>> _globalLabelTables;
+
+shared_ptr<LabelInternTable> SharedLabelInternTable(string accountId) {
+    lock_guard<mutex> lock(_globalLabelTablesMtx);
+    auto & table = _globalLabelTables[accountId];
+    if (table == nullptr) {
+        table = make_shared<LabelInternTable>();
+    }
+    return table;
+}
+
+// LabelInternTable
+
+uint32_t LabelInternTable::idFor(const string & name) {
+    lock_guard<mutex> lock(mtx);
+    auto it = ids.find(name);
+    if (it != ids.end()) {
+        return it->second;
+    }
+    uint32_t id = (uint32_t)names.size();
+    ids[name] = id;
+    names.push_back(name);
+    return id;
+}
+
+string LabelInternTable::nameFor(uint32_t id) {
+    lock_guard<mutex> lock(mtx);
+    return names[id];
+}
+
+// Returns the sorted set of IDs for a JSON array of label names
+vector<uint32_t> LabelInternTable::idsFor(const json & labelNames) {
+    vector<uint32_t> result{};
+    if (!labelNames.is_array()) {
+        return result;
+    }
+    result.reserve(labelNames.size());
+    for (const auto & name : labelNames) {
+        result.push_back(idFor(name.get<string>()));
+    }
+    sort(result.begin(), result.end());
+    return result;
+}
+
+// Returns a JSON array of the label names, sorted by name as they're stored in
+// Message.remoteXGMLabels.
+json LabelInternTable::namesFor(const vector<uint32_t> & labelIds) {
+    vector<string> result{};
+    result.reserve(labelIds.size());
+    for (auto id : labelIds) {
+        result.push_back(nameFor(id));
+    }
+    sort(result.begin(), result.end());
+    return json(result);
+}
+
+// LabelLookup
+
+LabelLookup::LabelLookup(string accountId, vector<shared_ptr<Label>> allLabels) :
+    table(SharedLabelInternTable(accountId)), allLabels(allLabels)
+{
+}
+
+shared_ptr<Label> LabelLookup::labelForId(uint32_t id) {
+    if (id >= resolved.size()) {
+        labels.resize(id + 1);
+        resolved.resize(id + 1, false);
+    }
+    if (!resolved[id]) {
+        labels[id] = MailUtils::labelForXGMLabelName(table->nameFor(id), allLabels);
+        resolved[id] = true;
+    }
+    return labels[id];
+}
@@ -0,0 +1,68 @@
+//
+//  LabelInternTable.hpp
+//  MailSync
+//
+//  Copyright © 2017 Foundry 376. All rights reserved.
+//
+//  Use of this file is subject to the terms and conditions defined
+//  in 'LICENSE.md', which is part of the Mailspring-Sync package.
+//
+
+/*
+ Gmail reports the labels on each message as a list of X-GM-LABELS strings.
+ The LabelInternTable assigns each distinct string a small integer the first
+ time it's seen (per account), so message attributes can be compared and thread
+ label counts can be updated using sorted integer sets instead of strings.
+
+ IDs are never reused or removed and are only meaningful within this process.
+
+ The LabelLookup resolves interned IDs to Label models. It's owned by a MailStore
+ (so it's single-threaded) and remembers each result, so the fairly expensive
+ MailUtils::labelForXGMLabelName matching runs once per label instead of once per
+ label per message.
+*/
+#ifndef LabelInternTable_hpp
+#define LabelInternTable_hpp
+
+#include <stdio.h>
+#include <memory>
+#include <mutex>
+#include <unordered_map>
+#include <vector>
+#include <string>
+
+#include "json.hpp"
+#include "Label.hpp"
+
+using namespace nlohmann;
+using namespace std;
+
+class LabelInternTable {
+    mutex mtx;
+    unordered_map<string, uint32_t> ids;
+    vector<string> names;
+
+public:
+    uint32_t idFor(const string & name);
+    string nameFor(uint32_t id);
+
+    vector<uint32_t> idsFor(const json & names);
+    json namesFor(const vector<uint32_t> & ids);
+};
+
+shared_ptr<LabelInternTable> SharedLabelInternTable(string accountId);
+
+
+class LabelLookup {
+    shared_ptr<LabelInternTable> table;
+    vector<shared_ptr<Label>> allLabels;
+    vector<shared_ptr<Label>> labels;
+    vector<bool> resolved;
+
+public:
+    LabelLookup(string accountId, vector<shared_ptr<Label>> allLabels);
+
+    shared_ptr<Label> labelForId(uint32_t id);
+};
+
+#endif /* LabelInternTable_hpp */
@@ -13,6 +13,8 @@
 #include "MailStoreTransaction.hpp"
 #include "MailUtils.hpp"
 #include "File.hpp"
+#include "HTMLTextExtractor.hpp"
+#include "ThreadSearchIndexer.hpp"
 #include "constants.h"
 
 #if defined(_MSC_VER)
@@ -24,6 +26,8 @@
 using namespace std;
 using nlohmann::json;
 
+#define SNIPPET_LENGTH  400
+
 class CleanHTMLBodyRendererTemplateCallback : public Object, public HTMLRendererTemplateCallback {
     mailcore::String * templateForMainHeader(MessageHeader * header) {
         return MCSTR("");
@@ -65,14 +69,6 @@ class CleanHTMLBodyRendererTemplateCallback : public Object, public HTMLRenderer
 //    }
 };
 
-string stringByAppendingOrSkipping(string input, string val) {
-    auto valWithSpace = " " + val;
-    if (input.find(valWithSpace) != std::string::npos) {
-        return input;
-    }
-    return input + valWithSpace;
-}
-
 MailProcessor::MailProcessor(shared_ptr<Account> account, MailStore * store) :
     store(store),
     account(account),
@@ -112,38 +108,11 @@ shared_ptr<Message> MailProcessor::insertMessage(IMAPMessage * mMsg, Folder & fo
         MailStoreTransaction transaction{store, "insertMessage"};
 
         // Find the correct thread
-
-        if (mMsg->gmailThreadID()) {
-            Query query = Query().equal("gThrId", to_string(mMsg->gmailThreadID()));
-            thread = store->find<Thread>(query);
-            
-        } else if (!mMsg->header()->isMessageIDAutoGenerated()) {
-            // find an existing thread using the references. Note - a rouge client could
-            // throw a lot of shit in here, limit the number of refs we look at to 50.
-            // TODO: It appears we should technically use the first 1 and then last 49.
-            int refcount = min(50, (int)references->count());
-            SQLite::Statement tQuery(store->db(), "SELECT Thread.* FROM Thread INNER JOIN ThreadReference ON ThreadReference.threadId = Thread.id WHERE ThreadReference.accountId = ? AND ThreadReference.headerMessageId IN (" + MailUtils::qmarks(1 + refcount) + ") LIMIT 1");
-            tQuery.bind(1, msg->accountId());
-            tQuery.bind(2, msg->headerMessageId());
-            for (int i = 0; i < refcount; i ++) {
-                String * ref = (String *)references->objectAtIndex(i);
-                tQuery.bind(3 + i, ref->UTF8Characters());
-            }
-            if (tQuery.executeStep()) {
-                thread = make_shared<Thread>(tQuery);
-            }
-        }
-        
-        if (thread == nullptr) {
-            // TODO: could move to message save hooks
-            thread = make_shared<Thread>(msg->id(), account->id(), msg->subject(), mMsg->gmailThreadID());
-        }
-        
+        thread = findOrCreateThreadForMessage(mMsg, msg.get(), references);
         msg->setThreadId(thread->id());
 
-        // Index the thread metadata for search. We only do this once and it'd
-        // be costly to make it part of the save hooks.
-        appendToThreadSearchContent(thread.get(), msg.get(), nullptr);
+        // Give the thread a search entry. Its content is written by the ThreadSearchIndexer.
+        createThreadSearchEntry(thread.get());
         store->save(thread.get());
 
         // Save the message - this will automatically find and update the counters
@@ -153,6 +122,8 @@ shared_ptr<Message> MailProcessor::insertMessage(IMAPMessage * mMsg, Folder & fo
         // Make the thread accessible by all of the message references
         upsertThreadReferences(thread->id(), thread->accountId(), msg->headerMessageId(), references);
 
+        QueueThreadsForSearchIndexing(store, account->id(), {thread->id()});
+
         transaction.commit();
     }
 
@@ -167,6 +138,220 @@ shared_ptr<Message> MailProcessor::insertMessage(IMAPMessage * mMsg, Folder & fo
     return msg;
 }
 
+// `prepared`, if provided, holds the Message models already built from each of the
+// IMAPMessages (eg: on the sync pipeline's parse thread) so they aren't built again here.
+vector<shared_ptr<Message>> MailProcessor::insertMessages(vector<IMAPMessage *> & mMsgs, Folder & folder, time_t syncDataTimestamp, vector<shared_ptr<Message>> * prepared) {
+    if (mMsgs.size() == 0) {
+        return {};
+    }
+    try {
+        return insertMessagesBatch(mMsgs, folder, syncDataTimestamp, prepared);
+    } catch (const SQLite::Exception & ex) {
+        if (ex.getErrorCode() != 19) { // constraint failed
+            throw;
+        }
+    }
+
+    // One or more of the messages already exists (it moved between folders, or another
+    // worker inserted it alongside us). The batch has been rolled back - process the
+    // messages individually so each one is inserted or updated as necessary.
+    logger->info("- Batch insert of {} messages found existing messages, falling back to individual upserts", mMsgs.size());
+
+    vector<shared_ptr<Message>> results{};
+    for (auto mMsg : mMsgs) {
+        results.push_back(insertFallbackToUpdateMessage(mMsg, folder, syncDataTimestamp));
+    }
+    return results;
+}
+
+vector<shared_ptr<Message>> MailProcessor::insertOrUpdateMessages(vector<IMAPMessage *> & mMsgs, Folder & folder, time_t syncDataTimestamp, vector<shared_ptr<Message>> * prepared) {
+    if (mMsgs.size() == 0) {
+        return {};
+    }
+
+    // Find out which of these messages we already have with one query, rather than
+    // attempting to insert each one and waiting for a constraint failure. During deep
+    // scans and UIDVALIDITY recovery nearly all of them already exist.
+    vector<string> ids{};
+    ids.reserve(mMsgs.size());
+    for (size_t ii = 0; ii < mMsgs.size(); ii ++) {
+        ids.push_back(prepared ? prepared->at(ii)->id() : MailUtils::idForMessage(folder.accountId(), folder.path(), mMsgs[ii]));
+    }
+
+    map<string, shared_ptr<Message>> existing{};
+    for (auto & local : store->findLargeSet<Message>("id", ids)) {
+        existing[local->id()] = local;
+    }
+
+    vector<shared_ptr<Message>> results{};
+    vector<IMAPMessage *> toInsert{};
+    vector<shared_ptr<Message>> toInsertPrepared{};
+
+    for (size_t ii = 0; ii < mMsgs.size(); ii ++) {
+        auto it = existing.find(ids[ii]);
+        if (it == existing.end()) {
+            toInsert.push_back(mMsgs[ii]);
+            if (prepared) {
+                toInsertPrepared.push_back(prepared->at(ii));
+            }
+            continue;
+        }
+        // Found message with an existing ID. Update it's attributes & folderId.
+        // Note: Could potentially have moved from another folder!
+        updateMessage(it->second.get(), mMsgs[ii], folder, syncDataTimestamp);
+        results.push_back(it->second);
+    }
+
+    // Note: insertMessages still falls back to individual upserts if another worker
+    // inserted one of these messages since we looked.
+    auto inserted = insertMessages(toInsert, folder, syncDataTimestamp, prepared ? &toInsertPrepared : nullptr);
+    results.insert(results.end(), inserted.begin(), inserted.end());
+    return results;
+}
+
+vector<shared_ptr<Message>> MailProcessor::insertMessagesBatch(vector<IMAPMessage *> & mMsgs, Folder & folder, time_t syncDataTimestamp, vector<shared_ptr<Message>> * prepared) {
+    vector<shared_ptr<Message>> msgs{};
+    vector<shared_ptr<Thread>> threads{};
+
+    // Threads created or loaded during this batch, so that several messages in the
+    // same thread share (and save) one Thread instance.
+    map<string, shared_ptr<Thread>> threadsById{};
+    map<string, shared_ptr<Thread>> threadsByGThrId{};
+    map<string, shared_ptr<Thread>> threadsByHeaderMessageId{};
+
+    {
+        MailStoreTransaction transaction{store, "insertMessages"};
+        auto labelLookup = store->labelLookup(account->id());
+
+        for (size_t ii = 0; ii < mMsgs.size(); ii ++) {
+            IMAPMessage * mMsg = mMsgs[ii];
+            shared_ptr<Message> msg = prepared ? prepared->at(ii) : make_shared<Message>(mMsg, folder, syncDataTimestamp);
+            shared_ptr<Thread> thread = nullptr;
+
+            Array * references = mMsg->header()->references();
+            if (references == nullptr) {
+                references = new Array();
+                references->autorelease();
+            }
+
+            // Find the correct thread, looking at the ones created in this batch first
+            // since they have not been written to the database yet.
+            string gThrId = mMsg->gmailThreadID() ? to_string(mMsg->gmailThreadID()) : "";
+            if (gThrId != "") {
+                if (threadsByGThrId.count(gThrId)) {
+                    thread = threadsByGThrId[gThrId];
+                }
+            } else if (!mMsg->header()->isMessageIDAutoGenerated()) {
+                if (threadsByHeaderMessageId.count(msg->headerMessageId())) {
+                    thread = threadsByHeaderMessageId[msg->headerMessageId()];
+                }
+                for (int i = 0; thread == nullptr && i < min(50, (int)references->count()); i ++) {
+                    string ref = ((String *)references->objectAtIndex(i))->UTF8Characters();
+                    if (threadsByHeaderMessageId.count(ref)) {
+                        thread = threadsByHeaderMessageId[ref];
+                    }
+                }
+            }
+            if (thread == nullptr) {
+                thread = findOrCreateThreadForMessage(mMsg, msg.get(), references);
+                if (threadsById.count(thread->id())) {
+                    thread = threadsById[thread->id()];
+                } else {
+                    threadsById[thread->id()] = thread;
+                    threads.push_back(thread);
+                }
+            }
+            if (gThrId != "") {
+                threadsByGThrId[gThrId] = thread;
+            }
+            threadsByHeaderMessageId[msg->headerMessageId()] = thread;
+            for (int i = 0; i < min(100, (int)references->count()); i ++) {
+                threadsByHeaderMessageId[((String *)references->objectAtIndex(i))->UTF8Characters()] = thread;
+            }
+
+            msg->setThreadId(thread->id());
+
+            // Give the thread a search entry and apply the message's attributes
+            // (counters, folders, labels, participants) to the in-memory thread.
+            createThreadSearchEntry(thread.get());
+            msg->applyAttributeChangesToThread(thread.get(), *labelLookup);
+
+            // Make the thread accessible by all of the message references
+            upsertThreadReferences(thread->id(), thread->accountId(), msg->headerMessageId(), references);
+
+            msgs.push_back(msg);
+        }
+
+        // Write each thread once, then the messages. The messages have already been
+        // applied to their threads above, so skip the per-message thread update.
+        vector<MailModel *> threadModels{};
+        vector<string> threadIds{};
+        for (auto & thread : threads) {
+            threadModels.push_back(thread.get());
+            threadIds.push_back(thread->id());
+        }
+        store->saveAll(threadModels);
+        QueueThreadsForSearchIndexing(store, account->id(), threadIds);
+
+        vector<MailModel *> msgModels{};
+        for (auto & msg : msgs) {
+            msg->_skipThreadUpdatesAfterSave = true;
+            msgModels.push_back(msg.get());
+        }
+        store->saveAll(msgModels);
+        for (auto & msg : msgs) {
+            msg->_skipThreadUpdatesAfterSave = false;
+        }
+
+        transaction.commit();
+    }
+
+    {
+        // Index contacts for autocomplete. We do this separately in a transaction that does not
+        // emit any deltas, since the client doesn't need to be bothered with contacts changes.
+        MailStoreTransaction transaction{store, "insertMessages:contacts"};
+        for (auto & msg : msgs) {
+            upsertContacts(msg.get());
+        }
+        store->unsafeEraseTransactionDeltas();
+        transaction.commit();
+    }
+
+    return msgs;
+}
+
+shared_ptr<Thread> MailProcessor::findOrCreateThreadForMessage(IMAPMessage * mMsg, Message * msg, Array * references) {
+    shared_ptr<Thread> thread = nullptr;
+
+    if (mMsg->gmailThreadID()) {
+        Query query = Query().equal("gThrId", to_string(mMsg->gmailThreadID()));
+        thread = store->find<Thread>(query);
+        
+    } else if (!mMsg->header()->isMessageIDAutoGenerated()) {
+        // find an existing thread using the references. Note - a rouge client could
+        // throw a lot of shit in here, limit the number of refs we look at to 50.
+        // TODO: It appears we should technically use the first 1 and then last 49.
+        int refcount = min(50, (int)references->count());
+        store->flushThreadWriteBack();
+        SQLite::Statement tQuery(store->db(), "SELECT Thread.* FROM Thread INNER JOIN ThreadReference ON ThreadReference.threadId = Thread.id WHERE ThreadReference.accountId = ? AND ThreadReference.headerMessageId IN (" + MailUtils::qmarks(1 + refcount) + ") LIMIT 1");
+        tQuery.bind(1, msg->accountId());
+        tQuery.bind(2, msg->headerMessageId());
+        for (int i = 0; i < refcount; i ++) {
+            String * ref = (String *)references->objectAtIndex(i);
+            tQuery.bind(3 + i, ref->UTF8Characters());
+        }
+        if (tQuery.executeStep()) {
+            thread = make_shared<Thread>(tQuery);
+        }
+    }
+    
+    if (thread == nullptr) {
+        // TODO: could move to message save hooks
+        thread = make_shared<Thread>(msg->id(), account->id(), msg->subject(), mMsg->gmailThreadID());
+    }
+    return thread;
+}
+
 void MailProcessor::updateMessage(Message * local, IMAPMessage * remote, Folder & folder, time_t syncDataTimestamp)
 {
     if (local->syncedAt() > syncDataTimestamp) {
@@ -174,10 +359,9 @@ void MailProcessor::updateMessage(Message * local, IMAPMessage * remote, Folder
         return;
     }
     
-    auto updated = MessageAttributesForMessage(remote);
-    auto jlabels = json(updated.labels);
+    auto updated = MessageAttributesForMessage(remote, folder.accountId());
+
 
-    
     bool noChanges = true;
     if (updated.unread != local->isUnread()) {
         if (noChanges) logger->info("- Updating message {}", local->id());
@@ -204,9 +388,9 @@ void MailProcessor::updateMessage(Message * local, IMAPMessage * remote, Folder
         logger->info("-- FolderID ({} to {})", local->remoteFolderId(), folder.id());
         noChanges = false;
     }
-    if (jlabels != local->remoteXGMLabels()) {
+    if (updated.labelIds != local->remoteXGMLabelIds()) {
         if (noChanges) logger->info("- Updating message {}", local->id());
-        logger->info("-- XGMLabels ({} to {})", local->remoteXGMLabels().dump(), jlabels.dump());
+        logger->info("-- XGMLabels ({} to {})", local->remoteXGMLabels().dump(), SharedLabelInternTable(folder.accountId())->namesFor(updated.labelIds).dump());
         noChanges = false;
     }
 
@@ -214,6 +398,8 @@ void MailProcessor::updateMessage(Message * local, IMAPMessage * remote, Folder
         return;
     }
 
+    auto jlabels = SharedLabelInternTable(folder.accountId())->namesFor(updated.labelIds);
+
     {
         MailStoreTransaction transaction{store, "updateMessage"};
     
@@ -246,16 +432,19 @@ void MailProcessor::retrievedMessageBody(Message * message, MessageParser * pars
     // times to retrieve attachments, relatedAttachments, message HTML separately. The code seems to build
     // and discard things you don't ask for.
     String * html = parser->htmlRenderingAndAttachments(htmlCallback, partAttachments, htmlInlineAttachments);
-    String * text = html;
+    string snippet;
     
     if (html->hasPrefix(MCSTR("PLAINTEXT:"))) {
-        text = html->substringFromIndex(10);
+        String * text = html->substringFromIndex(10);
         bodyRepresentation = text->UTF8Characters();
         bodyIsPlaintext = true;
+        snippet = text->substringToIndex(SNIPPET_LENGTH)->UTF8Characters();
     } else {
-        text = html->flattenHTML()->stripWhitespace();
+        // Note: we only need the first few hundred characters of text for the snippet,
+        // so we don't flatten the whole document. (See HTMLTextExtractor.hpp)
         bodyRepresentation = html->UTF8Characters();
         bodyIsPlaintext = false;
+        snippet = HTMLTextExtractor::textFromHTML(bodyRepresentation, SNIPPET_LENGTH);
     }
     MC_SAFE_RELEASE(htmlCallback);
 
@@ -307,10 +496,14 @@ void MailProcessor::retrievedMessageBody(Message * message, MessageParser * pars
         MailStoreTransaction transaction{store, "retrievedMessageBody"};
         
         // write body to the MessageBodies table
-        SQLite::Statement insert(store->db(), "REPLACE INTO MessageBody (id, value, fetchedAt) VALUES (?, ?, datetime('now'))");
-        insert.bind(1, message->id());
-        insert.bind(2, bodyRepresentation);
-        insert.exec();
+        auto insert = store->cachedStatement("REPLACE INTO MessageBody (id, value, fetchedAt) VALUES (?, ?, datetime('now'))");
+        insert->bind(1, message->id());
+        insert->bind(2, bodyRepresentation);
+        insert->exec();
+
+        auto dequeue = store->cachedStatement("DELETE FROM BodyFetchQueue WHERE id = ?");
+        dequeue->bind(1, message->id());
+        dequeue->exec();
         
         // write files to the files table
         
@@ -325,14 +518,11 @@ void MailProcessor::retrievedMessageBody(Message * message, MessageParser * pars
             }
         }
         
-        // append the body text to the thread's FTS5 search index
-        auto thread = store->find<Thread>(Query().equal("id", message->threadId()));
-        if (thread.get() != nullptr) {
-            appendToThreadSearchContent(thread.get(), nullptr, text);
-        }
+        // queue the thread to be re-indexed with the body text
+        QueueThreadsForSearchIndexing(store, account->id(), {message->threadId()});
 
         // write the message snippet. This also gives us the database trigger!
-        message->setSnippet(text->substringToIndex(400)->UTF8Characters());
+        message->setSnippet(snippet);
         message->setPlaintext(bodyIsPlaintext);
         message->setBodyForDispatch(bodyRepresentation);
         message->setFiles(files);
@@ -435,83 +625,36 @@ void MailProcessor::deleteMessagesStillUnlinkedFromPhase(int phase)
     }
 }
 
-void MailProcessor::appendToThreadSearchContent(Thread * thread, Message * messageToAppendOrNull, String * bodyToAppendOrNull) {
-    string to = "";
-    string from = "";
-    string categories = thread->categoriesSearchString();
-    string body = "";
-    
-    // retrieve the current index if there is one
+// Inserts an empty ThreadSearch row for a new thread, so it has a rowid the ThreadSearchIndexer
+// can update. This must happen before the thread is saved, so the rowid is saved with it.
+void MailProcessor::createThreadSearchEntry(Thread * thread) {
     if (thread->searchRowId()) {
-        SQLite::Statement existing(store->db(), "SELECT to_, from_, body FROM ThreadSearch WHERE rowid = ?");
-        existing.bind(1, (double)thread->searchRowId());
-        if (existing.executeStep()) {
-            to = existing.getColumn("to_").getString();
-            from = existing.getColumn("from_").getString();
-            body = existing.getColumn("body").getString();
-        }
-    }
-    
-    if (messageToAppendOrNull != nullptr) {
-        for (auto c : messageToAppendOrNull->to()) {
-            if (c.count("email")) { to = stringByAppendingOrSkipping(to, c["email"].get<string>()); }
-            if (c.count("name")) { to = stringByAppendingOrSkipping(to, c["name"].get<string>()); }
-        }
-        for (auto c : messageToAppendOrNull->cc()) {
-            if (c.count("email")) { to = stringByAppendingOrSkipping(to, c["email"].get<string>()); }
-            if (c.count("name")) { to = stringByAppendingOrSkipping(to, c["name"].get<string>()); }
-        }
-        for (auto c : messageToAppendOrNull->bcc()) {
-            if (c.count("email")) { to = stringByAppendingOrSkipping(to, c["email"].get<string>()); }
-            if (c.count("name")) { to = stringByAppendingOrSkipping(to, c["name"].get<string>()); }
-        }
-        for (auto c : messageToAppendOrNull->from()) {
-            if (c.count("email")) { from = stringByAppendingOrSkipping(from, c["email"].get<string>()); }
-            if (c.count("name")) { from = stringByAppendingOrSkipping(from, c["name"].get<string>()); }
-        }
-    }
-    
-    if (bodyToAppendOrNull != nullptr) {
-        body = body + " " + bodyToAppendOrNull->substringToIndex(5000)->UTF8Characters();
-    }
-    
-    if (thread->searchRowId()) {
-        SQLite::Statement update(store->db(), "UPDATE ThreadSearch SET to_ = ?, from_ = ?, body = ?, categories = ? WHERE rowid = ?");
-        update.bind(1, to);
-        update.bind(2, from);
-        update.bind(3, body);
-        update.bind(4, categories);
-        update.bind(5, (double)thread->searchRowId());
-        update.exec();
-    } else {
-        SQLite::Statement insert(store->db(), "INSERT INTO ThreadSearch (subject, to_, from_, body, categories, content_id) VALUES (?, ?, ?, ?, ?, ?)");
-        insert.bind(1, thread->subject());
-        insert.bind(2, to);
-        insert.bind(3, from);
-        insert.bind(4, body);
-        insert.bind(5, categories);
-        insert.bind(6, thread->id());
-        insert.exec();
-        thread->setSearchRowId(store->db().getLastInsertRowid());
+        return;
     }
+    auto insert = store->cachedStatement("INSERT INTO ThreadSearchContent (subject, to_, from_, body, categories, content_id) VALUES (?, '', '', '', ?, ?)");
+    insert->bind(1, thread->subject());
+    insert->bind(2, thread->categoriesSearchString());
+    insert->bind(3, thread->id());
+    insert->exec();
+    thread->setSearchRowId(store->db().getLastInsertRowid());
 }
 
 void MailProcessor::upsertThreadReferences(string threadId, string accountId, string headerMessageId, Array * references) {
-    SQLite::Statement query(store->db(), "INSERT OR IGNORE INTO ThreadReference (threadId, accountId, headerMessageId) VALUES (?,?,?)");
-    query.bind(1, threadId);
-    query.bind(2, accountId);
-    query.bind(3, headerMessageId);
-    query.exec();
-    query.reset();
+    auto query = store->cachedStatement("INSERT OR IGNORE INTO ThreadReference (threadId, accountId, headerMessageId) VALUES (?,?,?)");
+    query->bind(1, threadId);
+    query->bind(2, accountId);
+    query->bind(3, headerMessageId);
+    query->exec();
+    query->reset();
 
     // todo: technically, we should look at the first reference (Start of thread)
     // and then the last N, where N is some number we give a shit about, but we've
     // rarely seen more than 100 items.
     for (int i = 0; i < min(100, (int)references->count()); i ++) {
         String * address = (String*)references->objectAtIndex(i);
-        query.bind(3, address->UTF8Characters());
-        query.exec();
-        query.reset(); // does not clear bindings 1 and 2! https://sqlite.org/c3ref/reset.html
+        query->bind(3, address->UTF8Characters());
+        query->exec();
+        query->reset(); // does not clear bindings 1 and 2! https://sqlite.org/c3ref/reset.html
     }
 }
 
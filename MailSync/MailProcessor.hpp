@@ -40,6 +40,8 @@ public:
     MailProcessor(shared_ptr<Account> account, MailStore * store);
     shared_ptr<Message> insertFallbackToUpdateMessage(IMAPMessage * mMsg, Folder & folder, time_t syncDataTimestamp);
     shared_ptr<Message> insertMessage(IMAPMessage * mMsg, Folder & folder, time_t syncDataTimestamp);
+    vector<shared_ptr<Message>> insertMessages(vector<IMAPMessage *> & mMsgs, Folder & folder, time_t syncDataTimestamp, vector<shared_ptr<Message>> * prepared = nullptr);
+    vector<shared_ptr<Message>> insertOrUpdateMessages(vector<IMAPMessage *> & mMsgs, Folder & folder, time_t syncDataTimestamp, vector<shared_ptr<Message>> * prepared = nullptr);
     void updateMessage(Message * local, IMAPMessage * remote, Folder & folder, time_t syncDataTimestamp);
     void retrievedMessageBody(Message * message, MessageParser * parser);
     bool retrievedFileData(File * file, Data * data);
@@ -47,7 +49,9 @@ public:
     void deleteMessagesStillUnlinkedFromPhase(int phase);
     
 private:
-    void appendToThreadSearchContent(Thread * thread, Message * messageToAppendOrNull, String * bodyToAppendOrNull);
+    vector<shared_ptr<Message>> insertMessagesBatch(vector<IMAPMessage *> & mMsgs, Folder & folder, time_t syncDataTimestamp, vector<shared_ptr<Message>> * prepared);
+    shared_ptr<Thread> findOrCreateThreadForMessage(IMAPMessage * mMsg, Message * msg, Array * references);
+    void createThreadSearchEntry(Thread * thread);
     void upsertThreadReferences(string threadId, string accountId, string headerMessageId, Array * references);
     void upsertContacts(Message * message);
     shared_ptr<Label> labelForXGMLabelName(string mlname);
@@ -23,6 +23,7 @@ using namespace mailcore;
 using namespace std;
 
 std::atomic<int> globalLabelsVersion {1};
+std::atomic<int> globalRollbackVersion {1};
 
 #pragma mark Metadata
 
@@ -39,17 +40,18 @@ Metadata MetadataFromJSON(const json & metadata) {
 
 #pragma mark MessageAttributes
 
-MessageAttributes MessageAttributesForMessage(IMAPMessage * msg) {
+MessageAttributes MessageAttributesForMessage(IMAPMessage * msg, string accountId) {
     auto m = MessageAttributes{};
     m.uid = msg->uid();
     m.unread = bool(!(msg->flags() & MessageFlagSeen));
     m.starred = bool(msg->flags() & MessageFlagFlagged);
-    m.labels = std::vector<std::string>{};
+    m.labelIds = std::vector<uint32_t>{};
     
     Array * labels = msg->gmailLabels();
     bool draftLabelPresent = false;
     bool trashSpamLabelPresent = false;
     if (labels != nullptr) {
+        auto table = SharedLabelInternTable(accountId);
         for (unsigned int ii = 0; ii < labels->count(); ii ++) {
             string str = ((String *)labels->objectAtIndex(ii))->UTF8Characters();
             // Gmail exposes Trash and Spam as folders and labels. We want them
@@ -61,9 +63,9 @@ MessageAttributes MessageAttributesForMessage(IMAPMessage * msg) {
             if ((str == "\\Draft")) {
                 draftLabelPresent = true;
             }
-            m.labels.push_back(str);
+            m.labelIds.push_back(table->idFor(str));
         }
-        sort(m.labels.begin(), m.labels.end());
+        sort(m.labelIds.begin(), m.labelIds.end());
     }
     
     m.draft = (bool(msg->flags() & MessageFlagDraft) || draftLabelPresent) && !trashSpamLabelPresent;
@@ -72,7 +74,7 @@ MessageAttributes MessageAttributesForMessage(IMAPMessage * msg) {
 }
 
 bool MessageAttributesMatch(MessageAttributes a, MessageAttributes b) {
-    return a.unread == b.unread && a.starred == b.starred && a.uid == b.uid && a.labels == b.labels;
+    return a.unread == b.unread && a.starred == b.starred && a.uid == b.uid && a.labelIds == b.labelIds;
 }
 
 
@@ -83,9 +85,15 @@ MailStore::MailStore() :
     _stmtBeginTransaction(_db, "BEGIN IMMEDIATE TRANSACTION"),
     _stmtRollbackTransaction(_db, "ROLLBACK"),
     _stmtCommitTransaction(_db, "COMMIT"),
+    _transactionOpen(false),
+    _transactionDeltasSealed(0),
+    _interactiveWriter(false),
+    _holdingWriterLock(false),
+    _statements(_db, 64),
     _owningThread(spdlog::details::os::thread_id()),
     _labelCacheVersion(0),
-    _labelCache()
+    _labelCache(),
+    _labelLookupVersion(0)
 {
     _db.setBusyTimeout(10 * 1000);
     
@@ -100,10 +108,19 @@ MailStore::MailStore() :
     SQLite::Statement(_db, "PRAGMA main.synchronous = NORMAL").exec();
 }
 
-static int CURRENT_VERSION = 8;
+static int CURRENT_VERSION = 10;
 static string VACUUM_TIME_KEY = "VACUUM_TIME";
 static time_t VACUUM_INTERVAL = 14 * 24 * 60 * 60; // 14 days
 
+static long long _databaseSize(SQLite::Database & db) {
+    SQLite::Statement count(db, "PRAGMA page_count");
+    SQLite::Statement size(db, "PRAGMA page_size");
+    if (!count.executeStep() || !size.executeStep()) {
+        return 0;
+    }
+    return count.getColumn(0).getInt64() * size.getColumn(0).getInt64();
+}
+
 void MailStore::migrate() {
     SQLite::Statement uv(_db, "PRAGMA user_version");
     uv.executeStep();
@@ -150,6 +167,29 @@ void MailStore::migrate() {
             SQLite::Statement(_db, sql).exec();
         }
     }
+    if (version < 9) {
+        // Moves the search index to external content. Every thread is re-indexed by the
+        // ThreadSearchIndexer when sync starts. VACUUM now to release the old content.
+        // Note: the content table only holds word lists, so FTS5's 'rebuild' and
+        // 'integrity-check' must never be run on ThreadSearch (see V9_SETUP_QUERIES).
+        // Re-indexing is done by setting Thread.isSearchIndexed = 0 instead.
+        cout << "\nRunning " << verb;
+        cout.flush();
+        auto start = chrono::system_clock::now();
+        for (string sql : V9_SETUP_QUERIES) {
+            SQLite::Statement(_db, sql).exec();
+        }
+        if (version > 0) {
+            saveKeyValue(VACUUM_TIME_KEY, "0");
+        }
+        cout << "\nMoved search index to external content in " << chrono::duration_cast<chrono::milliseconds>(chrono::system_clock::now() - start).count() << "ms";
+        cout.flush();
+    }
+    if (version < 10) {
+        for (string sql : V10_SETUP_QUERIES) {
+            SQLite::Statement(_db, sql).exec();
+        }
+    }
     
     // Update the version flag. Note that we don't want to go from v3 back to v2
     // if the user re-opens an older version of the app.
@@ -172,7 +212,10 @@ void MailStore::migrate() {
         saveKeyValue(VACUUM_TIME_KEY, to_string(time(0)));
         
         try {
+            long long sizeBefore = _databaseSize(_db);
             SQLite::Statement(_db, "VACUUM").exec();
+            cout << "\nVacuum complete: " << sizeBefore / 1048576 << "MB to " << _databaseSize(_db) / 1048576 << "MB\n";
+            cout.flush();
         } catch (std::exception & ex) {
             // Vacuuming can fail if we run out of disk space and isn't mandatory,
             // so we fail silently and still return 0 to allow the app to launch.
@@ -208,6 +251,8 @@ void MailStore::resetForAccount(string accountId) {
     // reset the metadata stream cursor so we re-fetch metadata on resync
     saveKeyValue("cursor-" + accountId, "0");
 
+    SharedMessageAttributesCache()->invalidateAll();
+
     SQLite::Statement(_db, "VACUUM").exec();
 }
 
@@ -216,73 +261,110 @@ SQLite::Database & MailStore::db()
     return this->_db;
 }
 
-map<uint32_t, MessageAttributes> MailStore::fetchMessagesAttributesInRange(Range range, Folder & folder) {
+// Returns a prepared statement for the SQL, reusing the one from the last time
+// the same SQL was run on this connection if possible. The statement is reset
+// when the returned pointer is released.
+shared_ptr<SQLite::Statement> MailStore::cachedStatement(const string & sql)
+{
     assertCorrectThread();
-    SQLite::Statement query(this->_db, "SELECT id, unread, starred, remoteUID, remoteXGMLabels FROM Message WHERE accountId = ? AND remoteFolderId = ? AND remoteUID >= ? AND remoteUID <= ?");
-    query.bind(1, folder.accountId());
-    query.bind(2, folder.id());
-    query.bind(3, (long long)(range.location));
-    
+    return _statements.get(sql);
+}
+
+MessageAttributesSet MailStore::fetchMessagesAttributesInRange(Range range, Folder & folder) {
+    assertCorrectThread();
+
     // Range is uint64_t, and "*" is represented by UINT64_MAX.
-    // SQLite doesn't support UINT64 and the conversion /can/ fail.
-    if (range.length == UINT64_MAX) {
-        query.bind(4, LLONG_MAX);
-    } else {
-        query.bind(4, (long long)(range.location + range.length));
+    uint32_t minUID = (uint32_t)min(range.location, (uint64_t)UINT32_MAX);
+    uint32_t maxUID = UINT32_MAX;
+    if (range.length != UINT64_MAX) {
+        maxUID = (uint32_t)min(range.location + range.length, (uint64_t)UINT32_MAX);
+    }
+
+    auto cache = SharedMessageAttributesCache();
+    MessageAttributesSet results;
+    if (cache->sliceOfFolder(folder.id(), minUID, maxUID, results)) {
+        return results;
     }
 
-    map<uint32_t, MessageAttributes> results {};
+    // We haven't looked at this folder yet - read the entire folder once and keep it.
+    // From now on it's kept up to date by the Message save hooks.
+    uint64_t version = cache->versionOfFolder(folder.id());
 
+    SQLite::Statement query(this->_db, "SELECT unread, starred, remoteUID, remoteXGMLabels FROM Message WHERE accountId = ? AND remoteFolderId = ? ORDER BY remoteUID ASC");
+    query.bind(1, folder.accountId());
+    query.bind(2, folder.id());
+
+    auto labels = SharedLabelInternTable(folder.accountId());
+    MessageAttributesSet all;
     while (query.executeStep()) {
-        MessageAttributes attrs{};
         uint32_t uid = (uint32_t)query.getColumn("remoteUID").getInt64();
-        attrs.uid = uid;
-        attrs.starred = query.getColumn("starred").getInt() != 0;
-        attrs.unread = query.getColumn("unread").getInt() != 0;
-        
-        vector<string> labels{};
-        for (const auto i : json::parse(query.getColumn("remoteXGMLabels").getString())) {
-            labels.push_back(i.get<string>());
+        if (!MessageAttributesCache::isCachedUID(uid)) {
+            continue;
         }
-        attrs.labels = labels;
+        uint8_t flags = 0;
+        if (query.getColumn("unread").getInt() != 0) flags |= MESSAGE_ATTRIBUTE_UNREAD;
+        if (query.getColumn("starred").getInt() != 0) flags |= MESSAGE_ATTRIBUTE_STARRED;
 
-        results[uid] = attrs;
+        auto labelIds = labels->idsFor(json::parse(query.getColumn("remoteXGMLabels").getString()));
+        all.upsert(uid, flags, cache->labelSetIdFor(labelIds));
     }
-    
+
+    results = all.slice(minUID, maxUID);
+    cache->installFolder(folder.id(), all, version);
     return results;
 }
 
+// Called from the Message save hooks with the message's previous remote location
+// and the message, or nullptr if the message was deleted.
+void MailStore::updateMessageAttributesCache(string previousFolderId, uint32_t previousUID, Message * message) {
+    MessageAttributesChange change {previousFolderId, previousUID, "", 0, 0, 0};
+    if (message != nullptr) {
+        change.folderId = message->remoteFolderId();
+        change.uid = message->remoteUID();
+        change.flags = (message->isUnread() ? MESSAGE_ATTRIBUTE_UNREAD : 0) | (message->isStarred() ? MESSAGE_ATTRIBUTE_STARRED : 0);
+
+        change.labelSet = SharedMessageAttributesCache()->labelSetIdFor(message->remoteXGMLabelIds());
+    }
+
+    // Changes made in a transaction are applied when it commits, so the cache never
+    // reflects rows other connections can't see yet (or rows we roll back.)
+    if (_transactionOpen) {
+        _transactionAttributeChanges.push_back(change);
+    } else {
+        vector<MessageAttributesChange> changes {change};
+        SharedMessageAttributesCache()->applyChanges(changes);
+    }
+}
+
 uint32_t MailStore::fetchMessageUIDAtDepth(Folder & folder, uint32_t depth, uint32_t before) {
     assertCorrectThread();
-    SQLite::Statement query(this->_db, "SELECT remoteUID FROM Message WHERE accountId = ? AND remoteFolderId = ? AND remoteUID < ? ORDER BY remoteUID DESC LIMIT 1 OFFSET ?");
-    query.bind(1, folder.accountId());
-    query.bind(2, folder.id());
-    query.bind(3, before);
-    query.bind(4, depth);
-    if (query.executeStep()) {
-        return query.getColumn("remoteUID").getUInt();
+    auto query = cachedStatement("SELECT remoteUID FROM Message WHERE accountId = ? AND remoteFolderId = ? AND remoteUID < ? ORDER BY remoteUID DESC LIMIT 1 OFFSET ?");
+    query->bind(1, folder.accountId());
+    query->bind(2, folder.id());
+    query->bind(3, before);
+    query->bind(4, depth);
+    if (query->executeStep()) {
+        return query->getColumn("remoteUID").getUInt();
     }
-    query.reset();
     return 1;
 }
 
 string MailStore::getKeyValue(string key) {
     assertCorrectThread();
-    SQLite::Statement query(this->_db, "SELECT value FROM _State WHERE id = ?");
-    query.bind(1, key);
-    if (query.executeStep()) {
-        return query.getColumn(0).getString();
+    auto query = cachedStatement("SELECT value FROM _State WHERE id = ?");
+    query->bind(1, key);
+    if (query->executeStep()) {
+        return query->getColumn(0).getString();
     }
-    query.reset();
     return "";
 }
 
 void MailStore::saveKeyValue(string key, string value) {
     assertCorrectThread();
-    SQLite::Statement query(this->_db, "REPLACE INTO _State (id, value) VALUES (?, ?)");
-    query.bind(1, key);
-    query.bind(2, value);
-    query.exec();
+    auto query = cachedStatement("REPLACE INTO _State (id, value) VALUES (?, ?)");
+    query->bind(1, key);
+    query->bind(2, value);
+    query->exec();
 }
 
 vector<shared_ptr<Label>> MailStore::allLabelsCache(string accountId) {
@@ -294,23 +376,179 @@ vector<shared_ptr<Label>> MailStore::allLabelsCache(string accountId) {
     return _labelCache;
 }
 
+shared_ptr<LabelLookup> MailStore::labelLookup(string accountId) {
+    if (_labelLookupVersion != globalLabelsVersion) {
+        _labelLookup = make_shared<LabelLookup>(accountId, allLabelsCache(accountId));
+        _labelLookupVersion = globalLabelsVersion;
+    }
+    return _labelLookup;
+}
+
+// Thread Write-Back
+//
+// Every message saved in a transaction used to load, update and save its thread,
+// so syncing a 50-message thread parsed and rewrote the thread (and its
+// ThreadCategory and ThreadCounts rows) 50 times. Within a transaction, threads
+// requested here are kept in memory and accumulate the message attribute changes,
+// and each dirty thread is saved once before the transaction commits.
+//
+// Note: Any other read of the Thread table that could return a dirty thread flushes
+// the dirty threads first, and
+// saving or removing a different instance of a thread drops ours, so callers never
+// see stale rows and writes land in the same order they did without the cache.
+
+shared_ptr<Thread> MailStore::findThreadForWriteBack(string threadId) {
+    if (!_transactionOpen) {
+        return find<Thread>(Query().equal("id", threadId));
+    }
+    auto it = _transactionThreads.find(threadId);
+    if (it != _transactionThreads.end()) {
+        return it->second;
+    }
+    auto thread = find<Thread>(Query().equal("id", threadId));
+    if (thread != nullptr) {
+        _transactionThreads[threadId] = thread;
+    }
+    return thread;
+}
+
+void MailStore::saveThreadWriteBack(shared_ptr<Thread> thread) {
+    if (!_transactionOpen || !_transactionThreads.count(thread->id())) {
+        save(thread.get());
+        return;
+    }
+    _transactionDirtyThreadIds.insert(thread->id());
+}
+
+void MailStore::flushThreadWriteBack() {
+    if (_transactionDirtyThreadIds.size() == 0) {
+        return;
+    }
+    // Note: saving a thread may read the Thread table, which calls back into this method.
+    set<string> dirtyIds{};
+    swap(dirtyIds, _transactionDirtyThreadIds);
+    for (auto & id : dirtyIds) {
+        save(_transactionThreads[id].get());
+    }
+}
+
+void MailStore::_willReadTable(const string & tableName, Query * query) {
+    if (_transactionDirtyThreadIds.size() == 0 || tableName != Thread::TABLE_NAME) {
+        return;
+    }
+    // Looking up threads by id only needs a flush if one of them is dirty. This is the
+    // common case during sync, where we look up the thread of each message we save.
+    vector<string> ids{};
+    if (query != nullptr && query->isLookupById(ids)) {
+        bool dirty = false;
+        for (auto & id : ids) {
+            if (_transactionDirtyThreadIds.count(id)) {
+                dirty = true;
+                break;
+            }
+        }
+        if (!dirty) {
+            return;
+        }
+    }
+    flushThreadWriteBack();
+}
+
+void MailStore::_willWriteThread(MailModel * model) {
+    flushThreadWriteBack();
+    auto it = _transactionThreads.find(model->id());
+    if (it != _transactionThreads.end() && it->second.get() != model) {
+        _transactionThreads.erase(it);
+    }
+}
+
+// Interactive writers (the main thread running client tasks, the foreground worker)
+// begin their transactions before any background writer that is waiting.
+void MailStore::setInteractiveWriter(bool interactive) {
+    _interactiveWriter = interactive;
+}
+
 void MailStore::beginTransaction() {
     assertCorrectThread();
-    _stmtBeginTransaction.exec();
-    _stmtBeginTransaction.reset();
+    if (_transactionOpen) {
+        // Note: the thread write-back cache is flushed so that it only holds changes made
+        // inside the savepoint, and can be dropped if the savepoint is rolled back. Deltas
+        // queued before the savepoint are sealed so nothing inside it is merged into them.
+        flushThreadWriteBack();
+        _savepoints.push_back({_transactionDeltas.size(), _transactionDeltasSealed, _transactionAttributeChanges.size()});
+        _transactionDeltasSealed = _transactionDeltas.size();
+        _db.exec("SAVEPOINT nested" + to_string(_savepoints.size()));
+        return;
+    }
+
+    SharedDatabaseWriterLock()->acquire(_interactiveWriter);
+    _holdingWriterLock = true;
+    try {
+        _stmtBeginTransaction.exec();
+        _stmtBeginTransaction.reset();
+    } catch (...) {
+        _releaseWriterLock();
+        throw;
+    }
     _transactionOpen = true;
 }
 
+void MailStore::_releaseWriterLock() {
+    if (_holdingWriterLock) {
+        _holdingWriterLock = false;
+        SharedDatabaseWriterLock()->release();
+    }
+}
+
 
 void MailStore::rollbackTransaction() {
+    if (_savepoints.size() > 0) {
+        string name = "nested" + to_string(_savepoints.size());
+        MailStoreSavepoint savepoint = _savepoints.back();
+        _savepoints.pop_back();
+
+        _transactionDeltas.erase(_transactionDeltas.begin() + savepoint.deltas, _transactionDeltas.end());
+        _transactionDeltasSealed = savepoint.deltasSealed;
+        _transactionAttributeChanges.erase(_transactionAttributeChanges.begin() + savepoint.attributeChanges, _transactionAttributeChanges.end());
+        _transactionThreads = {};
+        _transactionDirtyThreadIds = {};
+        globalRollbackVersion += 1;
+
+        // Note: a statement that failed re-throws its error when it's reset, so the cached
+        // statements are discarded here too, or the next task that uses one would fail.
+        _saveUpdateQueries = {};
+        _saveInsertQueries = {};
+        _removeQueries = {};
+        _statements.clear();
+
+        _db.exec("ROLLBACK TO " + name);
+        _db.exec("RELEASE " + name);
+        return;
+    }
+
     // Note: when a transaction is interrupted and we roll it back,
     // running the statement again produces the error again? Unclear...
     _saveUpdateQueries = {};
     _saveInsertQueries = {};
     _removeQueries = {};
-    _stmtRollbackTransaction.exec();
-    _stmtRollbackTransaction.reset();
+    _statements.clear();
+    globalRollbackVersion += 1;
+    try {
+        _stmtRollbackTransaction.exec();
+        _stmtRollbackTransaction.reset();
+    } catch (...) {
+        _releaseWriterLock();
+        throw;
+    }
+    _releaseWriterLock();
     _transactionOpen = false;
+
+    // None of the changes were written, so don't tell the client about them
+    _transactionDeltas = {};
+    _transactionDeltasSealed = 0;
+    _transactionAttributeChanges = {};
+    _transactionThreads = {};
+    _transactionDirtyThreadIds = {};
 }
 
 // This method allows you to perform work in a transaction and then prevent the
@@ -319,16 +557,33 @@ void MailStore::rollbackTransaction() {
 // client falling out of sync and it can be a performance win in key places where
 // many unnecessary updates would cause thrashing on the JS side.
 void MailStore::unsafeEraseTransactionDeltas() {
-    _transactionDeltas = {};
+    flushThreadWriteBack();
+    _transactionDeltas.erase(_transactionDeltas.begin() + _transactionDeltasSealed, _transactionDeltas.end());
 }
 
 void MailStore::commitTransaction() {
+    if (_savepoints.size() > 0) {
+        _db.exec("RELEASE nested" + to_string(_savepoints.size()));
+        _transactionDeltasSealed = _savepoints.back().deltasSealed;
+        _savepoints.pop_back();
+        return;
+    }
+
+    flushThreadWriteBack();
+    _transactionThreads = {};
+
     _stmtCommitTransaction.exec();
     _stmtCommitTransaction.reset();
+    _releaseWriterLock();
+
+    if (_transactionAttributeChanges.size()) {
+        SharedMessageAttributesCache()->applyChanges(_transactionAttributeChanges);
+        _transactionAttributeChanges = {};
+    }
     
     // emit all of the deltas
     if (_transactionDeltas.size()) {
-        SharedDeltaStream()->emit(_transactionDeltas, _streamMaxDelay);
+        SharedDeltaStream()->emit(std::move(_transactionDeltas), _streamMaxDelay);
         _transactionDeltas = {};
     }
     _transactionOpen = false;
@@ -337,13 +592,82 @@ void MailStore::commitTransaction() {
 
 void MailStore::save(MailModel * model) {
     assertCorrectThread();
+    _save(model);
 
-    model->incrementVersion();
-    model->beforeSave(this);
+    json patch;
+    if (model->patchSinceInitialData(patch)) {
+        DeltaStreamItem delta {DELTA_TYPE_PATCH, model->tableName(), {std::move(patch)}};
+        _emit(delta);
+    } else {
+        DeltaStreamItem delta {DELTA_TYPE_PERSIST, model};
+        _emit(delta);
+    }
+    model->captureInitialData();
+}
 
+void MailStore::saveAll(vector<MailModel *> models) {
+    assertCorrectThread();
+    if (models.size() == 0) {
+        return;
+    }
+
+    // Batches are only useful if they're written in a single transaction. If the
+    // caller hasn't opened one, wrap the entire set in our own.
+    if (!_transactionOpen) {
+        MailStoreTransaction transaction{this, "saveAll"};
+        saveAll(models);
+        transaction.commit();
+        return;
+    }
+
+    // Save each model using the cached INSERT / UPDATE statements, and collect a single
+    // delta per model class (and type) so the client receives one payload for the batch.
+    vector<pair<string, string>> deltaOrder{};
+    map<pair<string, string>, vector<json>> jsonsByDelta{};
+
+    for (auto model : models) {
+        _save(model);
+
+        json patch;
+        pair<string, string> key {model->tableName(), DELTA_TYPE_PATCH};
+        if (!model->patchSinceInitialData(patch)) {
+            key.second = DELTA_TYPE_PERSIST;
+            patch = model->toJSONDispatch();
+        }
+        model->captureInitialData();
+
+        if (!jsonsByDelta.count(key)) {
+            deltaOrder.push_back(key);
+        }
+        jsonsByDelta[key].push_back(std::move(patch));
+    }
+
+    for (auto & key : deltaOrder) {
+        DeltaStreamItem delta {key.second, key.first, std::move(jsonsByDelta[key])};
+        _emit(delta);
+    }
+}
+
+void MailStore::_save(MailModel * model) {
     auto tableName = model->tableName();
+    if (tableName == Thread::TABLE_NAME) {
+        _willWriteThread(model);
+    }
+
+    model->incrementVersion();
+    model->beforeSave(this);
     
     if (model->version() > 1) {
+        // A patch describes the changes since the model's snapshot, so it's only valid
+        // if nothing else has written the row since. Otherwise we send the full model.
+        if (!model->_initialData.is_null()) {
+            auto prior = cachedStatement("SELECT version FROM " + tableName + " WHERE id = ?");
+            prior->bind(1, model->id());
+            if (!prior->executeStep() || prior->getColumn(0).getInt() != model->_initialData["v"].get<int>()) {
+                model->_initialData = nullptr;
+            }
+        }
+
         if (!_saveUpdateQueries.count(tableName)) {
             string pairs{""};
             for (const auto col : model->columnsForQuery()) {
@@ -388,9 +712,6 @@ void MailStore::save(MailModel * model) {
     if (tableName == "Label") {
         globalLabelsVersion += 1;
     }
-
-    DeltaStreamItem delta {DELTA_TYPE_PERSIST, model};
-    _emit(delta);
 }
 
 void MailStore::saveFolderStatus(Folder * folder, json & initialStatus) {
@@ -418,6 +739,10 @@ void MailStore::saveFolderStatus(Folder * folder, json & initialStatus) {
 void MailStore::remove(MailModel * model) {
     assertCorrectThread();
     auto tableName = model->tableName();
+    if (tableName == Thread::TABLE_NAME) {
+        _willWriteThread(model);
+        _transactionThreads.erase(model->id());
+    }
     if (!_removeQueries.count(tableName)) {
         _removeQueries[tableName] = make_shared<SQLite::Statement>(this->_db, "DELETE FROM " + tableName + " WHERE id = ?");
     }
@@ -438,9 +763,20 @@ void MailStore::remove(MailModel * model) {
 
 void MailStore::_emit(DeltaStreamItem & delta) {
     if (_transactionOpen) {
-        _transactionDeltas.push_back(delta);
+        // Merge the delta into the last one queued for the same model class, just as the
+        // DeltaStream buffer would. Otherwise a thread saved once per message in a large
+        // transaction would hold a copy of the thread's JSON for every message.
+        for (auto it = _transactionDeltas.rbegin(); it != _transactionDeltas.rend() - _transactionDeltasSealed; it++) {
+            if (it->modelClass == delta.modelClass) {
+                if (it->concatenate(std::move(delta))) {
+                    return;
+                }
+                break;
+            }
+        }
+        _transactionDeltas.push_back(std::move(delta));
     } else {
-        SharedDeltaStream()->emit(delta, _streamMaxDelay);
+        SharedDeltaStream()->emit(std::move(delta), _streamMaxDelay);
     }
 }
 
@@ -480,14 +816,8 @@ vector<shared_ptr<MailModel>> MailStore::findAllGeneric(string type, Query query
 
 vector<Metadata> MailStore::findAndDeleteDetatchedPluginMetadata(string accountId, string objectId) {
     assertCorrectThread();
-    if (!_saveInsertQueries.count("metadata")) {
-        auto stmt = make_shared<SQLite::Statement>(db(), "SELECT version, value, pluginId, objectType FROM DetatchedPluginMetadata WHERE objectId = ? AND accountId = ?");
-        _saveInsertQueries["metadata"] = stmt;
-    }
-    
     vector<Metadata> results;
-    auto st = _saveInsertQueries["metadata"];
-    st->reset();
+    auto st = cachedStatement("SELECT version, value, pluginId, objectType FROM DetatchedPluginMetadata WHERE objectId = ? AND accountId = ?");
     st->bind(1, objectId);
     st->bind(2, accountId);
     while (st->executeStep()) {
@@ -501,24 +831,24 @@ vector<Metadata> MailStore::findAndDeleteDetatchedPluginMetadata(string accountI
         results.push_back(m);
     }
     if (results.size()) {
-        SQLite::Statement dt(db(), "DELETE FROM DetatchedPluginMetadata WHERE objectId = ? AND accountId = ?");
-        dt.bind(1, objectId);
-        dt.bind(2, accountId);
-        dt.exec();
+        auto dt = cachedStatement("DELETE FROM DetatchedPluginMetadata WHERE objectId = ? AND accountId = ?");
+        dt->bind(1, objectId);
+        dt->bind(2, accountId);
+        dt->exec();
     }
     return results;
 }
 
 void MailStore::saveDetatchedPluginMetadata(Metadata & m) {
     assertCorrectThread();
-    SQLite::Statement st(db(), "REPLACE INTO DetatchedPluginMetadata (objectId, objectType, accountId, pluginId, value, version) VALUES (?,?,?,?,?,?)");
-    st.bind(1, m.objectId);
-    st.bind(2, m.objectType);
-    st.bind(3, m.accountId);
-    st.bind(4, m.pluginId);
-    st.bind(5, m.value.dump());
-    st.bind(6, m.version);
-    st.exec();
+    auto st = cachedStatement("REPLACE INTO DetatchedPluginMetadata (objectId, objectType, accountId, pluginId, value, version) VALUES (?,?,?,?,?,?)");
+    st->bind(1, m.objectId);
+    st->bind(2, m.objectType);
+    st->bind(3, m.accountId);
+    st->bind(4, m.pluginId);
+    st->bind(5, m.value.dump());
+    st->bind(6, m.version);
+    st->exec();
 }
 
 void MailStore::setStreamDelay(int streamMaxDelay) {
@@ -14,6 +14,8 @@
 
 #include <stdio.h>
 #include <vector>
+#include <set>
+#include <atomic>
 
 #include <MailCore/MailCore.h>
 #include <SQLiteCpp/SQLiteCpp.h>
@@ -22,10 +24,15 @@
 #include "Folder.hpp"
 #include "Label.hpp"
 #include "Message.hpp"
+#include "Thread.hpp"
 #include "Contact.hpp"
 #include "Query.hpp"
 #include "DeltaStream.hpp"
 #include "MailUtils.hpp"
+#include "MessageAttributesCache.hpp"
+#include "LabelInternTable.hpp"
+#include "StatementCache.hpp"
+#include "DatabaseWriterLock.hpp"
 
 using namespace nlohmann;
 using namespace std;
@@ -46,10 +53,24 @@ struct MessageAttributes {
     bool unread;
     bool starred;
     bool draft;
-    vector<string> labels;
+    vector<uint32_t> labelIds; // sorted, see LabelInternTable
 };
 
-MessageAttributes MessageAttributesForMessage(mailcore::IMAPMessage * msg);
+// When a transaction is begun inside another one, it's run as a SQLite savepoint.
+// This records what the outer transaction had queued, so it can be restored if
+// the inner one is rolled back.
+struct MailStoreSavepoint {
+    size_t deltas;
+    size_t deltasSealed;
+    size_t attributeChanges;
+};
+
+// Incremented each time a transaction or savepoint is rolled back. Models note the
+// value when they snapshot their data, and a snapshot taken before a rollback is not
+// used to build a patch, since the client may never have received what it contains.
+extern std::atomic<int> globalRollbackVersion;
+
+MessageAttributes MessageAttributesForMessage(mailcore::IMAPMessage * msg, string accountId);
 bool MessageAttributesMatch(MessageAttributes a, MessageAttributes b);
 
 
@@ -60,14 +81,24 @@ class MailStore {
     SQLite::Statement _stmtCommitTransaction;
     
     bool _transactionOpen;
+    bool _interactiveWriter;
+    bool _holdingWriterLock;
     vector<DeltaStreamItem> _transactionDeltas;
+    size_t _transactionDeltasSealed;
+    vector<MessageAttributesChange> _transactionAttributeChanges;
+    vector<MailStoreSavepoint> _savepoints;
+    map<string, shared_ptr<Thread>> _transactionThreads;
+    set<string> _transactionDirtyThreadIds;
 
     map<string, shared_ptr<SQLite::Statement>> _saveUpdateQueries;
     map<string, shared_ptr<SQLite::Statement>> _saveInsertQueries;
     map<string, shared_ptr<SQLite::Statement>> _removeQueries;
+    StatementCache _statements;
     
     vector<shared_ptr<Label>> _labelCache;
     int _labelCacheVersion;
+    shared_ptr<LabelLookup> _labelLookup;
+    int _labelLookupVersion;
     int _streamMaxDelay;
     size_t _owningThread;
     
@@ -80,12 +111,16 @@ public:
 
     SQLite::Database & db();
 
+    shared_ptr<SQLite::Statement> cachedStatement(const string & sql);
+
     void resetForAccount(string accountId);
     
     string getKeyValue(string key);
     
     void saveKeyValue(string key, string value);
     
+    void setInteractiveWriter(bool interactive);
+
     void beginTransaction();
     
     void rollbackTransaction();
@@ -96,14 +131,26 @@ public:
 
     void save(MailModel * model);
 
+    void saveAll(vector<MailModel *> models);
+
     void saveFolderStatus(Folder * folder, json & initialLocalStatus);
 
     uint32_t fetchMessageUIDAtDepth(Folder & folder, uint32_t depth, uint32_t before = UINT32_MAX);
 
-    map<uint32_t, MessageAttributes> fetchMessagesAttributesInRange(mailcore::Range range, Folder & folder);
+    MessageAttributesSet fetchMessagesAttributesInRange(mailcore::Range range, Folder & folder);
+
+    void updateMessageAttributesCache(string previousFolderId, uint32_t previousUID, Message * message);
 
     vector<shared_ptr<Label>> allLabelsCache(string accountId);
 
+    shared_ptr<LabelLookup> labelLookup(string accountId);
+
+    shared_ptr<Thread> findThreadForWriteBack(string threadId);
+
+    void saveThreadWriteBack(shared_ptr<Thread> thread);
+
+    void flushThreadWriteBack();
+
     void setStreamDelay(int streamMaxDelay);
     
     // Detatched plugin metadata storage
@@ -123,10 +170,11 @@ public:
     template<typename ModelClass>
     shared_ptr<ModelClass> find(Query & query) {
         assertCorrectThread();
-        SQLite::Statement statement(this->_db, "SELECT data FROM " + ModelClass::TABLE_NAME + query.getSQL() + " LIMIT 1");
-        query.bind(statement);
-        if (statement.executeStep()) {
-            return make_shared<ModelClass>(statement);
+        _willReadTable(ModelClass::TABLE_NAME, &query);
+        auto statement = cachedStatement("SELECT data FROM " + ModelClass::TABLE_NAME + query.getSQL() + " LIMIT 1");
+        query.bind(*statement);
+        if (statement->executeStep()) {
+            return make_shared<ModelClass>(*statement);
         }
         return nullptr;
     }
@@ -134,16 +182,17 @@ public:
     template<typename ModelClass>
     vector<shared_ptr<ModelClass>> findAll(Query & query) {
         assertCorrectThread();
+        _willReadTable(ModelClass::TABLE_NAME, &query);
         string sql = "SELECT data FROM " + ModelClass::TABLE_NAME + query.getSQL();
         if (query.getLimit() != 0) {
             sql = sql + " LIMIT " + to_string(query.getLimit());
         }
-        SQLite::Statement statement(this->_db, sql);
-        query.bind(statement);
+        auto statement = cachedStatement(sql);
+        query.bind(*statement);
         
         vector<shared_ptr<ModelClass>> results;
-        while (statement.executeStep()) {
-            results.push_back(make_shared<ModelClass>(statement));
+        while (statement->executeStep()) {
+            results.push_back(make_shared<ModelClass>(*statement));
         }
         
         return results;
@@ -173,12 +222,13 @@ public:
     template<typename ModelClass>
     map<string, shared_ptr<ModelClass>> findAllMap(Query & query, std::string keyField) {
         assertCorrectThread();
-        SQLite::Statement statement(this->_db, "SELECT " + keyField + ", data FROM " + ModelClass::TABLE_NAME + query.getSQL());
-        query.bind(statement);
+        _willReadTable(ModelClass::TABLE_NAME, &query);
+        auto statement = cachedStatement("SELECT " + keyField + ", data FROM " + ModelClass::TABLE_NAME + query.getSQL());
+        query.bind(*statement);
 
         map<string, shared_ptr<ModelClass>> results;
-        while (statement.executeStep()) {
-            results[statement.getColumn(keyField.c_str()).getString()] = make_shared<ModelClass>(statement);
+        while (statement->executeStep()) {
+            results[statement->getColumn(keyField.c_str()).getString()] = make_shared<ModelClass>(*statement);
         }
         
         return results;
@@ -187,12 +237,13 @@ public:
     template<typename ModelClass>
     map<uint32_t, shared_ptr<ModelClass>> findAllUINTMap(Query & query, std::string keyField) {
         assertCorrectThread();
-        SQLite::Statement statement(this->_db, "SELECT " + keyField + ", data FROM " + ModelClass::TABLE_NAME + query.getSQL());
-        query.bind(statement);
+        _willReadTable(ModelClass::TABLE_NAME, &query);
+        auto statement = cachedStatement("SELECT " + keyField + ", data FROM " + ModelClass::TABLE_NAME + query.getSQL());
+        query.bind(*statement);
 
         map<uint32_t, shared_ptr<ModelClass>> results;
-        while (statement.executeStep()) {
-            results[statement.getColumn(keyField.c_str()).getUInt()] = make_shared<ModelClass>(statement);
+        while (statement->executeStep()) {
+            results[statement->getColumn(keyField.c_str()).getUInt()] = make_shared<ModelClass>(*statement);
         }
         
         return results;
@@ -204,10 +255,13 @@ public:
     void remove(Query & query) {
         assertCorrectThread();
         auto models = findAll<ModelClass>(query);
+        if (ModelClass::TABLE_NAME == Thread::TABLE_NAME) {
+            _transactionThreads = {};
+        }
 
-        SQLite::Statement statement(this->_db, "DELETE FROM " + ModelClass::TABLE_NAME + query.getSQL());
-        query.bind(statement);
-        statement.exec();
+        auto statement = cachedStatement("DELETE FROM " + ModelClass::TABLE_NAME + query.getSQL());
+        query.bind(*statement);
+        statement->exec();
         
         DeltaStreamItem delta {DELTA_TYPE_UNPERSIST, models};
         _emit(delta);
@@ -216,6 +270,14 @@ public:
 
 private:
 
+    void _save(MailModel * model);
+
+    void _releaseWriterLock();
+
+    void _willReadTable(const string & tableName, Query * query = nullptr);
+
+    void _willWriteThread(MailModel * model);
+
     void _emit(DeltaStreamItem & delta);
 };
 
@@ -19,6 +19,7 @@ MailStoreTransaction::MailStoreTransaction(MailStore * store, string nameHint) :
 {
     mStore->beginTransaction();
     mBegan = system_clock::now();
+    SharedDatabaseWriterLock()->recordWait(mNameHint, duration_cast<microseconds>(mBegan - mStart));
 }
 
 MailStoreTransaction::~MailStoreTransaction() noexcept // nothrow
@@ -408,7 +408,7 @@ shared_ptr<Label> MailUtils::labelForXGMLabelName(string mlname, vector<shared_p
         }
     }
 
-    cout << "\n\nIMPORTANT --- Label not found: " << mlname;
+    spdlog::get("logger")->warn("IMPORTANT --- Label not found: {}", mlname);
     return shared_ptr<Label>{};
 }
 
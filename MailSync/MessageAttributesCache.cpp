@@ -0,0 +1,161 @@
+//
+//  MessageAttributesCache.cpp
+//  MailSync
+//
+//  Copyright © 2017 Foundry 376. All rights reserved.
+//
+//  Use of this file is subject to the terms and conditions defined
+//  in 'LICENSE.md', which is part of the Mailspring-Sync package.
+//
+
+#include "MessageAttributesCache.hpp"
+#include "MailStore.hpp"
+
+#include <algorithm>
+
+// Singleton Implementation
+
+shared_ptr<MessageAttributesCache> _globalAttributesCache = make_shared<MessageAttributesCache>();
+
+shared_ptr<MessageAttributesCache> SharedMessageAttributesCache() {
+    return _globalAttributesCache;
+}
+
+// MessageAttributesSet
+
+size_t MessageAttributesSet::size() const {
+    return uids.size();
+}
+
+size_t MessageAttributesSet::lowerBound(uint32_t uid) const {
+    return lower_bound(uids.begin(), uids.end(), uid) - uids.begin();
+}
+
+// Note: `labelSet` is the label set of `attrs`, which callers resolve for an entire chunk
+// of messages with labelSetIdsFor, so comparing a message doesn't take the cache's lock.
+bool MessageAttributesSet::matchesAt(size_t index, const MessageAttributes & attrs, uint32_t labelSet) const {
+    uint8_t f = (attrs.unread ? MESSAGE_ATTRIBUTE_UNREAD : 0) | (attrs.starred ? MESSAGE_ATTRIBUTE_STARRED : 0);
+    return uids[index] == attrs.uid && flags[index] == f && labelSets[index] == labelSet;
+}
+
+void MessageAttributesSet::upsert(uint32_t uid, uint8_t f, uint32_t labelSet) {
+    // New mail almost always has the highest UID in the folder, so appending is the common case.
+    size_t ii = (uids.size() == 0 || uids.back() < uid) ? uids.size() : lowerBound(uid);
+    if (ii < uids.size() && uids[ii] == uid) {
+        flags[ii] = f;
+        labelSets[ii] = labelSet;
+        return;
+    }
+    uids.insert(uids.begin() + ii, uid);
+    flags.insert(flags.begin() + ii, f);
+    labelSets.insert(labelSets.begin() + ii, labelSet);
+}
+
+void MessageAttributesSet::remove(uint32_t uid) {
+    size_t ii = lowerBound(uid);
+    if (ii == uids.size() || uids[ii] != uid) {
+        return;
+    }
+    uids.erase(uids.begin() + ii);
+    flags.erase(flags.begin() + ii);
+    labelSets.erase(labelSets.begin() + ii);
+}
+
+MessageAttributesSet MessageAttributesSet::slice(uint32_t minUID, uint32_t maxUID) const {
+    MessageAttributesSet result;
+    size_t start = lowerBound(minUID);
+    size_t end = start;
+    while (end < uids.size() && uids[end] <= maxUID) {
+        end ++;
+    }
+    result.uids.assign(uids.begin() + start, uids.begin() + end);
+    result.flags.assign(flags.begin() + start, flags.begin() + end);
+    result.labelSets.assign(labelSets.begin() + start, labelSets.begin() + end);
+    return result;
+}
+
+// MessageAttributesCache
+
+// Messages we've unlinked (UIDs near UINT32_MAX) and local drafts (UID 0) are not on
+// the server and many of them can share a UID, so they aren't tracked.
+bool MessageAttributesCache::isCachedUID(uint32_t uid) {
+    return uid > 0 && uid <= UINT32_MAX - 5;
+}
+
+uint32_t MessageAttributesCache::_labelSetIdFor(const vector<uint32_t> & labelIds) {
+    auto it = labelSetIds.find(labelIds);
+    if (it == labelSetIds.end()) {
+        it = labelSetIds.emplace(labelIds, (uint32_t)labelSetIds.size()).first;
+    }
+    return it->second;
+}
+
+uint32_t MessageAttributesCache::labelSetIdFor(const vector<uint32_t> & labelIds) {
+    lock_guard<mutex> lock(mtx);
+    return _labelSetIdFor(labelIds);
+}
+
+// Resolves the label sets of many messages with a single acquisition of the lock.
+vector<uint32_t> MessageAttributesCache::labelSetIdsFor(const vector<MessageAttributes> & attrs) {
+    vector<uint32_t> result{};
+    result.reserve(attrs.size());
+    lock_guard<mutex> lock(mtx);
+    for (const auto & a : attrs) {
+        result.push_back(_labelSetIdFor(a.labelIds));
+    }
+    return result;
+}
+
+bool MessageAttributesCache::sliceOfFolder(string folderId, uint32_t minUID, uint32_t maxUID, MessageAttributesSet & result) {
+    lock_guard<mutex> lock(mtx);
+    auto it = folders.find(folderId);
+    if (it == folders.end()) {
+        return false;
+    }
+    result = it->second.slice(minUID, maxUID);
+    return true;
+}
+
+uint64_t MessageAttributesCache::versionOfFolder(string folderId) {
+    lock_guard<mutex> lock(mtx);
+    return folderVersions[folderId];
+}
+
+void MessageAttributesCache::installFolder(string folderId, MessageAttributesSet & set, uint64_t version) {
+    lock_guard<mutex> lock(mtx);
+    // If changes to the folder were committed while the caller was reading it from
+    // the database, we can't tell whether they're reflected in `set`. Skip it and
+    // load the folder again next time.
+    if (folderVersions[folderId] != version) {
+        return;
+    }
+    folders[folderId] = set;
+}
+
+void MessageAttributesCache::applyChanges(vector<MessageAttributesChange> & changes) {
+    lock_guard<mutex> lock(mtx);
+    for (auto & change : changes) {
+        if (change.previousFolderId != "" && (change.previousFolderId != change.folderId || change.previousUID != change.uid)) {
+            folderVersions[change.previousFolderId] += 1;
+            auto it = folders.find(change.previousFolderId);
+            if (it != folders.end() && isCachedUID(change.previousUID)) {
+                it->second.remove(change.previousUID);
+            }
+        }
+        if (change.folderId != "") {
+            folderVersions[change.folderId] += 1;
+            auto it = folders.find(change.folderId);
+            if (it != folders.end() && isCachedUID(change.uid)) {
+                it->second.upsert(change.uid, change.flags, change.labelSet);
+            }
+        }
+    }
+}
+
+void MessageAttributesCache::invalidateAll() {
+    lock_guard<mutex> lock(mtx);
+    for (auto & pair : folderVersions) {
+        pair.second += 1;
+    }
+    folders = {};
+}
@@ -0,0 +1,92 @@
+//
+//  MessageAttributesCache.hpp
+//  MailSync
+//
+//  Copyright © 2017 Foundry 376. All rights reserved.
+//
+//  Use of this file is subject to the terms and conditions defined
+//  in 'LICENSE.md', which is part of the Mailspring-Sync package.
+//
+
+/*
+ The MessageAttributesCache is a singleton that keeps the attributes we compare
+ against the server during a sync (UID, unread, starred and X-GM-LABELS) for
+ each folder in memory, so that shallow and deep scans don't need to query and
+ parse every message in the folder.
+
+ Each folder is stored as a set of columns sorted by UID. Each distinct combination
+ of labels (see LabelInternTable) is interned as a "label set" integer, so a row is
+ just 9 bytes and comparing the labels on two messages is a single integer comparison.
+
+ Folders are loaded from the database the first time they're requested and are
+ kept up to date by the Message save hooks. Changes made inside a transaction are
+ applied when the transaction is committed.
+*/
+#ifndef MessageAttributesCache_hpp
+#define MessageAttributesCache_hpp
+
+#include <stdio.h>
+#include <memory>
+#include <mutex>
+#include <map>
+#include <vector>
+#include <string>
+
+using namespace std;
+
+struct MessageAttributes;
+
+#define MESSAGE_ATTRIBUTE_UNREAD    1
+#define MESSAGE_ATTRIBUTE_STARRED   2
+
+class MessageAttributesSet {
+public:
+    vector<uint32_t> uids;
+    vector<uint8_t> flags;
+    vector<uint32_t> labelSets;
+
+    size_t size() const;
+    size_t lowerBound(uint32_t uid) const;
+    bool matchesAt(size_t index, const MessageAttributes & attrs, uint32_t labelSet) const;
+
+    void upsert(uint32_t uid, uint8_t flags, uint32_t labelSet);
+    void remove(uint32_t uid);
+    MessageAttributesSet slice(uint32_t minUID, uint32_t maxUID) const;
+};
+
+struct MessageAttributesChange {
+    string previousFolderId;
+    uint32_t previousUID;
+    string folderId;
+    uint32_t uid;
+    uint8_t flags;
+    uint32_t labelSet;
+};
+
+class MessageAttributesCache {
+    mutex mtx;
+
+    map<string, MessageAttributesSet> folders;
+    map<string, uint64_t> folderVersions;
+
+    map<vector<uint32_t>, uint32_t> labelSetIds;
+
+    uint32_t _labelSetIdFor(const vector<uint32_t> & labelIds);
+
+public:
+    static bool isCachedUID(uint32_t uid);
+
+    uint32_t labelSetIdFor(const vector<uint32_t> & labelIds);
+    vector<uint32_t> labelSetIdsFor(const vector<MessageAttributes> & attrs);
+
+    bool sliceOfFolder(string folderId, uint32_t minUID, uint32_t maxUID, MessageAttributesSet & result);
+    uint64_t versionOfFolder(string folderId);
+    void installFolder(string folderId, MessageAttributesSet & set, uint64_t version);
+
+    void applyChanges(vector<MessageAttributesChange> & changes);
+    void invalidateAll();
+};
+
+shared_ptr<MessageAttributesCache> SharedMessageAttributesCache();
+
+#endif /* MessageAttributesCache_hpp */
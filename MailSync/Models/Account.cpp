@@ -117,6 +117,16 @@ bool Account::IMAPAllowInsecureSSL() {
     return _data["settings"]["imap_allow_insecure_ssl"].get<bool>();
 }
 
+// The number of additional connections the background worker may open to fetch
+// headers in parallel. Zero (the default) fetches on the worker's own session.
+int Account::IMAPFetchConnections() {
+    json & s = _data["settings"];
+    if (!s.count("imap_fetch_connections") || !s["imap_fetch_connections"].is_number()) {
+        return 0;
+    }
+    return max(0, min(8, s["imap_fetch_connections"].get<int>()));
+}
+
 unsigned int Account::SMTPPort() {
     json & val = _data["settings"]["smtp_port"];
     return val.is_string() ? stoi(val.get<string>()) : val.get<unsigned int>();
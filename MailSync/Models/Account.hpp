@@ -46,6 +46,7 @@ public:
     string IMAPPassword();
     string IMAPSecurity();
     bool IMAPAllowInsecureSSL();
+    int IMAPFetchConnections();
 
     unsigned int SMTPPort();
     string SMTPHost();
@@ -58,6 +58,6 @@ vector<string> Calendar::columnsForQuery() {
 
 void Calendar::bindToQuery(SQLite::Statement * query) {
     query->bind(":id", id());
-    query->bind(":data", toJSON().dump());
+    query->bind(":data", _dataWithClassName().dump());
     query->bind(":accountId", accountId());
 }
@@ -13,6 +13,7 @@
 #include "MailUtils.hpp"
 #include "Thread.hpp"
 #include "Message.hpp"
+#include "MailStoreTransaction.hpp"
 
 using namespace std;
 using namespace mailcore;
@@ -92,7 +93,7 @@ vector<string> ContactGroup::getMembers(MailStore * store) {
 }
 
 void ContactGroup::syncMembers(MailStore * store, vector<string> newContactIds) {
-    store->beginTransaction();
+    MailStoreTransaction transaction {store, "syncMembers"};
     
     vector<string> oldContactIds = getMembers(store);
     
@@ -135,5 +136,5 @@ void ContactGroup::syncMembers(MailStore * store, vector<string> newContactIds)
         }
     }
     
-    store->commitTransaction();
+    transaction.commit();
 }
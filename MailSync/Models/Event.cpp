@@ -93,7 +93,7 @@ vector<string> Event::columnsForQuery() {
 
 void Event::bindToQuery(SQLite::Statement * query) {
     query->bind(":id", id());
-    query->bind(":data", this->toJSON().dump());
+    query->bind(":data", _dataWithClassName().dump());
     query->bind(":icsuid", icsUID());
     query->bind(":accountId", accountId());
     query->bind(":etag", etag());
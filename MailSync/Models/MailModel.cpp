@@ -14,6 +14,7 @@
 #include "MailStore.hpp"
 #include "SyncException.hpp"
 #include "MetadataExpirationWorker.hpp"
+#include "DeltaStream.hpp"
 
 using namespace std;
 
@@ -27,9 +28,10 @@ MailModel::MailModel(string id, string accountId, int version) :
 }
 
 MailModel::MailModel(SQLite::Statement & query) :
-    _data(json::parse(query.getColumn("data").getString()))
+    _data(json::parse(query.getColumn("data").getText()))
 {
     captureInitialMetadataState();
+    captureInitialData();
 }
 
 
@@ -49,6 +51,49 @@ void MailModel::captureInitialMetadataState() {
     }
 }
 
+// Note: this is a deep copy of the model, so we only keep it if the client has asked
+// for patch deltas. It's taken when the model is loaded and again each time it's saved,
+// so it matches the last version the client was sent - unless the transaction it was
+// taken in is rolled back, which is why we note the rollback version alongside it.
+void MailModel::captureInitialData() {
+    if (SharedDeltaStream()->patchesEnabled()) {
+        _initialData = _data;
+        _initialDataRollbackVersion = globalRollbackVersion;
+    } else {
+        _initialData = nullptr;
+    }
+}
+
+// Fills `patch` with the keys of the dispatch JSON that differ from the initial data,
+// plus the keys the client needs to identify the model. Returns false if the client
+// needs the full model instead (no snapshot was taken, a transaction has been rolled
+// back since, or a key has been removed).
+bool MailModel::patchSinceInitialData(json & patch) {
+    if (_initialData.is_null() || _initialDataRollbackVersion != globalRollbackVersion) {
+        return false;
+    }
+    json current = toJSONDispatch();
+    for (const auto & e : _initialData.items()) {
+        if (!current.count(e.key())) {
+            return false;
+        }
+    }
+
+    patch = json::object();
+    for (auto & e : current.items()) {
+        const string & key = e.key();
+        if (key == "id" || key == "aid" || key == "v" || key == "__cls") {
+            patch[key] = e.value();
+            continue;
+        }
+        auto initial = _initialData.find(key);
+        if (initial == _initialData.end() || *initial != e.value()) {
+            patch[key] = std::move(e.value());
+        }
+    }
+    return true;
+}
+
 string MailModel::id()
 {
     return _data["id"].get<std::string>();
@@ -113,10 +158,7 @@ string MailModel::tableName()
 json MailModel::toJSON()
 {
     // note: do not override for Task!
-    if (!_data.count("__cls")) {
-        _data["__cls"] = this->tableName();
-    }
-    return _data;
+    return _dataWithClassName();
 }
 
 json MailModel::toJSONDispatch()
@@ -124,10 +166,18 @@ json MailModel::toJSONDispatch()
     return this->toJSON();
 }
 
+json & MailModel::_dataWithClassName() {
+    if (!_data.count("__cls")) {
+        _data["__cls"] = this->tableName();
+    }
+    return _data;
+}
+
 void MailModel::bindToQuery(SQLite::Statement * query) {
     auto _id = id();
     query->bind(":id", _id);
-    query->bind(":data", this->toJSON().dump());
+    // Serialize _data in place - toJSON() would make a deep copy of the model first.
+    query->bind(":data", _dataWithClassName().dump());
     query->bind(":accountId", accountId());
     query->bind(":version", version());
 
@@ -166,14 +216,14 @@ void MailModel::afterSave(MailStore * store) {
     if (_initialMetadataPluginIds != metadataPluginIds) {
         string _id = id();
         
-        SQLite::Statement removePluginIds(store->db(), "DELETE FROM ModelPluginMetadata WHERE id = ?");
-        removePluginIds.bind(1, _id);
-        removePluginIds.exec();
+        auto removePluginIds = store->cachedStatement("DELETE FROM ModelPluginMetadata WHERE id = ?");
+        removePluginIds->bind(1, _id);
+        removePluginIds->exec();
         
-        SQLite::Statement insertPluginIds(store->db(), "INSERT INTO ModelPluginMetadata (id, accountId, objectType, value, expiration) VALUES (?,?,?,?, ?)");
-        insertPluginIds.bind(1, _id);
-        insertPluginIds.bind(2, accountId());
-        insertPluginIds.bind(3, this->tableName());
+        auto insertPluginIds = store->cachedStatement("INSERT INTO ModelPluginMetadata (id, accountId, objectType, value, expiration) VALUES (?,?,?,?, ?)");
+        insertPluginIds->bind(1, _id);
+        insertPluginIds->bind(2, accountId());
+        insertPluginIds->bind(3, this->tableName());
         
         long lowestExpiration = LONG_MAX;
 
@@ -187,16 +237,16 @@ void MailModel::afterSave(MailStore * store) {
 
             bool hasExpiration = m["value"].count("expiration") && m["value"]["expiration"].is_number();
 
-            insertPluginIds.bind(4, m["pluginId"].get<string>());
+            insertPluginIds->bind(4, m["pluginId"].get<string>());
             if (hasExpiration) {
                 long e = m["value"]["expiration"].get<long>();
                 if (e < lowestExpiration) { lowestExpiration = e; }
-                insertPluginIds.bind(5, (long long)e);
+                insertPluginIds->bind(5, (long long)e);
             } else {
-                insertPluginIds.bind(5); // binds null
+                insertPluginIds->bind(5); // binds null
             }
-            insertPluginIds.exec();
-            insertPluginIds.reset();
+            insertPluginIds->exec();
+            insertPluginIds->reset();
         }
 
         if (lowestExpiration != LONG_MAX) {
@@ -216,8 +266,8 @@ void MailModel::afterRemove(MailStore * store) {
         return;
     }
     string _id = id();
-    SQLite::Statement removePluginIds(store->db(), "DELETE FROM ModelPluginMetadata WHERE id = ?");
-    removePluginIds.bind(1, _id);
-    removePluginIds.exec();
+    auto removePluginIds = store->cachedStatement("DELETE FROM ModelPluginMetadata WHERE id = ?");
+    removePluginIds->bind(1, _id);
+    removePluginIds->exec();
 }
 
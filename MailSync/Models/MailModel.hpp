@@ -28,9 +28,15 @@ class MailStore;
 
 class MailModel {
 public:
+    // Note: models keep their state as JSON rather than in typed fields. The accessors
+    // of every subclass, the client-facing deltas and the few places that edit _data
+    // directly (eg: draft syncing in TaskProcessor) all depend on it, so the work done
+    // to reduce JSON overhead is in how often _data is copied, parsed and dumped.
     json _data;
 
     map<string, int> _initialMetadataPluginIds;
+    json _initialData;
+    int _initialDataRollbackVersion = 0;
     
     static string TABLE_NAME;
     virtual string tableName();
@@ -40,6 +46,8 @@ public:
     MailModel(json json);
     
     void captureInitialMetadataState();
+    void captureInitialData();
+    bool patchSinceInitialData(json & patch);
     
     string id();
     string accountId();
@@ -61,6 +69,9 @@ public:
 
     virtual json toJSON();
     virtual json toJSONDispatch();
+
+protected:
+    json & _dataWithClassName();
 };
 
 #endif /* MailModel_hpp */
@@ -16,6 +16,7 @@
 #include "MailStore.hpp"
 #include "File.hpp"
 #include "Thread.hpp"
+#include "constants.h"
 
 using namespace std;
 
@@ -59,6 +60,8 @@ MailModel(MailUtils::idForMessage(folder.accountId(), folder.path(), msg), folde
 {
     _skipThreadUpdatesAfterSave = false;
     _lastSnapshot = MessageEmptySnapshot;
+    _lastRemoteFolderId = "";
+    _lastRemoteUID = 0;
     _data["_sa"] = syncDataTimestamp;
     _data["_suc"] = 0;
     
@@ -80,10 +83,10 @@ MailModel(MailUtils::idForMessage(folder.accountId(), folder.path(), msg), folde
         _data["rthMsgId"] = nullptr;
     }
 
-    MessageAttributes attrs = MessageAttributesForMessage(msg);
+    MessageAttributes attrs = MessageAttributesForMessage(msg, folder.accountId());
     _data["unread"] = attrs.unread;
     _data["starred"] = attrs.starred;
-    _data["labels"] = attrs.labels;
+    _data["labels"] = SharedLabelInternTable(folder.accountId())->namesFor(attrs.labelIds);
     _data["draft"] = attrs.draft;
     if (folder.role() == "drafts") {
         _data["draft"] = true;
@@ -131,6 +134,8 @@ Message::Message(SQLite::Statement & query) :
 {
     _skipThreadUpdatesAfterSave = false;
     _lastSnapshot = getSnapshot();
+    _lastRemoteFolderId = remoteFolderId();
+    _lastRemoteUID = remoteUID();
 }
 
 Message::Message(json json) :
@@ -139,8 +144,12 @@ Message::Message(json json) :
     _skipThreadUpdatesAfterSave = false;
     if (version() == 0) {
         _lastSnapshot = MessageEmptySnapshot;
+        _lastRemoteFolderId = "";
+        _lastRemoteUID = 0;
     } else {
         _lastSnapshot = getSnapshot();
+        _lastRemoteFolderId = remoteFolderId();
+        _lastRemoteUID = remoteUID();
     }
 }
 
@@ -150,7 +159,7 @@ MessageSnapshot Message::getSnapshot() {
     s.starred = isStarred();
     s.inAllMail = inAllMail();
     s.fileCount = fileCountForThreadList();
-    s.remoteXGMLabels = remoteXGMLabels();
+    s.remoteXGMLabelIds = remoteXGMLabelIds();
     s.clientFolderId = clientFolderId();
     return s;
 }
@@ -206,6 +215,10 @@ json & Message::remoteXGMLabels() {
     return _data["labels"];
 }
 
+vector<uint32_t> Message::remoteXGMLabelIds() {
+    return SharedLabelInternTable(accountId())->idsFor(remoteXGMLabels());
+}
+
 void Message::setRemoteXGMLabels(json & labels) {
     _data["labels"] = labels;
 }
@@ -449,6 +462,34 @@ void Message::bindToQuery(SQLite::Statement * query) {
 void Message::afterSave(MailStore * store) {
     MailModel::afterSave(store);
 
+    store->updateMessageAttributesCache(_lastRemoteFolderId, _lastRemoteUID, this);
+
+    // Keep the BodyFetchQueue in sync. Messages are queued when they arrive from the
+    // server and follow their folder if they're moved. Local drafts are created with
+    // their body, so they're never queued, and neither are messages outside the body
+    // sync window or in spam and trash, where bodies aren't cached (see SyncWorker).
+    if (version() == 1 && remoteUID() > 0) {
+        string role = remoteFolder()["role"].get<string>();
+        bool wanted = isDraft() || date() > time(0) - BODY_SYNC_MAX_AGE;
+        if (wanted && role != "spam" && role != "trash") {
+            auto enqueue = store->cachedStatement("INSERT OR IGNORE INTO BodyFetchQueue (id, accountId, folderId, priority, date) VALUES (?, ?, ?, ?, ?)");
+            enqueue->bind(1, id());
+            enqueue->bind(2, accountId());
+            enqueue->bind(3, remoteFolderId());
+            enqueue->bind(4, isDraft() ? 1 : 0);
+            enqueue->bind(5, (double)date());
+            enqueue->exec();
+        }
+    } else if (_lastRemoteFolderId != "" && _lastRemoteFolderId != remoteFolderId()) {
+        auto move = store->cachedStatement("UPDATE BodyFetchQueue SET folderId = ? WHERE id = ?");
+        move->bind(1, remoteFolderId());
+        move->bind(2, id());
+        move->exec();
+    }
+
+    _lastRemoteFolderId = remoteFolderId();
+    _lastRemoteUID = remoteUID();
+
     // if we have a thread, keep the thread's folder, label, and unread counters
     // in sync by providing it with a before + after snapshot of this message.
     if (_skipThreadUpdatesAfterSave) {
@@ -457,19 +498,19 @@ void Message::afterSave(MailStore * store) {
     if (threadId() == "") {
         return;
     }
-    auto thread = store->find<Thread>(Query().equal("id", threadId()));
+    auto thread = store->findThreadForWriteBack(threadId());
     if (thread == nullptr) {
         return;
     }
 
-    auto allLabels = store->allLabelsCache(accountId());
-    thread->applyMessageAttributeChanges(_lastSnapshot, this, allLabels);
-    store->save(thread.get());
-    _lastSnapshot = getSnapshot();
+    applyAttributeChangesToThread(thread.get(), *store->labelLookup(accountId()));
+    store->saveThreadWriteBack(thread);
 }
 
 void Message::afterRemove(MailStore * store) {
     MailModel::afterRemove(store);
+
+    store->updateMessageAttributesCache(_lastRemoteFolderId, _lastRemoteUID, nullptr);
     
     // if we have a thread, keep the thread's folder, label, and unread counters
     // in sync by providing it with a before + after snapshot of this message.
@@ -477,23 +518,34 @@ void Message::afterRemove(MailStore * store) {
     if (threadId() == "") {
         return;
     }
-    auto thread = store->find<Thread>(Query().equal("id", threadId()));
+    auto thread = store->findThreadForWriteBack(threadId());
     if (thread == nullptr) {
         return;
     }
     
-    auto allLabels = store->allLabelsCache(accountId());
-    thread->applyMessageAttributeChanges(_lastSnapshot, nullptr, allLabels);
+    thread->applyMessageAttributeChanges(_lastSnapshot, nullptr, *store->labelLookup(accountId()));
     if (thread->folders().size() == 0) {
         store->remove(thread.get());
     } else {
-        store->save(thread.get());
+        store->saveThreadWriteBack(thread);
     }
     
     // Also delete our draft body
-    SQLite::Statement removeBody(store->db(), "DELETE FROM MessageBody WHERE id = ?");
-    removeBody.bind(1, id());
-    removeBody.exec();
+    auto removeBody = store->cachedStatement("DELETE FROM MessageBody WHERE id = ?");
+    removeBody->bind(1, id());
+    removeBody->exec();
+
+    auto dequeue = store->cachedStatement("DELETE FROM BodyFetchQueue WHERE id = ?");
+    dequeue->bind(1, id());
+    dequeue->exec();
+}
+
+// Provides the thread with a before + after snapshot of this message and advances
+// the snapshot. Callers that manage the thread themselves (eg: batch inserts) use this
+// with _skipThreadUpdatesAfterSave so the thread is loaded and saved only once.
+void Message::applyAttributeChangesToThread(Thread * thread, LabelLookup & labelLookup) {
+    thread->applyMessageAttributeChanges(_lastSnapshot, this, labelLookup);
+    _lastSnapshot = getSnapshot();
 }
 
 json Message::toJSONDispatch() {
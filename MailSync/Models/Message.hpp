@@ -27,8 +27,11 @@ using namespace std;
 using namespace nlohmann;
 
 class File;
+class Label;
+class LabelLookup;
 class MailStore;
 class Message;
+class Thread;
 
 // Snapshot concept
 
@@ -37,11 +40,11 @@ struct MessageSnapshot {
     bool starred;
     bool inAllMail;
     size_t fileCount;
-    json remoteXGMLabels;
+    vector<uint32_t> remoteXGMLabelIds;
     string clientFolderId;
 };
 
-static MessageSnapshot MessageEmptySnapshot = MessageSnapshot{false, false, false, 0, nullptr, ""};
+static MessageSnapshot MessageEmptySnapshot = MessageSnapshot{false, false, false, 0, {}, ""};
 
 // Message
 
@@ -50,6 +53,10 @@ class Message : public MailModel {
     string _bodyForDispatch;
     MessageSnapshot _lastSnapshot;
 
+    // The remote folder + UID we last saved, used to keep the MessageAttributesCache in sync
+    string _lastRemoteFolderId;
+    uint32_t _lastRemoteUID;
+
 public:
     static string TABLE_NAME;
     
@@ -111,6 +118,7 @@ public:
     bool _isIn(string roleAlsoLabelName);
 
     json & remoteXGMLabels();
+    vector<uint32_t> remoteXGMLabelIds();
     void setRemoteXGMLabels(json & labels);
 
     uint32_t remoteUID();
@@ -145,6 +153,8 @@ public:
     void afterSave(MailStore * store);
     void afterRemove(MailStore * store);
 
+    void applyAttributeChangesToThread(Thread * thread, LabelLookup & labelLookup);
+
     json toJSONDispatch();
 
     bool _skipThreadUpdatesAfterSave;
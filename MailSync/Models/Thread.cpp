@@ -12,6 +12,7 @@
 #include "Thread.hpp"
 #include "MailUtils.hpp"
 #include "MailStore.hpp"
+#include "ThreadSearchIndexer.hpp"
 
 #define DEFAULT_SUBJECT "unassigned"
 
@@ -164,7 +165,7 @@ void Thread::resetCountedAttributes() {
     // now call applyMessageAttributeChanges(empty, msg) for all messages
 }
 
-void Thread::applyMessageAttributeChanges(MessageSnapshot & old, Message * next, vector<shared_ptr<Label>> allLabels) {
+void Thread::applyMessageAttributeChanges(MessageSnapshot & old, Message * next, LabelLookup & labelLookup) {
     // decrement basic attributes
     setUnread(unread() - old.unread);
     setStarred(starred() - old.starred);
@@ -191,28 +192,39 @@ void Thread::applyMessageAttributeChanges(MessageSnapshot & old, Message * next,
     }
     _data["folders"] = nextFolders;
     
-    // decrement label refcounts
+    // decrement label refcounts. Resolve the message's labels first so we
+    // only need to make one pass through the thread's labels.
     //
     // Note: Since labels are within `All Mail`, a message only contributes
     // to a label's unread count if it is also in `All Mail`.
-    for (auto& mlname : old.remoteXGMLabels) {
-        shared_ptr<Label> ml = MailUtils::labelForXGMLabelName(mlname, allLabels);
-        if (ml == nullptr) {
-            continue;
+    map<string, int> removedLabelRefs;
+    for (auto labelId : old.remoteXGMLabelIds) {
+        shared_ptr<Label> ml = labelLookup.labelForId(labelId);
+        if (ml != nullptr) {
+            removedLabelRefs[ml->id()] += 1;
         }
+    }
+    if (removedLabelRefs.size() > 0) {
         json nextLabels = json::array();
         for (auto & l : labels()) {
-            if (l["id"].get<string>() != ml->id()) {
+            auto removed = removedLabelRefs.find(l["id"].get<string>());
+            if (removed == removedLabelRefs.end()) {
                 nextLabels.push_back(l);
                 continue;
             }
-            int r = l["_refs"].get<int>();
+            for (int ii = 0; ii < removed->second; ii ++) {
+                int r = l["_refs"].get<int>();
 
-            // Would be >0, but in the "decrementing to zero" case, we don't want
-            // the label in the result set at all.
-            if (r > 1) {
+                // Would be >0, but in the "decrementing to zero" case, we don't want
+                // the label in the result set at all.
+                if (r <= 1) {
+                    l = nullptr;
+                    break;
+                }
                 l["_refs"] = r - 1;
                 l["_u"] = l["_u"].get<int>() - old.unread && old.inAllMail; // see Note
+            }
+            if (!l.is_null()) {
                 nextLabels.push_back(l);
             }
         }
@@ -276,27 +288,32 @@ void Thread::applyMessageAttributeChanges(MessageSnapshot & old, Message * next,
         }
         
         // update our label set + increment refcounts
-        for (auto& mlname : next->remoteXGMLabels()) {
-            shared_ptr<Label> ml = MailUtils::labelForXGMLabelName(mlname, allLabels);
-            if (ml == nullptr) {
-                continue;
+        vector<uint32_t> nextLabelIds = next->remoteXGMLabelIds();
+        if (nextLabelIds.size() > 0) {
+            map<string, size_t> labelIndexes;
+            for (size_t ii = 0; ii < labels().size(); ii ++) {
+                labelIndexes[labels()[ii]["id"].get<string>()] = ii;
             }
 
-            bool found = false;
-            for (auto& l : labels()) {
-                if (l["id"].get<string>() == ml->id()) {
+            for (auto labelId : nextLabelIds) {
+                shared_ptr<Label> ml = labelLookup.labelForId(labelId);
+                if (ml == nullptr) {
+                    continue;
+                }
+
+                auto existing = labelIndexes.find(ml->id());
+                if (existing != labelIndexes.end()) {
+                    json & l = labels()[existing->second];
                     l["_refs"] = l["_refs"].get<int>() + 1;
                     l["_u"] = l["_u"].get<int>() + next->isUnread() && next->inAllMail(); // See Note
-                    found = true;
-                    break;
+                } else {
+                    json l = ml->toJSON();
+                    l["_refs"] = 1;
+                    l["_u"] = (next->isUnread() && next->inAllMail()) ? 1 : 0; // See Note
+                    labelIndexes[ml->id()] = labels().size();
+                    labels().push_back(l);
                 }
             }
-            if (!found) {
-                json l = ml->toJSON();
-                l["_refs"] = 1;
-                l["_u"] = (next->isUnread() && next->inAllMail()) ? 1 : 0; // See Note
-                labels().push_back(l);
-            }
         }
         
         
@@ -358,21 +375,21 @@ void Thread::afterSave(MailStore * store) {
     // have not changed since the model was loaded.
     if (_initialCategoryIds != categoryIds || _initialLMRT != _lmrt || _initialLMST != _lmst) {
         string _id = id();
-        SQLite::Statement removeFolders(store->db(), "DELETE FROM ThreadCategory WHERE id = ?");
-        removeFolders.bind(1, id());
-        removeFolders.exec();
+        auto removeFolders = store->cachedStatement("DELETE FROM ThreadCategory WHERE id = ?");
+        removeFolders->bind(1, id());
+        removeFolders->exec();
 
         if (categoryIds.size() > 0) {
-            SQLite::Statement insertFolders(store->db(), "INSERT INTO ThreadCategory (id, value, inAllMail, unread, lastMessageReceivedTimestamp, lastMessageSentTimestamp) VALUES (?,?,?,?,?,?)");
+            auto insertFolders = store->cachedStatement("INSERT INTO ThreadCategory (id, value, inAllMail, unread, lastMessageReceivedTimestamp, lastMessageSentTimestamp) VALUES (?,?,?,?,?,?)");
             for (auto& it : categoryIds) {
-                insertFolders.bind(1, _id);
-                insertFolders.bind(2, it.first);
-                insertFolders.bind(3, _inAllMail);
-                insertFolders.bind(4, it.second);
-                insertFolders.bind(5, _lmrt);
-                insertFolders.bind(6, _lmst);
-                insertFolders.exec();
-                insertFolders.reset();
+                insertFolders->bind(1, _id);
+                insertFolders->bind(2, it.first);
+                insertFolders->bind(3, _inAllMail);
+                insertFolders->bind(4, it.second);
+                insertFolders->bind(5, _lmrt);
+                insertFolders->bind(6, _lmst);
+                insertFolders->exec();
+                insertFolders->reset();
             }
         }
     }
@@ -392,27 +409,28 @@ void Thread::afterSave(MailStore * store) {
                 diffs[it.first] = {it.second, 1};
             }
         }
-        SQLite::Statement changeCounters(store->db(), "UPDATE ThreadCounts SET unread = unread + ?, total = total + ? WHERE categoryId = ?");
+        auto changeCounters = store->cachedStatement("UPDATE ThreadCounts SET unread = unread + ?, total = total + ? WHERE categoryId = ?");
 
         for (auto& it : diffs) {
             if (it.second[0] == 0 && it.second[1] == 0) {
                 continue;
             }
-            changeCounters.bind(1, it.second[0]);
-            changeCounters.bind(2, it.second[1]);
-            changeCounters.bind(3, it.first);
-            changeCounters.exec();
-            changeCounters.reset();
+            changeCounters->bind(1, it.second[0]);
+            changeCounters->bind(2, it.second[1]);
+            changeCounters->bind(3, it.first);
+            changeCounters->exec();
+            changeCounters->reset();
         }
 
-        // update the thread search table if we're indexed
+        // queue the thread search entry to be updated with the new categories
         if (searchRowId()) {
-            SQLite::Statement update(store->db(), "UPDATE ThreadSearch SET categories = ? WHERE rowid = ?");
-            update.bind(1, categoriesSearchString());
-            update.bind(2, (double)searchRowId());
-            update.exec();
+            QueueThreadsForSearchIndexing(store, accountId(), {id()});
         }
     }
+
+    // The rows now reflect our state, so the next save (eg: of the same instance held
+    // by the MailStore's thread write-back cache) only applies the changes made since.
+    captureInitialState();
 }
 
 void Thread::afterRemove(MailStore * store) {
@@ -425,9 +443,9 @@ void Thread::afterRemove(MailStore * store) {
 
     // Delete search entry
     if (searchRowId()) {
-        SQLite::Statement update(store->db(), "DELETE FROM ThreadSearch WHERE rowid = ?");
-        update.bind(1, (double)searchRowId());
-        update.exec();
+        auto update = store->cachedStatement("DELETE FROM ThreadSearchContent WHERE id = ?");
+        update->bind(1, (double)searchRowId());
+        update->exec();
     }
 }
 
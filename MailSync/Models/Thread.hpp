@@ -22,6 +22,7 @@
 #include "MailModel.hpp"
 #include "Label.hpp"
 #include "Message.hpp"
+#include "LabelInternTable.hpp"
 
 #include "json.hpp"
 
@@ -68,7 +69,7 @@ public:
     string categoriesSearchString();
 
     void resetCountedAttributes();
-    void applyMessageAttributeChanges(MessageSnapshot & old, Message * next, vector<shared_ptr<Label>> allLabels);
+    void applyMessageAttributeChanges(MessageSnapshot & old, Message * next, LabelLookup & labelLookup);
     void upsertReferences(SQLite::Database & db, string headerMessageId, mailcore::Array * references);
 
     string tableName();
@@ -74,6 +74,28 @@ int Query::getLimit() {
     return _limit;
 }
 
+// Returns true if the query selects rows only by their id, and fills `ids` with them.
+bool Query::isLookupById(vector<string> & ids) {
+    if (_clauses.size() != 1 || !_clauses.count("id") || _clauses["id"]["op"] != "=") {
+        return false;
+    }
+    json & rhs = _clauses["id"]["rhs"];
+    if (rhs.is_string()) {
+        ids.push_back(rhs.get<string>());
+        return true;
+    }
+    if (rhs.is_array()) {
+        for (auto & id : rhs) {
+            if (!id.is_string()) {
+                return false;
+            }
+            ids.push_back(id.get<string>());
+        }
+        return true;
+    }
+    return false;
+}
+
 string Query::getSQL() {
     string result = "";
 
@@ -41,6 +41,7 @@ public:
     Query & limit(int l);
 
     int getLimit();
+    bool isLookupById(vector<string> & ids);
     std::string getSQL();
 
     void bind(SQLite::Statement & query);
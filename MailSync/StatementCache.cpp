@@ -0,0 +1,89 @@
+//
+//  StatementCache.cpp
+//  MailSync
+//
+//  Copyright © 2017 Foundry 376. All rights reserved.
+//
+//  Use of this file is subject to the terms and conditions defined
+//  in 'LICENSE.md', which is part of the Mailspring-Sync package.
+//
+
+#include "StatementCache.hpp"
+#include "spdlog/spdlog.h"
+
+using namespace std::chrono;
+
+#define STATEMENT_CACHE_REPORT_INTERVAL 60 * 5
+
+StatementCache::StatementCache(SQLite::Database & db, size_t capacity) :
+    db(db), capacity(capacity), hits(0), misses(0), evictions(0), prepareTime(0), lastReport(system_clock::now())
+{
+}
+
+shared_ptr<SQLite::Statement> StatementCache::prepare(const string & sql) {
+    auto start = system_clock::now();
+    auto stmt = make_shared<SQLite::Statement>(db, sql);
+    prepareTime += duration_cast<microseconds>(system_clock::now() - start);
+    misses += 1;
+    return stmt;
+}
+
+shared_ptr<SQLite::Statement> StatementCache::get(const string & sql) {
+    reportIfNecessary();
+
+    shared_ptr<SQLite::Statement> owner = nullptr;
+    auto it = index.find(sql);
+
+    if (it != index.end()) {
+        // Note: the cache and the handle we give out both hold a reference. If there
+        // are more than that, someone is still stepping through this statement.
+        if (it->second->second.use_count() > 1) {
+            return prepare(sql);
+        }
+        hits += 1;
+        entries.splice(entries.begin(), entries, it->second);
+        owner = it->second->second;
+        owner->clearBindings();
+    } else {
+        owner = prepare(sql);
+        entries.push_front({sql, owner});
+        index[sql] = entries.begin();
+
+        while (entries.size() > capacity) {
+            index.erase(entries.back().first);
+            entries.pop_back();
+            evictions += 1;
+        }
+    }
+
+    // Hand out a handle that resets the statement when the caller is finished with it,
+    // instead of when it's next used, so it doesn't hold a read transaction open.
+    return shared_ptr<SQLite::Statement>(owner.get(), [owner](SQLite::Statement * stmt) {
+        try {
+            stmt->reset();
+        } catch (SQLite::Exception &) {
+            // reset() re-throws the error from the last step, which the caller has
+            // already been given. The statement is reset either way.
+        }
+    });
+}
+
+void StatementCache::clear() {
+    entries = {};
+    index = {};
+}
+
+void StatementCache::reportIfNecessary() {
+    auto now = system_clock::now();
+    if (now - lastReport < seconds(STATEMENT_CACHE_REPORT_INTERVAL)) {
+        return;
+    }
+    lastReport = now;
+
+    uint64_t total = hits + misses;
+    if (total == 0) {
+        return;
+    }
+    spdlog::get("logger")->info("Statement cache: {} hits, {} misses ({}% hit rate), {} evictions, {}ms preparing statements",
+                                hits, misses, (hits * 100) / total, evictions, prepareTime.count() / 1000);
+}
@@ -0,0 +1,58 @@
+//
+//  StatementCache.hpp
+//  MailSync
+//
+//  Copyright © 2017 Foundry 376. All rights reserved.
+//
+//  Use of this file is subject to the terms and conditions defined
+//  in 'LICENSE.md', which is part of the Mailspring-Sync package.
+//
+
+/*
+ The StatementCache keeps the most recently used prepared statements for a
+ single database connection, keyed by their SQL, so hot queries aren't parsed
+ and planned by SQLite every time they run.
+
+ Statements are handed out as shared_ptrs which reset the statement when the
+ caller releases them, so a cached SELECT never holds a read transaction open.
+ If a statement is requested while another caller is still using it (eg: a
+ nested find with the same SQL), a separate, uncached statement is returned.
+*/
+#ifndef StatementCache_hpp
+#define StatementCache_hpp
+
+#include <stdio.h>
+#include <chrono>
+#include <list>
+#include <memory>
+#include <string>
+#include <unordered_map>
+
+#include <SQLiteCpp/SQLiteCpp.h>
+
+using namespace std;
+
+class StatementCache {
+    SQLite::Database & db;
+    size_t capacity;
+
+    list<pair<string, shared_ptr<SQLite::Statement>>> entries; // most recently used first
+    unordered_map<string, list<pair<string, shared_ptr<SQLite::Statement>>>::iterator> index;
+
+    uint64_t hits;
+    uint64_t misses;
+    uint64_t evictions;
+    chrono::microseconds prepareTime;
+    chrono::system_clock::time_point lastReport;
+
+    shared_ptr<SQLite::Statement> prepare(const string & sql);
+    void reportIfNecessary();
+
+public:
+    StatementCache(SQLite::Database & db, size_t capacity);
+
+    shared_ptr<SQLite::Statement> get(const string & sql);
+    void clear();
+};
+
+#endif /* StatementCache_hpp */
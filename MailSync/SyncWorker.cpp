@@ -9,6 +9,11 @@
 //  in 'LICENSE.md', which is part of the Mailspring-Sync package.
 //
 #include <algorithm>
+#include <deque>
+#include <exception>
+#include <set>
+#include <sstream>
+#include <thread>
 
 #include "SyncWorker.hpp"
 #include "MailUtils.hpp"
@@ -29,8 +34,13 @@
 #define DEEP_SCAN_INTERVAL          60 * 10
 
 #define MAX_FULL_HEADERS_REQUEST_SIZE  25000
+#define MAX_INSERT_BATCH_SIZE       250
+#define SYNC_PIPELINE_CHUNK_SIZE    500
+#define SYNC_PIPELINE_DEPTH         2
 #define MODSEQ_TRUNCATION_THRESHOLD 4000
 #define MODSEQ_TRUNCATION_UID_COUNT 12000
+#define BODY_FETCH_BATCH_BYTES      2 * 1024 * 1024
+#define BODY_FETCH_BATCH_MAX_COUNT  25
 
 // These keys are saved to the folder object's "localState".
 // Starred keys are used in the client to show sync progress.
@@ -43,6 +53,7 @@
 /// IMPORTANT: deep/shallow are only used for some IMAP servers
 #define LS_LAST_SHALLOW             "lastShallow"
 #define LS_LAST_DEEP                "lastDeep"
+#define LS_SHALLOW_MODSEQ           "shallowModseq"
 #define LS_HIGHESTMODSEQ            "highestmodseq"
 #define LS_UIDVALIDITY              "uidvalidity"
 #define LS_UIDVALIDITY_RESET_COUNT  "uidvalidityResetCount"
@@ -50,11 +61,156 @@
 using namespace mailcore;
 using namespace std;
 
+// Collects everything the server sends while it's attached to a session. libetpan
+// keeps only the last untagged STATUS response of a command, so we read the STATUS
+// responses to LIST-STATUS from the connection log instead. Anything logged is passed
+// on to the session's own logger, if it has one.
+class ReceivedDataCollector : public ConnectionLogger {
+public:
+    string received = "";
+    ConnectionLogger * next = nullptr;
+
+    void log(void * sender, ConnectionLogType logType, Data * buffer) {
+        if (logType == ConnectionLogTypeReceived && buffer != nullptr) {
+            received.append(buffer->bytes(), buffer->length());
+        }
+        if (next != nullptr) {
+            next->log(sender, logType, buffer);
+        }
+    }
+};
+
+// Parses and saves each message body as soon as it has been read from a batched
+// UID FETCH, while the rest of the response is still arriving. Exceptions can't be
+// thrown back through libetpan, so the first one is kept and rethrown by the caller
+// once the fetch returns.
+class MessageBodyCollector : public IMAPMessageDataCallback {
+public:
+    MailProcessor * processor;
+    map<uint32_t, Message *> messages;
+    set<uint32_t> received;
+    size_t bytes = 0;
+    std::exception_ptr error = nullptr;
+
+    MessageBodyCollector(MailProcessor * processor) : processor(processor) {
+    }
+
+    void messageDataFetched(IMAPSession * session, uint32_t uid, Data * data) {
+        auto it = messages.find(uid);
+        if (it == messages.end() || error != nullptr) {
+            return;
+        }
+        received.insert(uid);
+        bytes += data->length();
+        try {
+            MessageParser * messageParser = MessageParser::messageParserWithData(data);
+            processor->retrievedMessageBody(it->second, messageParser);
+        } catch (...) {
+            error = std::current_exception();
+        }
+    }
+};
+
+// Reads an IMAP astring (atom, quoted string or literal) starting at `pos`, advancing
+// `pos` past it. Returns false if the input is malformed.
+static bool readIMAPString(const string & input, size_t & pos, string & result) {
+    result = "";
+    if (pos >= input.size()) {
+        return false;
+    }
+    if (input[pos] == '"') {
+        for (pos = pos + 1; pos < input.size(); pos ++) {
+            if (input[pos] == '\\' && pos + 1 < input.size()) {
+                result += input[++pos];
+            } else if (input[pos] == '"') {
+                pos ++;
+                return true;
+            } else {
+                result += input[pos];
+            }
+        }
+        return false;
+    }
+    if (input[pos] == '{') {
+        size_t close = input.find("}\r\n", pos);
+        if (close == string::npos) {
+            return false;
+        }
+        size_t length = strtoul(input.substr(pos + 1, close - pos - 1).c_str(), nullptr, 10);
+        pos = close + 3;
+        if (pos + length > input.size()) {
+            return false;
+        }
+        result = input.substr(pos, length);
+        pos += length;
+        return true;
+    }
+    size_t end = input.find_first_of(" ()\r\n", pos);
+    if (end == string::npos || end == pos) {
+        return false;
+    }
+    result = input.substr(pos, end - pos);
+    pos = end;
+    return true;
+}
+
+// Parses the untagged `* STATUS <mailbox> (<att> <value> ...)` responses in `input`.
+static map<string, IMAPFolderStatus *> parseStatusResponses(const string & input) {
+    map<string, IMAPFolderStatus *> results{};
+    const string prefix = "* STATUS ";
+    size_t pos = 0;
+
+    while ((pos = input.find(prefix, pos)) != string::npos) {
+        bool atLineStart = (pos == 0) || (pos >= 2 && input.compare(pos - 2, 2, "\r\n") == 0);
+        pos += prefix.size();
+        if (!atLineStart) {
+            continue;
+        }
+
+        string path;
+        if (!readIMAPString(input, pos, path)) {
+            continue;
+        }
+        size_t open = input.find('(', pos);
+        size_t close = input.find(')', pos);
+        if (open == string::npos || close == string::npos || close < open) {
+            continue;
+        }
+
+        IMAPFolderStatus * status = new IMAPFolderStatus();
+        status->autorelease();
+        istringstream atts(input.substr(open + 1, close - open - 1));
+        string att;
+        uint64_t value;
+        while (atts >> att >> value) {
+            if (att == "MESSAGES") {
+                status->setMessageCount((uint32_t)value);
+            } else if (att == "RECENT") {
+                status->setRecentCount((uint32_t)value);
+            } else if (att == "UNSEEN") {
+                status->setUnseenCount((uint32_t)value);
+            } else if (att == "UIDNEXT") {
+                status->setUidNext((uint32_t)value);
+            } else if (att == "UIDVALIDITY") {
+                status->setUidValidity((uint32_t)value);
+            } else if (att == "HIGHESTMODSEQ") {
+                status->setHighestModSeqValue(value);
+            }
+        }
+        if (status->uidNext() > 0 && status->uidValidity() > 0) {
+            results[path] = status;
+        }
+        pos = close;
+    }
+    return results;
+}
+
 
 SyncWorker::SyncWorker(shared_ptr<Account> account) :
     store(new MailStore()),
     account(account),
     unlinkPhase(1),
+    listStatusUnsupported(false),
     logger(spdlog::get("logger")),
     processor(new MailProcessor(account, store)),
     session(IMAPSession())
@@ -70,6 +226,11 @@ void SyncWorker::configure()
     MailUtils::configureSessionForAccount(session, account);
 }
 
+void SyncWorker::setInteractiveWriter(bool interactive)
+{
+    store->setInteractiveWriter(interactive);
+}
+
 void SyncWorker::idleInterrupt()
 {
     // called on main / random threads to interrupt idle
@@ -81,7 +242,8 @@ void SyncWorker::idleInterrupt()
 }
 
 void SyncWorker::idleQueueBodiesToSync(vector<string> & ids) {
-    // called on main thread
+    // called on the stdin reader thread
+    std::unique_lock<std::mutex> lck(idleMtx);
     for (string & id : ids) {
         idleFetchBodyIDs.push_back(id);
     }
@@ -90,9 +252,16 @@ void SyncWorker::idleQueueBodiesToSync(vector<string> & ids) {
 void SyncWorker::idleCycleIteration()
 {
     // Run body requests from the client
-    while (idleFetchBodyIDs.size() > 0) {
-        string id = idleFetchBodyIDs.back();
-        idleFetchBodyIDs.pop_back();
+    while (true) {
+        string id;
+        {
+            std::unique_lock<std::mutex> lck(idleMtx);
+            if (idleFetchBodyIDs.size() == 0) {
+                break;
+            }
+            id = idleFetchBodyIDs.back();
+            idleFetchBodyIDs.pop_back();
+        }
         Query byId = Query().equal("id", id);
         auto msg = store->find<Message>(byId);
         if (msg.get() != nullptr) {
@@ -152,9 +321,7 @@ void SyncWorker::idleCycleIteration()
             rowid = max(rowid, statement.getColumn("rowid").getInt());
         }
         statement.reset();
-        for (auto & task : tasks) {
-            processor.performRemote(task.get());
-        }
+        processor.performRemoteBatch(tasks);
     } while (tasks.size() > 0);
 
     if (idleShouldReloop) {
@@ -247,6 +414,12 @@ bool SyncWorker::syncNow()
     AutoreleasePool pool;
     bool syncAgainImmediately = false;
 
+    // Open the additional connections used to fetch headers in parallel, if the
+    // account has opted in to them.
+    if (fetchPool == nullptr && account->IMAPFetchConnections() > 0) {
+        fetchPool = make_shared<FetchSessionPool>(account, account->IMAPFetchConnections());
+    }
+
     vector<shared_ptr<Folder>> folders = syncFoldersAndLabels();
     bool hasCondstore = session.storedCapabilities()->containsIndex(IMAPCapabilityCondstore);
     bool hasQResync = session.storedCapabilities()->containsIndex(IMAPCapabilityQResync);
@@ -260,14 +433,20 @@ bool SyncWorker::syncNow()
         ptrdiff_t rhsRank = find(roleOrder.begin(), roleOrder.end(), rhs->role()) - roleOrder.begin();
         return lhsRank < rhsRank;
     });
-    
+
+    // Get the status of every folder up front if we can. Otherwise we ask for each
+    // folder's status as we go, which is a round trip per folder.
+    map<string, IMAPFolderStatus *> statuses = fetchFolderStatuses();
+    int unchanged = 0;
+
     for (auto & folder : folders) {
         json & localStatus = folder->localStatus();
         json initialLocalStatus = localStatus; // note: json not json&
         
         String path = AS_MCSTR(folder->path());
         ErrorCode err = ErrorCode::ErrorNone;
-        IMAPFolderStatus remoteStatus = session.folderStatus(&path, &err);
+        auto prefetched = statuses.find(folder->path());
+        IMAPFolderStatus remoteStatus = (prefetched != statuses.end()) ? prefetched->second : session.folderStatus(&path, &err);
         bool firstChunk = false;
 
         if (err != ErrorNone) {
@@ -327,6 +506,11 @@ bool SyncWorker::syncNow()
             continue;
         }
         
+        if (!firstChunk && localStatus[LS_UIDNEXT].get<uint32_t>() == remoteStatus.uidNext() &&
+            localStatus[LS_HIGHESTMODSEQ].get<uint64_t>() == remoteStatus.highestModSeqValue()) {
+            unchanged += 1;
+        }
+
         // Step 2: Initial sync. Until we reach UID 1, we grab chunks of messages
         uint32_t syncedMinUID = localStatus[LS_SYNCED_MIN_UID].get<uint32_t>();
         uint32_t chunkSize = firstChunk ? 750 : 5000;
@@ -359,6 +543,15 @@ bool SyncWorker::syncNow()
             bool timeForDeepScan = (iterationsSinceLaunch > 0) && (time(0) - localStatus[LS_LAST_DEEP].get<time_t>() > DEEP_SCAN_INTERVAL);
             bool timeForShallowScan = !timeForDeepScan && (time(0) - localStatus[LS_LAST_SHALLOW].get<time_t>() > SHALLOW_SCAN_INTERVAL);
 
+            // With CONDSTORE (but not QRESYNC), HIGHESTMODSEQ changes whenever a message is added
+            // or its flags change. If it's the same as it was at the last scan, a shallow scan
+            // would find nothing, so skip it. Deep scans still run to find deleted messages.
+            uint64_t remoteModseq = remoteStatus.highestModSeqValue();
+            if (timeForShallowScan && hasCondstore && !newMessages && remoteModseq > 0 &&
+                localStatus.count(LS_SHALLOW_MODSEQ) && localStatus[LS_SHALLOW_MODSEQ].get<uint64_t>() == remoteModseq) {
+                timeForShallowScan = false;
+            }
+
             // Okay. If there are new messages in the folder (UIDnext has increased), do a heavy fetch of
             // those /AND/ get the bodies. This ensures people see both very quickly, which is important.
             //
@@ -374,14 +567,15 @@ bool SyncWorker::syncNow()
                     if (synced.size() > 1 && synced[0]->remoteUID() < synced[1]->remoteUID()) {
                         std::reverse(synced.begin(), synced.end());
                     }
-                    int count = 0;
+                    vector<shared_ptr<Message>> inboxMessages{};
                     for (auto msg : synced) {
                         if (!msg->isInInbox()) {
                             continue; // skip "all mail" that is not in inbox
                         }
-                        syncMessageBody(msg.get());
-                        if (count++ > 30) { break; }
+                        inboxMessages.push_back(msg);
+                        if (inboxMessages.size() > 31) { break; }
                     }
+                    syncMessageBodiesInBatches(inboxMessages);
                 }
             }
             
@@ -395,6 +589,7 @@ bool SyncWorker::syncNow()
                 syncFolderUIDRange(*folder, RangeMake(bottomUID, remoteUidnext - bottomUID), false);
                 localStatus[LS_LAST_SHALLOW] = time(0);
                 localStatus[LS_UIDNEXT] = remoteUidnext;
+                localStatus[LS_SHALLOW_MODSEQ] = remoteModseq;
             }
             
             if (timeForDeepScan) {
@@ -402,6 +597,7 @@ bool SyncWorker::syncNow()
                 localStatus[LS_LAST_SHALLOW] = time(0);
                 localStatus[LS_LAST_DEEP] = time(0);
                 localStatus[LS_UIDNEXT] = remoteUidnext;
+                localStatus[LS_SHALLOW_MODSEQ] = remoteModseq;
             }
         }
         
@@ -442,7 +638,7 @@ bool SyncWorker::syncNow()
     logger->info("Sync loop deleting unlinked messages with phase {}.", unlinkPhase);
     processor->deleteMessagesStillUnlinkedFromPhase(unlinkPhase);
     
-    logger->info("Sync loop complete.");
+    logger->info("Sync loop complete. {} of {} folders were unchanged, {} statuses were fetched with LIST-STATUS.", unchanged, folders.size(), statuses.size());
     iterationsSinceLaunch += 1;
 
     return syncAgainImmediately;
@@ -472,6 +668,58 @@ void SyncWorker::ensureRootMailspringFolder(Array * remoteFolders)
     }
 }
 
+// Fetches the status of every folder in a single round trip using LIST-STATUS (RFC 5819).
+// mailcore doesn't expose the extension, so we send it as a custom command. If the server
+// rejects it or doesn't return any statuses, we stop trying and the sync loop falls back
+// to a STATUS per folder. The returned statuses are autoreleased.
+map<string, IMAPFolderStatus *> SyncWorker::fetchFolderStatuses()
+{
+    map<string, IMAPFolderStatus *> results{};
+    if (listStatusUnsupported) {
+        return results;
+    }
+    IndexSet * capabilities = session.storedCapabilities();
+    if (capabilities == nullptr) {
+        return results;
+    }
+    if (!capabilities->containsIndex(IMAPCapabilityListStatus)) {
+        logger->info("LIST-STATUS is not advertised, using STATUS for each folder.");
+        listStatusUnsupported = true;
+        return results;
+    }
+
+    string atts = "MESSAGES UNSEEN UIDNEXT UIDVALIDITY";
+    if (capabilities->containsIndex(IMAPCapabilityCondstore)) {
+        atts += " HIGHESTMODSEQ";
+    }
+    string listStatus = "LIST \"\" \"*\" RETURN (STATUS (" + atts + "))";
+    String command = AS_MCSTR(listStatus);
+
+    ReceivedDataCollector collector;
+    collector.next = session.connectionLogger();
+    session.setConnectionLogger(&collector);
+    ErrorCode err = ErrorCode::ErrorNone;
+    auto start = chrono::system_clock::now();
+    session.customCommand(&command, &err);
+    session.setConnectionLogger(collector.next);
+
+    if (err == ErrorCode::ErrorNone) {
+        results = parseStatusResponses(collector.received);
+    }
+    // Note: a server that advertises LIST-STATUS but sends a response libetpan can't parse, or
+    // drops the connection, would fail the same way every cycle, so we stop using it.
+    if (err == ErrorCode::ErrorCustomCommand || err == ErrorCode::ErrorParse || err == ErrorCode::ErrorConnection || (err == ErrorCode::ErrorNone && results.size() == 0)) {
+        logger->info("LIST-STATUS is not supported ({}), using STATUS for each folder.", ErrorCodeToTypeMap[err]);
+        listStatusUnsupported = true;
+    } else if (err != ErrorCode::ErrorNone) {
+        logger->warn("LIST-STATUS failed ({}), using STATUS for each folder.", ErrorCodeToTypeMap[err]);
+    } else {
+        long long ms = chrono::duration_cast<chrono::milliseconds>(chrono::system_clock::now() - start).count();
+        logger->info("LIST-STATUS returned the status of {} folders in {}ms", results.size(), ms);
+    }
+    return results;
+}
+
 vector<shared_ptr<Folder>> SyncWorker::syncFoldersAndLabels()
 {
     // allocated mailcore objects freed when `pool` is removed from the stack
@@ -677,74 +925,315 @@ void SyncWorker::syncFolderUIDRange(Folder & folder, Range range, bool heavyInit
     logger->info("syncFolderUIDRange for {}, UIDs: {} - {}, Heavy: {}", folder.path(), range.location, range.location + range.length, heavyInitialRequest);
 
     AutoreleasePool pool;
-    IndexSet * set = IndexSet::indexSetWithRange(range);
-    IndexSet * heavyNeeded = new IndexSet();
     IMAPProgress cb;
     ErrorCode err(ErrorCode::ErrorNone);
     String path(AS_MCSTR(folder.path()));
-    int heavyNeededIdeal = 0;
-    
+
     // Step 1: Fetch the local attributes (unread, starred, etc.)
     // Note: we do this first because the remote fetch may take a long time, and if the data that
     // comes back is already stale, we want to calculate changes (deletes, especially) based on
     // old <> old, not new <> old, since new, freshly downloaded messages will always be missing
     // in the stale server set and will be marked for deletion. Re-downloading is better.
-    map<uint32_t, MessageAttributes> local(store->fetchMessagesAttributesInRange(range, folder));
+    MessageAttributesSet local(store->fetchMessagesAttributesInRange(range, folder));
 
     // Step 2: Fetch the remote attributes (unread, starred, etc.) for the same UID range
-    time_t syncDataTimestamp = time(0);
     auto kind = MailUtils::messagesRequestKindFor(session.storedCapabilities(), heavyInitialRequest);
-    Array * remote = session.fetchMessagesByUID(&path, kind, set, &cb, &err);
+
+    if (heavyInitialRequest && range.length > SYNC_PIPELINE_CHUNK_SIZE) {
+        syncFolderUIDRangePipelined(folder, range, local, kind, syncedMessages);
+        return;
+    }
+
+    time_t syncDataTimestamp = time(0);
+    Array * remote = session.fetchMessagesByUID(&path, kind, IndexSet::indexSetWithRange(range), &cb, &err);
     if (err) {
         throw SyncException(err, "syncFolderUIDRange - fetchMessagesByUID");
     }
 
-    clock_t lastSleepClock = clock();
+    SyncUIDRangeChanges changes = changesInUIDRange(folder.accountId(), local, remote, heavyInitialRequest);
+    applyChangesInUIDRange(folder, changes, heavyInitialRequest, syncDataTimestamp, syncedMessages);
+}
+
+// A chunk of a UID range moving through the sync pipeline. The fetch stage fills in
+// `remote`, the parse stage compares it with our local attributes and builds models for
+// the messages we need to upsert, and the store stage writes them.
+class SyncPipelineBatch {
+public:
+    Range range;
+    time_t syncDataTimestamp;
+    Array * remote = nullptr;
+    ErrorCode err = ErrorNone;
+    string failure = "";
+
+    SyncUIDRangeChanges changes;
+    vector<shared_ptr<Message>> prepared;
+
+    ~SyncPipelineBatch() {
+        MC_SAFE_RELEASE(remote);
+    }
+};
+
+// A bounded queue between two stages of the sync pipeline. Pushing blocks while the queue
+// is full, so a slow stage holds back the one before it instead of buffering the folder.
+// Once closed, pushes fail and pops return the remaining batches and then nullptr.
+class SyncPipelineQueue {
+    mutex mtx;
+    condition_variable cv;
+    deque<shared_ptr<SyncPipelineBatch>> batches;
+    size_t capacity;
+    bool closed;
+
+public:
+    SyncPipelineQueue(size_t capacity) : capacity(capacity), closed(false) {
+    }
+
+    bool push(shared_ptr<SyncPipelineBatch> batch) {
+        unique_lock<mutex> lock(mtx);
+        cv.wait(lock, [this]() { return closed || batches.size() < capacity; });
+        if (closed) {
+            return false;
+        }
+        batches.push_back(batch);
+        cv.notify_all();
+        return true;
+    }
 
-    logger->info("- remote={}, local={}", remote->count(), local.size());
+    shared_ptr<SyncPipelineBatch> pop() {
+        unique_lock<mutex> lock(mtx);
+        cv.wait(lock, [this]() { return closed || batches.size() > 0; });
+        if (batches.size() == 0) {
+            return nullptr;
+        }
+        auto batch = batches.front();
+        batches.pop_front();
+        cv.notify_all();
+        return batch;
+    }
+
+    void close() {
+        lock_guard<mutex> lock(mtx);
+        closed = true;
+        cv.notify_all();
+    }
+};
 
-    for (int ii = ((int)remote->count()) - 1; ii >= 0; ii--) {
-        // Never sit in a hard loop inserting things into the database for more than 250ms.
-        // This ensures we don't starve another thread waiting for a database connection
-        if (((clock() - lastSleepClock) * 4) / CLOCKS_PER_SEC > 1) {
-            std::this_thread::sleep_for(std::chrono::milliseconds(50));
-            lastSleepClock = clock();
+// Syncs a large, heavy UID range in chunks of SYNC_PIPELINE_CHUNK_SIZE UIDs, newest first,
+// with the fetch, parse and store stages running concurrently:
+//
+// - The fetch thread downloads chunks using our session (or the fetch pool, if the account
+//   has opted in to extra connections, keeping each of them busy).
+// - The parse thread compares each chunk with the local attributes and builds the Message
+//   models for the messages that need to be upserted.
+// - This thread writes them to the MailStore, which never leaves it.
+//
+// The queues between the stages are bounded, so at most a few chunks are in memory at once.
+// Note: the fetch thread is the only user of `session` until the pipeline finishes, since
+// applying heavy changes never goes back to the server.
+void SyncWorker::syncFolderUIDRangePipelined(Folder & folder, Range range, MessageAttributesSet & local, IMAPMessagesRequestKind kind, vector<shared_ptr<Message>> * syncedMessages)
+{
+    vector<Range> chunks{};
+    uint64_t chunkMax = range.location + range.length;
+    while (true) {
+        uint64_t chunkMin = chunkMax - range.location >= SYNC_PIPELINE_CHUNK_SIZE ? chunkMax - SYNC_PIPELINE_CHUNK_SIZE + 1 : range.location;
+        chunks.push_back(RangeMake(chunkMin, chunkMax - chunkMin));
+        if (chunkMin == range.location) {
+            break;
         }
-        
-        IMAPMessage * remoteMsg = (IMAPMessage *)(remote->objectAtIndex(ii));
+        chunkMax = chunkMin - 1;
+    }
+
+    SyncPipelineQueue fetched(SYNC_PIPELINE_DEPTH);
+    SyncPipelineQueue parsed(SYNC_PIPELINE_DEPTH);
+    string path = folder.path();
+    string accountId = folder.accountId();
+
+    // The parse thread builds models with its own copy of the folder, since reading the
+    // folder's JSON while this thread serializes it isn't safe.
+    json folderJSON = folder.toJSON();
+    Folder parseFolder(folderJSON);
+
+    std::thread fetchThread([&]() {
+        // Note: an exception can't leave the thread, so it's passed to this thread as a
+        // failed batch, just like a failure in the parse stage.
+        try {
+            deque<shared_ptr<FetchPoolJob>> jobs{};
+
+            for (size_t ii = 0; ii < chunks.size(); ii ++) {
+                AutoreleasePool pool;
+                auto batch = make_shared<SyncPipelineBatch>();
+                batch->range = chunks[ii];
+                batch->syncDataTimestamp = time(0);
+
+                if (fetchPool != nullptr) {
+                    // Keep every connection busy fetching the chunks after the one we're waiting for
+                    while (jobs.size() < min((size_t)fetchPool->size(), chunks.size() - ii)) {
+                        Range next = chunks[ii + jobs.size()];
+                        jobs.push_back(fetchPool->enqueue(path, IndexSet::indexSetWithRange(next), kind));
+                    }
+                    batch->remote = fetchPool->waitFor(jobs.front(), &batch->err);
+                    jobs.pop_front();
+                } else {
+                    IMAPProgress cb;
+                    String mpath(AS_MCSTR(path));
+                    batch->remote = session.fetchMessagesByUID(&mpath, kind, IndexSet::indexSetWithRange(batch->range), &cb, &batch->err);
+                }
+                if (batch->err != ErrorNone) {
+                    batch->remote = nullptr;
+                }
+                MC_SAFE_RETAIN(batch->remote);
+
+                if (!fetched.push(batch) || batch->err != ErrorNone) {
+                    break;
+                }
+            }
+        } catch (std::exception & ex) {
+            auto batch = make_shared<SyncPipelineBatch>();
+            batch->failure = ex.what();
+            fetched.push(batch);
+        }
+        fetched.close();
+    });
+
+    std::thread parseThread([&]() {
+        while (auto batch = fetched.pop()) {
+            if (batch->err == ErrorNone && batch->failure == "") {
+                AutoreleasePool pool;
+                try {
+                    Range r = batch->range;
+                    MessageAttributesSet chunkLocal = local.slice((uint32_t)r.location, (uint32_t)min(r.location + r.length, (uint64_t)UINT32_MAX));
+                    batch->changes = changesInUIDRange(accountId, chunkLocal, batch->remote, true);
+                    for (auto mMsg : batch->changes.toUpsert) {
+                        batch->prepared.push_back(make_shared<Message>(mMsg, parseFolder, batch->syncDataTimestamp));
+                    }
+                } catch (std::exception & ex) {
+                    batch->failure = ex.what();
+                }
+            }
+            if (!parsed.push(batch)) {
+                break;
+            }
+        }
+        parsed.close();
+    });
+
+    auto start = chrono::system_clock::now();
+    chrono::milliseconds waiting(0);
+
+    try {
+        while (true) {
+            auto waitStart = chrono::system_clock::now();
+            auto batch = parsed.pop();
+            waiting += chrono::duration_cast<chrono::milliseconds>(chrono::system_clock::now() - waitStart);
+            if (batch == nullptr) {
+                break;
+            }
+            if (batch->err != ErrorNone) {
+                throw SyncException(batch->err, "syncFolderUIDRange - fetchMessagesByUID");
+            }
+            if (batch->failure != "") {
+                throw SyncException("sync-pipeline-failure", batch->failure, false);
+            }
+            applyChangesInUIDRange(folder, batch->changes, true, batch->syncDataTimestamp, syncedMessages, &batch->prepared);
+        }
+    } catch (...) {
+        // Stop the other stages. They finish the chunk they're working on and exit.
+        fetched.close();
+        parsed.close();
+        fetchThread.join();
+        parseThread.join();
+        throw;
+    }
+    fetchThread.join();
+    parseThread.join();
+
+    long long ms = chrono::duration_cast<chrono::milliseconds>(chrono::system_clock::now() - start).count();
+    logger->info("- Synced {} chunks in {}ms ({}ms waiting for the fetch and parse stages)", chunks.size(), ms, waiting.count());
+}
+
+// Compares the remote messages fetched for a UID range with the local attributes we had for
+// the same range. Touches neither the MailStore nor the session, so the sync pipeline runs
+// it on the parse thread.
+SyncUIDRangeChanges SyncWorker::changesInUIDRange(string accountId, MessageAttributesSet & local, Array * remote, bool heavyInitialRequest)
+{
+    SyncUIDRangeChanges changes{};
+
+    logger->info("- remote={}, local={}", remote->count(), local.size());
+
+    // Both sets are walked from the highest UID down, so newer messages are processed first.
+    vector<IMAPMessage *> remoteMsgs{};
+    remoteMsgs.reserve(remote->count());
+    for (unsigned int ii = 0; ii < remote->count(); ii ++) {
+        remoteMsgs.push_back((IMAPMessage *)(remote->objectAtIndex(ii)));
+    }
+    sort(remoteMsgs.begin(), remoteMsgs.end(), [](IMAPMessage * a, IMAPMessage * b) {
+        return a->uid() > b->uid();
+    });
+
+    // Resolve the attributes and label sets of the whole chunk up front, so the merge
+    // below only compares integers.
+    vector<MessageAttributes> remoteAttrs{};
+    remoteAttrs.reserve(remoteMsgs.size());
+    for (auto remoteMsg : remoteMsgs) {
+        remoteAttrs.push_back(MessageAttributesForMessage(remoteMsg, accountId));
+    }
+    vector<uint32_t> remoteLabelSets = SharedMessageAttributesCache()->labelSetIdsFor(remoteAttrs);
+
+    size_t li = local.size();
+
+    for (size_t ri = 0; ri < remoteMsgs.size(); ri ++) {
+        IMAPMessage * remoteMsg = remoteMsgs[ri];
         uint32_t remoteUID = remoteMsg->uid();
 
+        // Local UIDs above this one weren't returned by the server.
+        while (li > 0 && local.uids[li - 1] > remoteUID) {
+            changes.deletedUIDs.push_back(local.uids[li - 1]);
+            li --;
+        }
+
         // Step 3: Collect messages that are different or not in our local UID set.
-        bool inFolder = (local.count(remoteUID) > 0);
-        bool same = inFolder && MessageAttributesMatch(local[remoteUID], MessageAttributesForMessage(remoteMsg));
+        bool inFolder = (li > 0 && local.uids[li - 1] == remoteUID);
+        bool same = inFolder && local.matchesAt(li - 1, remoteAttrs[ri], remoteLabelSets[ri]);
+        if (inFolder) {
+            li --;
+        }
 
         if (!inFolder || !same) {
-            // Step 4: Attempt to insert the new message. If we get unique exceptions,
-            // look for the existing message and do an update instead. This happens whenever
-            // a message has moved between folders or it's attributes have changed.
-            
-            // Note: We could prefetch all changedOrMissingIDs and then decide to update/insert,
-            // but we can only query for 500 at a time, it /feels/ nasty, and we /could/ always
-            // hit the exception anyway since another thread could be IDLEing and retrieving
-            // the messages alongside us.
+            // Step 4: Queue the message to be upserted. Each batch looks up the messages
+            // we already have in one query and updates them - this happens whenever a
+            // message has moved between folders or it's attributes have changed. The
+            // rest are inserted in a single transaction.
             if (heavyInitialRequest) {
-                auto local = processor->insertFallbackToUpdateMessage(remoteMsg, folder, syncDataTimestamp);
-                if (syncedMessages != nullptr) {
-                    syncedMessages->push_back(local);
-                }
+                changes.toUpsert.push_back(remoteMsg);
             } else {
-                if (heavyNeededIdeal < MAX_FULL_HEADERS_REQUEST_SIZE) {
-                    heavyNeeded->addIndex(remoteUID);
+                if (changes.heavyNeededIdeal < MAX_FULL_HEADERS_REQUEST_SIZE) {
+                    changes.heavyNeeded.push_back(remoteUID);
                 }
-                heavyNeededIdeal += 1;
+                changes.heavyNeededIdeal += 1;
             }
         }
-        
-        local.erase(remoteUID);
     }
+    while (li > 0) {
+        changes.deletedUIDs.push_back(local.uids[li - 1]);
+        li --;
+    }
+
+    return changes;
+}
+
+// Writes the changes found in a UID range: messages that are new or have changed are upserted
+// (after fetching their full headers, if the request was light) and messages missing on the
+// server are unlinked. `prepared`, if provided, holds models already built for changes.toUpsert.
+void SyncWorker::applyChangesInUIDRange(Folder & folder, SyncUIDRangeChanges & changes, bool heavyInitialRequest, time_t syncDataTimestamp, vector<shared_ptr<Message>> * syncedMessages, vector<shared_ptr<Message>> * prepared)
+{
+    IMAPProgress cb;
+    ErrorCode err(ErrorCode::ErrorNone);
+    String path(AS_MCSTR(folder.path()));
+
+    // Upsert the messages queued in changesInUIDRange
+    upsertMessagesInBatches(changes.toUpsert, folder, syncDataTimestamp, syncedMessages, prepared);
     
-    if (!heavyInitialRequest && heavyNeeded->count() > 0) {
-        logger->info("- Fetching full headers for {} (of {} needed)", heavyNeeded->count(), heavyNeededIdeal);
+    if (!heavyInitialRequest && changes.heavyNeeded.size() > 0) {
+        logger->info("- Fetching full headers for {} (of {} needed)", changes.heavyNeeded.size(), changes.heavyNeededIdeal);
 
         // Note: heavyNeeded could be enormous if the user added a zillion items to a folder, if it's been
         // years since the app was launched, or if a sync bug caused us to delete messages we shouldn't have.
@@ -754,31 +1243,29 @@ void SyncWorker::syncFolderUIDRange(Folder & folder, Range range, bool heavyInit
         // Instead we sync MAX_FULL_HEADERS_REQUEST_SIZE and on the next "deep scan" in 10 minutes, we'll
         // sync X more.
         //
+        IndexSet * heavyNeeded = new IndexSet();
+        heavyNeeded->autorelease();
+        for (auto uid : changes.heavyNeeded) {
+            heavyNeeded->addIndex(uid);
+        }
         syncDataTimestamp = time(0);
         auto kind = MailUtils::messagesRequestKindFor(session.storedCapabilities(), true);
-        remote = session.fetchMessagesByUID(&path, kind, heavyNeeded, &cb, &err);
+        Array * remote = session.fetchMessagesByUID(&path, kind, heavyNeeded, &cb, &err);
         if (err != ErrorNone) {
             throw SyncException(err, "syncFolderUIDRange - fetchMessagesByUID (heavy)");
         }
+        vector<IMAPMessage *> heavyToUpsert{};
         for (int ii = ((int)remote->count()) - 1; ii >= 0; ii--) {
-            IMAPMessage * remoteMsg = (IMAPMessage *)(remote->objectAtIndex(ii));
-            auto local = processor->insertFallbackToUpdateMessage(remoteMsg, folder, syncDataTimestamp);
-            if (syncedMessages != nullptr) {
-                syncedMessages->push_back(local);
-            }
-            remote->removeLastObject();
+            heavyToUpsert.push_back((IMAPMessage *)(remote->objectAtIndex(ii)));
         }
+        upsertMessagesInBatches(heavyToUpsert, folder, syncDataTimestamp, syncedMessages);
     }
 
-    // Step 5: Unlink. The messages left in local map are the ones we had in the range,
-    // which the server reported were no longer there. Remove their remoteUID.
+    // Step 5: Unlink. The deleted UIDs are the ones we had in the range, which the
+    // server reported were no longer there. Remove their remoteUID.
     // We'll delete them later if they don't appear in another folder during sync.
-    if (local.size() > 0) {
-        vector<uint32_t> deletedUIDs {};
-        for (auto const &ent : local) {
-            deletedUIDs.push_back(ent.first);
-        }
-        for (vector<uint32_t> chunk : MailUtils::chunksOfVector(deletedUIDs, 200)) {
+    if (changes.deletedUIDs.size() > 0) {
+        for (vector<uint32_t> chunk : MailUtils::chunksOfVector(changes.deletedUIDs, 200)) {
             auto query = Query().equal("remoteFolderId", folder.id()).equal("remoteUID", chunk);
             processor->unlinkMessagesMatchingQuery(query, unlinkPhase);
         }
@@ -832,22 +1319,13 @@ void SyncWorker::syncFolderChangesViaCondstore(Folder & folder, IMAPFolderStatus
     logger->info("syncFolderChangesViaCondstore - Changes since HMODSEQ {}: {} changed, {} vanished",
                  modseq, modifiedOrAdded->count(), (vanished != nullptr) ? vanished->count() : 0);
 
+    // messages with an existing ID are updated (they could have moved from another
+    // folder), messages with an ID we've never seen in any folder are inserted.
+    vector<IMAPMessage *> toUpsert{};
     for (unsigned int ii = 0; ii < modifiedOrAdded->count(); ii ++) {
-        IMAPMessage * msg = (IMAPMessage *)modifiedOrAdded->objectAtIndex(ii);
-        string id = MailUtils::idForMessage(folder.accountId(), folder.path(), msg);
-
-        Query query = Query().equal("id", id);
-        auto local = store->find<Message>(query);
-        
-        if (local == nullptr) {
-            // Found message with an ID we've never seen in any folder. Add it!
-            processor->insertFallbackToUpdateMessage(msg, folder, syncDataTimestamp);
-        } else {
-            // Found message with an existing ID. Update it's attributes & folderId.
-            // Note: Could potentially have moved from another folder!
-            processor->updateMessage(local.get(), msg, folder, syncDataTimestamp);
-        }
+        toUpsert.push_back((IMAPMessage *)modifiedOrAdded->objectAtIndex(ii));
     }
+    upsertMessagesInBatches(toUpsert, folder, syncDataTimestamp);
     
     // for deleted messages, collect UIDs and destroy. Note: vanishedMessages is only
     // populated when QRESYNC is available. IMPORTANT: vanished may include an infinite
@@ -863,6 +1341,35 @@ void SyncWorker::syncFolderChangesViaCondstore(Folder & folder, IMAPFolderStatus
     folder.localStatus()[LS_HIGHESTMODSEQ] = remoteModseq;
 }
 
+void SyncWorker::upsertMessagesInBatches(vector<IMAPMessage *> & remoteMsgs, Folder & folder, time_t syncDataTimestamp, vector<shared_ptr<Message>> * syncedMessages, vector<shared_ptr<Message>> * prepared)
+{
+    if (remoteMsgs.size() == 0) {
+        return;
+    }
+
+    auto start = chrono::system_clock::now();
+    size_t total = remoteMsgs.size();
+
+    for (size_t offset = 0; offset < total; offset += MAX_INSERT_BATCH_SIZE) {
+        size_t end = min(total, offset + MAX_INSERT_BATCH_SIZE);
+        vector<IMAPMessage *> chunk(remoteMsgs.begin() + offset, remoteMsgs.begin() + end);
+
+        // Note: each batch is written in its own transactions, and the DatabaseWriterLock lets
+        // any interactive writer that's waiting go first, so we don't starve the other threads.
+        vector<shared_ptr<Message>> preparedChunk{};
+        if (prepared != nullptr) {
+            preparedChunk.assign(prepared->begin() + offset, prepared->begin() + end);
+        }
+        auto synced = processor->insertOrUpdateMessages(chunk, folder, syncDataTimestamp, prepared ? &preparedChunk : nullptr);
+        if (syncedMessages != nullptr) {
+            syncedMessages->insert(syncedMessages->end(), synced.begin(), synced.end());
+        }
+    }
+
+    long long ms = chrono::duration_cast<chrono::milliseconds>(chrono::system_clock::now() - start).count();
+    logger->info("- Synced {} messages in {}ms ({} messages/sec)", total, ms, ms > 0 ? (total * 1000) / ms : total);
+}
+
 void SyncWorker::cleanMessageCache(Folder & folder) {
     logger->info("Cleaning local cache and updating stats");
     
@@ -876,15 +1383,26 @@ void SyncWorker::cleanMessageCache(Folder & folder) {
     logger->info("-- {} message bodies deleted from local cache.", purged);
     // TODO BG: Remove them from the search index and remove attachments
 
-    // update messages body stats
-    folder.localStatus()[LS_BODIES_PRESENT] = countBodiesDownloaded(folder);
-    folder.localStatus()[LS_BODIES_WANTED] = countBodiesNeeded(folder);
+    // remove messages that have aged out of the body sync window from the fetch queue,
+    // so it only ever holds bodies we still want.
+    SQLite::Statement expire(store->db(), "DELETE FROM BodyFetchQueue WHERE accountId = ? AND folderId = ? AND ((priority = 0 AND date < ?) OR ?)");
+    expire.bind(1, folder.accountId());
+    expire.bind(2, folder.id());
+    expire.bind(3, (double)(time(0) - maxAgeForBodySync(folder)));
+    expire.bind(4, !shouldCacheBodiesInFolder(folder));
+    expire.exec();
+
+    // update messages body stats. The present count is incremented as bodies are fetched,
+    // and recounted here so it reflects bodies purged and messages removed or moved away.
+    json & ls = folder.localStatus();
+    ls[LS_BODIES_PRESENT] = countBodiesDownloaded(folder);
+    ls[LS_BODIES_WANTED] = countBodiesNeeded(folder);
 }
 
 // Message Body Sync
 
 time_t SyncWorker::maxAgeForBodySync(Folder & folder) {
-    return 24 * 60 * 60 * 30 * 3; // three months TODO pref!
+    return BODY_SYNC_MAX_AGE; // TODO pref!
 }
 
 bool SyncWorker::shouldCacheBodiesInFolder(Folder & folder) {
@@ -902,15 +1420,17 @@ long long SyncWorker::countBodiesDownloaded(Folder & folder) {
     return count.getColumn(0).getInt64();
 }
 
+// The bodies we want are the ones we have plus the ones still in the fetch queue. The
+// queue is empty once the folder is synced, so this doesn't grow with the folder.
 long long SyncWorker::countBodiesNeeded(Folder & folder) {
     if (!shouldCacheBodiesInFolder(folder)) {
         return 0;
     }
-    SQLite::Statement count(store->db(), "SELECT COUNT(Message.id) FROM Message WHERE Message.remoteFolderId = ? AND (Message.date > ? OR Message.draft = 1) AND Message.remoteUID > 0");
-    count.bind(1, folder.id());
-    count.bind(2, (double)(time(0) - maxAgeForBodySync(folder)));
+    SQLite::Statement count(store->db(), "SELECT COUNT(*) FROM BodyFetchQueue WHERE accountId = ? AND folderId = ?");
+    count.bind(1, folder.accountId());
+    count.bind(2, folder.id());
     count.executeStep();
-    return count.getColumn(0).getInt64();
+    return folder.localStatus()[LS_BODIES_PRESENT].get<long long>() + count.getColumn(0).getInt64();
 }
 
 /*
@@ -924,34 +1444,45 @@ bool SyncWorker::syncMessageBodies(Folder & folder, IMAPFolderStatus & remoteSta
     vector<string> ids{};
     vector<shared_ptr<Message>> results{};
 
-    // very slow query = 400ms+
-    SQLite::Statement missing(store->db(), "SELECT Message.id, Message.remoteUID FROM Message LEFT JOIN MessageBody ON MessageBody.id = Message.id WHERE Message.accountId = ? AND Message.remoteFolderId = ? AND (Message.date > ? OR Message.draft = 1) AND Message.remoteUID > 0 AND MessageBody.id IS NULL ORDER BY Message.date DESC LIMIT 30");
-    missing.bind(1, folder.accountId());
-    missing.bind(2, folder.id());
-    missing.bind(3, (double)(time(0) - maxAgeForBodySync(folder))); // three months TODO pref!
-    while (missing.executeStep()) {
-        if (missing.getColumn(1).getUInt() >= UINT32_MAX - 2) {
-            continue; // message is scheduled for cleanup
+    // Take the next messages from the fetch queue: drafts first, then the newest messages
+    // within the sync window. Each of these is a range scan of BodyFetchQueueNextIndex.
+    SQLite::Statement next(store->db(), "SELECT id FROM BodyFetchQueue WHERE accountId = ? AND folderId = ? AND priority = ? AND date > ? ORDER BY date DESC LIMIT ?");
+    for (int priority : {1, 0}) {
+        next.bind(1, folder.accountId());
+        next.bind(2, folder.id());
+        next.bind(3, priority);
+        next.bind(4, priority == 1 ? 0 : (double)(time(0) - maxAgeForBodySync(folder)));
+        next.bind(5, (int)(30 - ids.size()));
+        while (next.executeStep()) {
+            ids.push_back(next.getColumn(0).getString());
         }
-        ids.push_back(missing.getColumn(0).getString());
+        next.reset();
+    }
+    if (ids.size() == 0) {
+        return false;
     }
     
-    SQLite::Statement stillMissing(store->db(), "SELECT Message.* FROM Message LEFT JOIN MessageBody ON MessageBody.id = Message.id WHERE Message.id IN (" + MailUtils::qmarks(ids.size()) + ") AND MessageBody.id IS NULL");
+    SQLite::Statement stillMissing(store->db(), "SELECT Message.* FROM Message LEFT JOIN MessageBody ON MessageBody.id = Message.id WHERE Message.id IN (" + MailUtils::qmarks(ids.size()) + ") AND MessageBody.id IS NULL AND Message.remoteUID > 0 AND Message.remoteUID < ?");
+    SQLite::Statement dequeue(store->db(), "DELETE FROM BodyFetchQueue WHERE id IN (" + MailUtils::qmarks(ids.size()) + ")");
     SQLite::Statement insertPlaceholder(store->db(), "INSERT OR IGNORE INTO MessageBody (id, value) VALUES (?, ?)");
 
     {
         MailStoreTransaction transaction { store, "syncMessageBodies" };
 
-        // very fast query for the messages found during very slow query that still have no message body.
-        // Inserting empty message body reserves them for processing here. We do this within a transaction
-        // to ensure we don't process the same message twice.
+        // Find the queued messages that still have no message body and remove them all from
+        // the queue. Inserting empty message body reserves them for processing here. We do this
+        // within a transaction to ensure we don't process the same message twice.
         int ii = 1;
         for (auto id : ids) {
-            stillMissing.bind(ii++, id);
+            stillMissing.bind(ii, id);
+            dequeue.bind(ii, id);
+            ii++;
         }
+        stillMissing.bind(ii, UINT32_MAX - 2); // messages above this are scheduled for cleanup
         while (stillMissing.executeStep()) {
             results.push_back(make_shared<Message>(stillMissing));
         }
+        dequeue.exec();
         if (results.size() < ids.size()) {
             logger->info("Body for {} messages already being fetched.", ids.size() - results.size());
         }
@@ -974,18 +1505,106 @@ bool SyncWorker::syncMessageBodies(Folder & folder, IMAPFolderStatus & remoteSta
         ls[LS_BODIES_PRESENT] = 0;
     }
     
-    for (auto result : results) {
-        // increment local sync state - it's fine if this sometimes fails to save,
-        // we recompute the value via COUNT(*) during cleanup
-        ls[LS_BODIES_PRESENT] = ls[LS_BODIES_PRESENT].get<long long>() + 1;
+    // increment local sync state - it's fine if this sometimes fails to save,
+    // we recompute the value via COUNT(*) during cleanup
+    ls[LS_BODIES_PRESENT] = ls[LS_BODIES_PRESENT].get<long long>() + (long long)results.size();
+
+    // attempt to fetch the message bodies
+    syncMessageBodiesInBatches(results);
 
-        // attempt to fetch the message boy
-        syncMessageBody(result.get());
-    }
-    
     return results.size() > 0;
 }
 
+/*
+ Fetches the bodies of the messages, which must all be in the same folder, with as few
+ UID FETCH commands as possible. We fetch RFC822.SIZE first so each batch can be limited
+ to BODY_FETCH_BATCH_BYTES: a batch of newsletters is a few large messages, a batch of
+ conversation replies is many small ones. Each body is parsed and saved as it arrives.
+ */
+void SyncWorker::syncMessageBodiesInBatches(vector<shared_ptr<Message>> & messages) {
+    if (messages.size() < 2) {
+        for (auto & msg : messages) {
+            syncMessageBody(msg.get());
+        }
+        return;
+    }
+
+    AutoreleasePool pool;
+    IMAPProgress cb;
+    ErrorCode err = ErrorCode::ErrorNone;
+    string folderPath = messages[0]->remoteFolder()["path"].get<string>();
+    String path(AS_MCSTR(folderPath));
+
+    IndexSet * uids = new IndexSet();
+    uids->autorelease();
+    for (auto & msg : messages) {
+        uids->addIndex(msg->remoteUID());
+    }
+
+    Array * remote = session.fetchMessagesByUID(&path, IMAPMessagesRequestKindSize, uids, &cb, &err);
+    if (err != ErrorNone) {
+        throw SyncException(err, "syncMessageBodiesInBatches - fetchMessagesByUID");
+    }
+    map<uint32_t, uint32_t> sizes{};
+    for (int ii = 0; ii < remote->count(); ii ++) {
+        IMAPMessage * msg = (IMAPMessage *)remote->objectAtIndex(ii);
+        sizes[msg->uid()] = msg->size();
+    }
+
+    size_t start = 0;
+    while (start < messages.size()) {
+        // Build the next batch. A message larger than the budget is fetched on its own.
+        // Messages the server didn't return a size for have been removed from the folder.
+        MessageBodyCollector collector{processor};
+        IndexSet * batch = new IndexSet();
+        batch->autorelease();
+        uint64_t batchBytes = 0;
+        size_t end = start;
+
+        for (; end < messages.size(); end ++) {
+            auto & msg = messages[end];
+            if (!sizes.count(msg->remoteUID())) {
+                logger->info("Unable to fetch body for message \"{}\" ({} UID {}). It is no longer in the folder.",
+                             msg->subject(), folderPath, msg->remoteUID());
+                continue;
+            }
+            uint32_t size = sizes[msg->remoteUID()];
+            if (collector.messages.size() > 0 && (batchBytes + size > BODY_FETCH_BATCH_BYTES || collector.messages.size() >= BODY_FETCH_BATCH_MAX_COUNT)) {
+                break;
+            }
+            batchBytes += size;
+            batch->addIndex(msg->remoteUID());
+            collector.messages[msg->remoteUID()] = msg.get();
+        }
+        start = end;
+
+        if (collector.messages.size() == 0) {
+            continue;
+        }
+
+        auto fetchStart = chrono::system_clock::now();
+        session.fetchMessagesDataByUID(&path, batch, &collector, &cb, &err);
+        if (collector.error != nullptr) {
+            std::rethrow_exception(collector.error);
+        }
+        if (err != ErrorNone && err != ErrorFetch) {
+            throw SyncException(err, "syncMessageBodiesInBatches - fetchMessagesDataByUID");
+        }
+
+        long long ms = chrono::duration_cast<chrono::milliseconds>(chrono::system_clock::now() - fetchStart).count();
+        logger->info("Fetched {} of {} message bodies ({}KB) from {} in {}ms",
+                     collector.received.size(), collector.messages.size(), collector.bytes / 1024, folderPath, ms);
+
+        // If the batch failed, or the server skipped some messages, fall back to fetching
+        // the rest individually, which tolerates messages disappearing out from under us.
+        for (auto & pair : collector.messages) {
+            if (!collector.received.count(pair.first)) {
+                syncMessageBody(pair.second);
+            }
+        }
+    }
+}
+
 void SyncWorker::syncMessageBody(Message * message) {
     // allocated mailcore objects freed when `pool` is removed from the stack
     AutoreleasePool pool;
@@ -15,6 +15,7 @@
 #include <stdio.h>
 
 #include <iostream>
+#include <map>
 #include <string>
 #include <vector>
 #include <MailCore/MailCore.h>
@@ -24,17 +25,27 @@
 #include "MailProcessor.hpp"
 #include "DeltaStream.hpp"
 #include "Folder.hpp"
+#include "FetchSessionPool.hpp"
 
 using namespace mailcore;
 
+struct SyncUIDRangeChanges {
+    vector<IMAPMessage *> toUpsert;
+    vector<uint32_t> heavyNeeded;
+    int heavyNeededIdeal = 0;
+    vector<uint32_t> deletedUIDs;
+};
+
 class SyncWorker {
     IMAPSession session;
+    shared_ptr<FetchSessionPool> fetchPool;
     
     MailStore * store;
     MailProcessor * processor;
     shared_ptr<spdlog::logger> logger;
 
     int unlinkPhase;
+    bool listStatusUnsupported;
     bool idleShouldReloop;
     int iterationsSinceLaunch;
     vector<string> idleFetchBodyIDs;
@@ -47,6 +58,7 @@ public:
 
     SyncWorker(shared_ptr<Account> account);
     void configure();
+    void setInteractiveWriter(bool interactive);
 
 #pragma mark Foreground Worker
 
@@ -71,12 +83,22 @@ private:
     
     void ensureRootMailspringFolder(Array * remoteFolders);
 
+    map<string, IMAPFolderStatus *> fetchFolderStatuses();
+
     bool initialSyncFolderIncremental(Folder & folder, IMAPFolderStatus & remoteStatus);
         
     void syncFolderUIDRange(Folder & folder, Range range, bool heavyInitialRequest, vector<shared_ptr<Message>> * syncedMessages = nullptr);
 
+    void syncFolderUIDRangePipelined(Folder & folder, Range range, MessageAttributesSet & local, IMAPMessagesRequestKind kind, vector<shared_ptr<Message>> * syncedMessages);
+
+    SyncUIDRangeChanges changesInUIDRange(string accountId, MessageAttributesSet & local, Array * remote, bool heavyInitialRequest);
+
+    void applyChangesInUIDRange(Folder & folder, SyncUIDRangeChanges & changes, bool heavyInitialRequest, time_t syncDataTimestamp, vector<shared_ptr<Message>> * syncedMessages, vector<shared_ptr<Message>> * prepared = nullptr);
+
     void syncFolderChangesViaCondstore(Folder & folder, IMAPFolderStatus & remoteStatus, bool mustSyncAll);
 
+    void upsertMessagesInBatches(vector<IMAPMessage *> & remoteMsgs, Folder & folder, time_t syncDataTimestamp, vector<shared_ptr<Message>> * syncedMessages = nullptr, vector<shared_ptr<Message>> * prepared = nullptr);
+
     void fetchRangeInFolder(String * folder, std::string folderId, Range range);
 
     void cleanMessageCache(Folder & folder);
@@ -86,6 +108,7 @@ private:
     time_t maxAgeForBodySync(Folder & folder);
     bool shouldCacheBodiesInFolder(Folder & folder);
     bool syncMessageBodies(Folder & folder, IMAPFolderStatus & remoteStatus);
+    void syncMessageBodiesInBatches(vector<shared_ptr<Message>> & messages);
     void syncMessageBody(Message * message);
 };
 
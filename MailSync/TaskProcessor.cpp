@@ -36,14 +36,18 @@ using namespace std;
 using namespace mailcore;
 using namespace nlohmann;
 
-// A helper function that can move messages between folders and update the provided
-// messages remoteUIDs, even if UIDPLUS and/or MOVE extensions are not present.
-
-void _moveMessagesResilient(IMAPSession * session, String * path, Folder * destFolder, IndexSet * uids, vector<shared_ptr<Message>> messages) {
+// Helper functions that can move messages between folders and update the provided
+// messages remoteUIDs, even if UIDPLUS and/or MOVE extensions are not present. The
+// move is split into steps so that a batch of moves into the same folder can locate
+// the moved messages and restore their flags with one set of commands.
+
+// Moves the messages. Returns true if the server told us their new UIDs (UIDPLUS) and
+// the messages have been updated. Sets mustApplyAttributes if the move was performed
+// as a COPY, in which case the flags of the new copies need to be restored.
+bool _moveMessages(IMAPSession * session, String * path, Folder * destFolder, IndexSet * uids, vector<shared_ptr<Message>> messages, bool * mustApplyAttributes) {
     ErrorCode err = ErrorCode::ErrorNone;
     HashMap * uidmap = nullptr;
     String * destPath = AS_MCSTR(destFolder->path());
-    bool mustApplyAttributes = false;
     
     // First, perform the action - either the MOVE or the COPY, STORE, EXPUNGE
     // if IMAPCapabilityMove is not present.
@@ -58,72 +62,109 @@ void _moveMessagesResilient(IMAPSession * session, String * path, Folder * destF
             throw SyncException(err, "moveMessages(copy)");
         }
         session->storeFlagsByUID(path, uids, IMAPStoreFlagsRequestKindAdd, MessageFlagDeleted, &err);
-        session->expunge(path, &err); // this will empty their whole trash...
+        if (session->storedCapabilities()->containsIndex(IMAPCapabilityUIDPlus)) {
+            session->expungeUIDs(path, uids, &err);
+        } else {
+            session->expunge(path, &err); // this will empty their whole trash...
+        }
         if (err != ErrorCode::ErrorNone) {
             throw SyncException(err, "moveMessages(copy cleanup)");
         }
-        mustApplyAttributes = true;
+        *mustApplyAttributes = true;
     }
 
     // Only returned if UIDPLUS extension is present and the server tells us
     // which UIDs in the old folder map to which UIDs in the new folder.
-    if (uidmap != nullptr) {
-        for (auto msg : messages) {
-            Value * currentUID = Value::valueWithUnsignedLongValue(msg->remoteUID());
-            Value * newUID = (Value *)uidmap->objectForKey(currentUID);
-            if (!newUID) {
-                throw SyncException("generic", "move did not provide new UID.", false);
-            }
-            msg->setRemoteFolder(destFolder);
-            msg->setRemoteUID(newUID->unsignedIntValue());
+    if (uidmap == nullptr) {
+        return false;
+    }
+    for (auto msg : messages) {
+        Value * currentUID = Value::valueWithUnsignedLongValue(msg->remoteUID());
+        Value * newUID = (Value *)uidmap->objectForKey(currentUID);
+        if (!newUID) {
+            throw SyncException("generic", "move did not provide new UID.", false);
         }
-    } else {
-        // UIDPLUS is not supported, we need to manually find the messages. Thankfully moves
-        // should add higher UIDs to the folder so we can grab the last few and get the messages
-        auto status = session->folderStatus(destPath, &err);
-        IMAPMessagesRequestKind kind = MailUtils::messagesRequestKindFor(session->storedCapabilities(), true);
-        
-        if (status != nullptr) {
-            uint32_t min = status->uidNext() - (uint32_t)messages.size() * 2;
-            if (min < 1) min = 1;
-            IndexSet * set = IndexSet::indexSetWithRange(RangeMake(min, UINT64_MAX));
-            Array * movedMessages = session->fetchMessagesByUID(destPath, kind, set, nullptr, &err);
-            for (auto msg : messages) {
-                bool found = false;
-                for (unsigned int ii = 0; ii < movedMessages->count(); ii ++) {
-                    IMAPMessage * movedMessage = (IMAPMessage*)movedMessages->objectAtIndex(ii);
-                    string movedId = MailUtils::idForMessage(msg->accountId(), destFolder->path(), movedMessage);
-                    if (msg->id() == movedId) {
-                        msg->setRemoteFolder(destFolder);
-                        msg->setRemoteUID(movedMessage->uid());
-                        found = true;
-                        break;
-                    }
-                }
-                if (!found) {
-                    spdlog::get("logger")->error("-- Could not find new UID for message {}", msg->id());
-                }
+        msg->setRemoteFolder(destFolder);
+        msg->setRemoteUID(newUID->unsignedIntValue());
+    }
+    return true;
+}
+
+// UIDPLUS is not supported, we need to manually find the messages. Thankfully moves
+// should add higher UIDs to the folder so we can grab the last few and get the messages
+void _locateMovedMessages(IMAPSession * session, Folder * destFolder, vector<shared_ptr<Message>> messages) {
+    ErrorCode err = ErrorCode::ErrorNone;
+    String * destPath = AS_MCSTR(destFolder->path());
+    auto status = session->folderStatus(destPath, &err);
+    IMAPMessagesRequestKind kind = MailUtils::messagesRequestKindFor(session->storedCapabilities(), true);
+    
+    if (status == nullptr) {
+        return;
+    }
+    // Note: computed as a signed 64-bit value - uidNext can be smaller than twice the number
+    // of messages, and the unsigned subtraction would wrap around to a huge UID.
+    int64_t min = (int64_t)status->uidNext() - (int64_t)messages.size() * 2;
+    if (min < 1) min = 1;
+    IndexSet * set = IndexSet::indexSetWithRange(RangeMake(min, UINT64_MAX));
+    Array * movedMessages = session->fetchMessagesByUID(destPath, kind, set, nullptr, &err);
+    for (auto msg : messages) {
+        bool found = false;
+        for (unsigned int ii = 0; movedMessages && ii < movedMessages->count(); ii ++) {
+            IMAPMessage * movedMessage = (IMAPMessage*)movedMessages->objectAtIndex(ii);
+            string movedId = MailUtils::idForMessage(msg->accountId(), destFolder->path(), movedMessage);
+            if (msg->id() == movedId) {
+                msg->setRemoteFolder(destFolder);
+                msg->setRemoteUID(movedMessage->uid());
+                found = true;
+                break;
             }
         }
+        if (!found) {
+            spdlog::get("logger")->error("-- Could not find new UID for message {}", msg->id());
+        }
     }
-    
-    if (mustApplyAttributes) {
-        for (auto msg : messages) {
-            if (msg->remoteFolderId() == destFolder->id()) {
-                MessageFlag flags = MessageFlagNone;
-                if (msg->isStarred())
-                    flags = (MessageFlag)(flags | MessageFlagFlagged);
-                if (!msg->isUnread())
-                    flags = (MessageFlag)(flags | MessageFlagSeen);
-                if (msg->isDraft())
-                    flags = (MessageFlag)(flags | MessageFlagDraft);
-        
-                if (flags != MessageFlagNone) {
-                    session->storeFlagsByUID(destPath, IndexSet::indexSetWithIndex(msg->remoteUID()), IMAPStoreFlagsRequestKindSet, flags, &err);
-                }
+}
+
+// Restores the flags of messages that were moved with COPY. Messages with the same
+// flags are updated together, so this is one STORE per combination of flags rather
+// than one per message.
+void _applyAttributesToMovedMessages(IMAPSession * session, Folder * destFolder, vector<shared_ptr<Message>> messages) {
+    ErrorCode err = ErrorCode::ErrorNone;
+    String * destPath = AS_MCSTR(destFolder->path());
+    map<int, IndexSet *> uidsByFlags{};
+
+    for (auto msg : messages) {
+        if (msg->remoteFolderId() != destFolder->id()) {
+            continue;
+        }
+        MessageFlag flags = MessageFlagNone;
+        if (msg->isStarred())
+            flags = (MessageFlag)(flags | MessageFlagFlagged);
+        if (!msg->isUnread())
+            flags = (MessageFlag)(flags | MessageFlagSeen);
+        if (msg->isDraft())
+            flags = (MessageFlag)(flags | MessageFlagDraft);
+
+        if (flags != MessageFlagNone) {
+            if (!uidsByFlags.count(flags)) {
+                uidsByFlags[flags] = IndexSet::indexSet();
             }
+            uidsByFlags[flags]->addIndex(msg->remoteUID());
         }
     }
+    for (auto & pair : uidsByFlags) {
+        session->storeFlagsByUID(destPath, pair.second, IMAPStoreFlagsRequestKindSet, (MessageFlag)pair.first, &err);
+    }
+}
+
+void _moveMessagesResilient(IMAPSession * session, String * path, Folder * destFolder, IndexSet * uids, vector<shared_ptr<Message>> messages) {
+    bool mustApplyAttributes = false;
+    if (!_moveMessages(session, path, destFolder, uids, messages, &mustApplyAttributes)) {
+        _locateMovedMessages(session, destFolder, messages);
+    }
+    if (mustApplyAttributes) {
+        _applyAttributesToMovedMessages(session, destFolder, messages);
+    }
 }
 
 // A helper function to permanently remove messages by UID from a given folder path. When a trash folder
@@ -282,6 +323,23 @@ void _applyLabels(Message * msg, json & data) {
     msg->setRemoteXGMLabels(labels);
 }
 
+typedef void (*LocalMessageChange)(Message *, json &);
+
+// Returns the change applied to each message by the mailbox-change task types,
+// which can be applied in batches. Returns nullptr for other task types.
+LocalMessageChange _localMessageChangeForTask(string cname) {
+    if (cname == "ChangeUnreadTask") {
+        return _applyUnread;
+    } else if (cname == "ChangeStarredTask") {
+        return _applyStarred;
+    } else if (cname == "ChangeFolderTask") {
+        return _applyFolder;
+    } else if (cname == "ChangeLabelsTask") {
+        return _applyLabels;
+    }
+    return nullptr;
+}
+
 void _applyLabelChangeInIMAPFolder(IMAPSession * session, String * path, IndexSet * uids, vector<shared_ptr<Message>> messages, json & data) {
     AutoreleasePool pool;
 
@@ -368,21 +426,8 @@ void TaskProcessor::cleanupOldTasksAtRuntime() {
 
 void TaskProcessor::performLocal(Task * task) {
     string cname = task->constructorName();
-    
-    logger->info("[{}] Running {} performLocal:", task->id(), cname);
-
-    try {
-        store->save(task);
-    } catch (SQLite::Exception & ex) {
-        logger->error("[{}] -- Exception: Task could not be saved to the database. {}", task->id(), ex.what());
-        return;
-    }
-
-    try {
-        if (task->accountId() != account->id()) {
-            throw SyncException("generic", "You must provide an account id.", false);
-        }
 
+    _performLocalAndSetStatus(task, "performLocal", [&]() {
         if (cname == "ChangeUnreadTask") {
             performLocalChangeOnMessages(task, _applyUnread);
             
@@ -446,6 +491,28 @@ void TaskProcessor::performLocal(Task * task) {
         } else {
             logger->error("Unsure of how to process this task type {}", cname);
         }
+    });
+}
+
+// Saves the task, runs `apply` and marks the task `remote`, or `complete` with the error
+// if it throws a SyncException, then saves the task again. Shared by performLocal and
+// performLocalChangeOnMessagesBatch so tasks are handled the same way either way.
+void TaskProcessor::_performLocalAndSetStatus(Task * task, string label, std::function<void()> apply) {
+    logger->info("[{}] Running {} {}:", task->id(), task->constructorName(), label);
+
+    try {
+        store->save(task);
+    } catch (SQLite::Exception & ex) {
+        logger->error("[{}] -- Exception: Task could not be saved to the database. {}", task->id(), ex.what());
+        return;
+    }
+
+    try {
+        if (task->accountId() != account->id()) {
+            throw SyncException("generic", "You must provide an account id.", false);
+        }
+
+        apply();
 
         logger->info("[{}] -- Succeeded. Changing status to `remote`", task->id());
         task->setStatus("remote");
@@ -456,10 +523,40 @@ void TaskProcessor::performLocal(Task * task) {
         task->setError(ex.toJSON());
         task->setStatus("complete");
     }
-    
+
     store->save(task);
 }
 
+// Runs performLocal for tasks the client queued back to back in a single transaction,
+// so the client receives one set of deltas. Consecutive mailbox-change tasks (eg: from
+// archiving a large selection) are applied together, other tasks run as usual, in order.
+void TaskProcessor::performLocalBatch(vector<shared_ptr<Task>> & tasks) {
+    if (tasks.size() == 1) {
+        performLocal(tasks[0].get());
+        return;
+    }
+
+    MailStoreTransaction transaction{store, "performLocalBatch"};
+    vector<shared_ptr<Task>> run{};
+
+    for (auto & task : tasks) {
+        if (_localMessageChangeForTask(task->constructorName()) != nullptr) {
+            run.push_back(task);
+            continue;
+        }
+        if (run.size() > 0) {
+            performLocalChangeOnMessagesBatch(run);
+            run = {};
+        }
+        performLocal(task.get());
+    }
+    if (run.size() > 0) {
+        performLocalChangeOnMessagesBatch(run);
+    }
+
+    transaction.commit();
+}
+
 // PerformRemote is run from the foreground worker
 
 void TaskProcessor::performRemote(Task * task) {
@@ -550,6 +647,325 @@ void TaskProcessor::performRemote(Task * task) {
     store->save(task);
 }
 
+// Returns the kind of batch a task's performRemote can be planned in, or "" if it must
+// be run on its own.
+string _remoteBatchKindForTask(string cname) {
+    if (cname == "ChangeUnreadTask" || cname == "ChangeStarredTask") {
+        return "flags";
+    } else if (cname == "ChangeLabelsTask") {
+        return "labels";
+    } else if (cname == "ChangeFolderTask") {
+        return "folder";
+    }
+    return "";
+}
+
+// Runs performRemote for the tasks in order. Consecutive tasks that change the flags,
+// labels or folder of messages are planned together, so toggling unread back and forth
+// or archiving in many separate clicks costs a handful of IMAP commands.
+void TaskProcessor::performRemoteBatch(vector<shared_ptr<Task>> & tasks) {
+    vector<shared_ptr<Task>> run{};
+    string runKind = "";
+
+    auto performRun = [&]() {
+        if (run.size() == 1) {
+            performRemote(run[0].get());
+        } else if (run.size() > 1) {
+            performRemoteChangeOnMessagesBatch(run, runKind);
+        }
+        run = {};
+    };
+
+    for (auto & task : tasks) {
+        string kind = _remoteBatchKindForTask(task->constructorName());
+        if (kind == "" || task->shouldCancel() || task->accountId() != account->id()) {
+            performRun();
+            performRemote(task.get());
+            continue;
+        }
+        if (kind != runKind) {
+            performRun();
+            runKind = kind;
+        }
+        run.push_back(task);
+    }
+    performRun();
+}
+
+// Merges the changes made by a run of tasks into the minimal set of IMAP commands. For
+// each message only the final state matters: if one task marks it unread and the next
+// marks it read, we only store the Seen flag. Messages are grouped by folder, and by the
+// flag / labels / destination being applied, so each group is a single command.
+vector<RemoteChangeCommand> TaskProcessor::planRemoteChangeOnMessages(vector<shared_ptr<Task>> & tasks, vector<vector<shared_ptr<Message>>> & messages, string kind) {
+    // The final change to each message, keyed by a description of the change
+    map<string, map<string, json>> finalChanges{};
+    map<string, shared_ptr<Message>> messagesById{};
+    map<string, set<size_t>> taskIndexesById{};
+    vector<string> order{};
+
+    for (size_t ii = 0; ii < tasks.size(); ii ++) {
+        json & data = tasks[ii]->data();
+        string cname = tasks[ii]->constructorName();
+
+        for (auto & msg : messages[ii]) {
+            string id = msg->id();
+            if (!messagesById.count(id)) {
+                messagesById[id] = msg;
+                order.push_back(id);
+            }
+            taskIndexesById[id].insert(ii);
+
+            auto & changes = finalChanges[id];
+            if (cname == "ChangeUnreadTask") {
+                changes["unread"] = data["unread"];
+            } else if (cname == "ChangeStarredTask") {
+                changes["starred"] = data["starred"];
+            } else if (cname == "ChangeFolderTask") {
+                changes["folder"] = data["folder"];
+            } else if (cname == "ChangeLabelsTask") {
+                for (auto & item : data["labelsToAdd"]) {
+                    changes["label:" + _xgmKeyForLabel(item)] = true;
+                }
+                for (auto & item : data["labelsToRemove"]) {
+                    changes["label:" + _xgmKeyForLabel(item)] = false;
+                }
+            }
+        }
+    }
+
+    map<string, RemoteChangeCommand> commands{};
+    vector<string> commandOrder{};
+
+    auto commandFor = [&](string key, string path) -> RemoteChangeCommand & {
+        if (!commands.count(key)) {
+            commands[key] = RemoteChangeCommand{path, IMAPStoreFlagsRequestKindAdd, MessageFlagNone, {}, nullptr, {}, {}, {}};
+            commandOrder.push_back(key);
+        }
+        return commands[key];
+    };
+
+    for (auto & id : order) {
+        auto & msg = messagesById[id];
+        string path = msg->remoteFolder()["path"].get<string>();
+
+        for (auto & change : finalChanges[id]) {
+            const string & attr = change.first;
+            string key = path + "\n" + attr + "\n" + change.second.dump();
+
+            if (attr == "folder" && change.second["id"].get<string>() == msg->remoteFolderId()) {
+                // The message has been moved back to where it is on the server
+                continue;
+            }
+
+            // Labels with the same UIDs are combined into one command below
+            if (attr.find("label:") == 0) {
+                key = path + "\nlabels\n" + change.second.dump();
+            }
+
+            auto & command = commandFor(key, path);
+            if (attr == "unread") {
+                command.flag = MessageFlagSeen;
+                command.kind = change.second.get<bool>() ? IMAPStoreFlagsRequestKindRemove : IMAPStoreFlagsRequestKindAdd;
+            } else if (attr == "starred") {
+                command.flag = MessageFlagFlagged;
+                command.kind = change.second.get<bool>() ? IMAPStoreFlagsRequestKindAdd : IMAPStoreFlagsRequestKindRemove;
+            } else if (attr == "folder") {
+                command.destFolder = change.second;
+            } else {
+                command.kind = change.second.get<bool>() ? IMAPStoreFlagsRequestKindAdd : IMAPStoreFlagsRequestKindRemove;
+                command.labels.push_back(attr.substr(6));
+            }
+            command.uids.push_back(msg->remoteUID());
+            command.messages.push_back(msg);
+            command.taskIndexes.insert(taskIndexesById[id].begin(), taskIndexesById[id].end());
+        }
+    }
+
+    vector<RemoteChangeCommand> results{};
+    for (auto & key : commandOrder) {
+        auto & command = commands[key];
+        if (kind != "labels") {
+            results.push_back(command);
+            continue;
+        }
+        // Each message added one entry to `labels` per label it's adding or removing. Split
+        // the command so that each label is applied to exactly the messages that need it,
+        // then merge labels that apply to the same set of UIDs.
+        map<string, vector<size_t>> indexesByLabel{};
+        for (size_t ii = 0; ii < command.labels.size(); ii ++) {
+            indexesByLabel[command.labels[ii]].push_back(ii);
+        }
+        map<vector<uint32_t>, RemoteChangeCommand> byUIDs{};
+        for (auto & pair : indexesByLabel) {
+            vector<uint32_t> uids{};
+            vector<shared_ptr<Message>> msgs{};
+            set<size_t> taskIndexes{};
+            for (auto ii : pair.second) {
+                uids.push_back(command.uids[ii]);
+                msgs.push_back(command.messages[ii]);
+                auto & indexes = taskIndexesById[command.messages[ii]->id()];
+                taskIndexes.insert(indexes.begin(), indexes.end());
+            }
+            sort(uids.begin(), uids.end());
+            if (!byUIDs.count(uids)) {
+                byUIDs[uids] = RemoteChangeCommand{command.path, command.kind, MessageFlagNone, {}, nullptr, uids, msgs, {}};
+            }
+            byUIDs[uids].labels.push_back(pair.first);
+            byUIDs[uids].taskIndexes.insert(taskIndexes.begin(), taskIndexes.end());
+        }
+        for (auto & pair : byUIDs) {
+            results.push_back(pair.second);
+        }
+    }
+
+    // Run the commands for each folder together. mailcore only SELECTs a folder when it
+    // isn't already selected, so this is one SELECT per folder instead of one each time
+    // the messages in the run alternate between folders.
+    stable_sort(results.begin(), results.end(), [](const RemoteChangeCommand & a, const RemoteChangeCommand & b) {
+        return a.path < b.path;
+    });
+    return results;
+}
+
+void TaskProcessor::performRemoteChangeOnMessagesBatch(vector<shared_ptr<Task>> & tasks, string kind) {
+    auto start = chrono::system_clock::now();
+    vector<vector<shared_ptr<Message>>> messages{};
+    for (auto & task : tasks) {
+        logger->info("[{}] Running {} performRemote (batched):", task->id(), task->constructorName());
+        messages.push_back(inflateMessages(task->data()).messages);
+    }
+
+    vector<RemoteChangeCommand> commands = planRemoteChangeOnMessages(tasks, messages, kind);
+    set<string> paths{};
+    for (auto & command : commands) {
+        paths.insert(command.path);
+    }
+    logger->info("-- Planned {} tasks as {} IMAP commands in {} folders", tasks.size(), commands.size(), paths.size());
+
+    // Run the commands. If one fails, every task that depends on it fails, but the
+    // remaining commands still run.
+    map<size_t, json> errors{};
+    map<string, shared_ptr<Message>> moved{};
+
+    // Moves the server didn't report new UIDs for (no UIDPLUS), and moves that were done
+    // with COPY, keyed by destination. We find them once per destination at the end.
+    map<string, json> destFolders{};
+    map<string, vector<shared_ptr<Message>>> unlocated{};
+    map<string, vector<shared_ptr<Message>>> copied{};
+
+    for (auto & command : commands) {
+        AutoreleasePool pool;
+        IndexSet * uids = new IndexSet();
+        uids->autorelease();
+        for (auto uid : command.uids) {
+            uids->addIndex(uid);
+        }
+        String * path = AS_MCSTR(command.path);
+        ErrorCode err = ErrorCode::ErrorNone;
+
+        try {
+            if (kind == "flags") {
+                session->storeFlagsByUID(path, uids, command.kind, command.flag, &err);
+                if (err != ErrorCode::ErrorNone) {
+                    throw SyncException(err, "storeFlagsByUID");
+                }
+            } else if (kind == "labels") {
+                Array * labels = new mailcore::Array{};
+                labels->autorelease();
+                for (auto & label : command.labels) {
+                    labels->addObject(AS_MCSTR(label));
+                }
+                session->storeLabelsByUID(path, uids, command.kind, labels, &err);
+                if (err != ErrorCode::ErrorNone) {
+                    throw SyncException(err, "storeLabelsByUID");
+                }
+            } else if (kind == "folder") {
+                // Note: this updates the remoteUID and remoteFolder of the messages
+                Folder destFolder{command.destFolder};
+                bool mustApplyAttributes = false;
+                bool located = _moveMessages(session, path, &destFolder, uids, command.messages, &mustApplyAttributes);
+                string destId = destFolder.id();
+                destFolders[destId] = command.destFolder;
+                for (auto & msg : command.messages) {
+                    moved[msg->id()] = msg;
+                    if (!located) {
+                        unlocated[destId].push_back(msg);
+                    }
+                    if (mustApplyAttributes) {
+                        copied[destId].push_back(msg);
+                    }
+                }
+            }
+        } catch (SyncException & ex) {
+            for (auto ii : command.taskIndexes) {
+                errors[ii] = ex.toJSON();
+            }
+        }
+    }
+
+    for (auto & pair : destFolders) {
+        AutoreleasePool pool;
+        Folder destFolder{pair.second};
+        if (unlocated.count(pair.first)) {
+            _locateMovedMessages(session, &destFolder, unlocated[pair.first]);
+        }
+        if (copied.count(pair.first)) {
+            _applyAttributesToMovedMessages(session, &destFolder, copied[pair.first]);
+        }
+    }
+    for (auto it = moved.begin(); it != moved.end();) {
+        // Messages we couldn't find in the destination keep their old UIDs, as before
+        if (!destFolders.count(it->second->remoteFolderId())) {
+            it = moved.erase(it);
+        } else {
+            it ++;
+        }
+    }
+
+    // Reload the messages inside a transaction, save the new remote UIDs of any messages we
+    // moved and decrement the locks held by the tasks that succeeded.
+    {
+        MailStoreTransaction transaction{store, "performRemoteChangeOnMessagesBatch"};
+        for (size_t ii = 0; ii < tasks.size(); ii ++) {
+            auto & task = tasks[ii];
+            bool succeeded = !errors.count(ii);
+
+            for (auto safe : inflateMessages(task->data()).messages) {
+                if (moved.count(safe->id())) {
+                    safe->setRemoteUID(moved[safe->id()]->remoteUID());
+                    safe->setRemoteFolder(moved[safe->id()]->remoteFolder());
+                }
+                if (succeeded) {
+                    int suc = safe->syncUnsavedChanges() - 1;
+                    safe->setSyncUnsavedChanges(suc);
+                    if (suc == 0) {
+                        safe->setSyncedAt(time(0));
+                    }
+                }
+                store->save(safe.get());
+            }
+
+            if (succeeded) {
+                logger->info("[{}] -- Succeeded. Changing status to `complete`", task->id());
+            } else {
+                logger->error("[{}] -- Failed ({}). Changing status to `complete`", task->id(), errors[ii].dump());
+                task->setError(errors[ii]);
+            }
+            task->setStatus("complete");
+        }
+        // See performRemoteChangeOnMessages - these are all internal fields and remote values.
+        store->unsafeEraseTransactionDeltas();
+
+        for (auto & task : tasks) {
+            store->save(task.get());
+        }
+        transaction.commit();
+    }
+
+    long long ms = chrono::duration_cast<chrono::milliseconds>(chrono::system_clock::now() - start).count();
+    logger->info("-- Ran {} tasks in {}ms ({} failed)", tasks.size(), ms, errors.size());
+}
+
 void TaskProcessor::cancel(string taskId) {
     MailStoreTransaction transaction{store, "cancel"};
     auto task = store->find<Task>(Query().equal("id", taskId).equal("accountId", account->id()));
@@ -679,28 +1095,88 @@ void TaskProcessor::performLocalChangeOnMessages(Task * task, void (*modifyLocal
         for (auto & member : data["threadIds"]) {
             threadIds.push_back(member.get<string>());
         }
-        auto chunks = MailUtils::chunksOfVector(threadIds, 500);
-        auto allLabels = store->allLabelsCache(task->accountId());
+        recomputeThreadCounters(threadIds, &models.messages);
+    }
+    // END TEMPORARY
 
-        for (auto chunk : chunks) {
-            auto threads = store->findAllMap<Thread>(Query().equal("id", chunk), "id");
+    transaction.commit();
+}
+
+// Applies a run of consecutive unread / starred / folder / label tasks in the caller's
+// transaction. Each task is applied in a savepoint so a failure only rolls back that task,
+// and thread counters are recomputed once for the whole run rather than once per task.
+void TaskProcessor::performLocalChangeOnMessagesBatch(vector<shared_ptr<Task>> & tasks) {
+    auto start = chrono::system_clock::now();
+    vector<string> threadIds{};
+    set<string> threadIdsSeen{};
+    size_t messageCount = 0;
+
+    for (auto & task : tasks) {
+        _performLocalAndSetStatus(task.get(), "performLocal (batched)", [&]() {
+            MailStoreTransaction savepoint{store, "performLocalChangeOnMessagesBatch"};
+
+            json & data = task->data();
+            LocalMessageChange modifyLocalMessage = _localMessageChangeForTask(task->constructorName());
+            ChangeMailModels models = inflateMessages(data);
+            bool recomputeThreadAttributes = data.count("threadIds");
 
-            for (auto pair : threads) {
-                pair.second->resetCountedAttributes();
-            }
             for (auto msg : models.messages) {
-                if (threads.count(msg->threadId())) {
-                    threads[msg->threadId()]->applyMessageAttributeChanges(MessageEmptySnapshot, msg.get(), allLabels);
+                // TEMPORARY (see performLocalChangeOnMessages)
+                if (recomputeThreadAttributes) {
+                    msg->_skipThreadUpdatesAfterSave = true;
                 }
+                modifyLocalMessage(msg.get(), data);
+                msg->setSyncUnsavedChanges(msg->syncUnsavedChanges() + 1);
+                msg->setSyncedAt(time(0) + 24 * 60 * 60);
+                store->save(msg.get());
             }
-            for (auto pair : threads) {
-                store->save(pair.second.get());
+            savepoint.commit();
+
+            if (recomputeThreadAttributes) {
+                for (auto & member : data["threadIds"]) {
+                    string threadId = member.get<string>();
+                    if (threadIdsSeen.insert(threadId).second) {
+                        threadIds.push_back(threadId);
+                    }
+                }
             }
-        }
+            messageCount += models.messages.size();
+        });
     }
-    // END TEMPORARY
 
-    transaction.commit();
+    if (threadIds.size() > 0) {
+        recomputeThreadCounters(threadIds, nullptr);
+    }
+
+    long long ms = chrono::duration_cast<chrono::milliseconds>(chrono::system_clock::now() - start).count();
+    logger->info("Applied {} tasks to {} messages and {} threads in {}ms", tasks.size(), messageCount, threadIds.size(), ms);
+}
+
+// Resets the unread / starred / category counters of the given threads and recomputes
+// them from their messages. If `messages` is nullptr, each chunk's messages are loaded.
+void TaskProcessor::recomputeThreadCounters(vector<string> & threadIds, vector<shared_ptr<Message>> * messages) {
+    auto chunks = MailUtils::chunksOfVector(threadIds, 500);
+    auto labelLookup = store->labelLookup(account->id());
+
+    for (auto chunk : chunks) {
+        auto threads = store->findAllMap<Thread>(Query().equal("id", chunk), "id");
+        vector<shared_ptr<Message>> loaded{};
+        if (messages == nullptr) {
+            loaded = store->findLargeSet<Message>("threadId", chunk);
+        }
+
+        for (auto pair : threads) {
+            pair.second->resetCountedAttributes();
+        }
+        for (auto msg : (messages ? *messages : loaded)) {
+            if (threads.count(msg->threadId())) {
+                threads[msg->threadId()]->applyMessageAttributeChanges(MessageEmptySnapshot, msg.get(), *labelLookup);
+            }
+        }
+        for (auto pair : threads) {
+            store->save(pair.second.get());
+        }
+    }
 }
 
 void TaskProcessor::performRemoteChangeOnMessages(Task * task, bool updatesFolder, void (*applyInFolder)(IMAPSession * session, String * path, IndexSet * uids, vector<shared_ptr<Message>> messages, json & data)) {
@@ -876,13 +1352,13 @@ void TaskProcessor::performLocalDestroyContact(Task * task) {
     }
 
     {
-        store->beginTransaction();
+        MailStoreTransaction transaction {store, "performLocalDestroyContact"};
         auto deleted = store->findLargeSet<Contact>("id", contactIds);
         for (auto & c : deleted) {
             c->setHidden(true);
             store->save(c.get());
         }
-        store->commitTransaction();
+        transaction.commit();
     }
 }
 
@@ -13,6 +13,8 @@
 #define TaskProcessor_hpp
 
 #include <stdio.h>
+#include <set>
+#include <functional>
 #include <string>
 #include "json.hpp"
 #include "spdlog/spdlog.h"
@@ -33,6 +35,19 @@ struct ChangeMailModels {
     vector<shared_ptr<Message>> messages;
 };
 
+// A single IMAP command planned for a run of remote mailbox-change tasks, and the
+// indexes of the tasks (in the run) that depend on it.
+struct RemoteChangeCommand {
+    string path;
+    IMAPStoreFlagsRequestKind kind;
+    MessageFlag flag;
+    vector<string> labels;
+    json destFolder;
+    vector<uint32_t> uids;
+    vector<shared_ptr<Message>> messages;
+    set<size_t> taskIndexes;
+};
+
 
 class TaskProcessor {
     MailStore * store;
@@ -47,7 +62,9 @@ public:
     void cleanupOldTasksAtRuntime();
     
     void performLocal(Task * task);
+    void performLocalBatch(vector<shared_ptr<Task>> & tasks);
     void performRemote(Task * task);
+    void performRemoteBatch(vector<shared_ptr<Task>> & tasks);
     void cancel(string taskId);
     
 private:
@@ -56,7 +73,12 @@ private:
     Message inflateClientDraftJSON(json & draftJSON, shared_ptr<Message> existing);
 
     void performLocalChangeOnMessages(Task * task,  void (*modifyLocalMessage)(Message *, json &));
+    void _performLocalAndSetStatus(Task * task, string label, std::function<void()> apply);
+    void performLocalChangeOnMessagesBatch(vector<shared_ptr<Task>> & tasks);
+    void recomputeThreadCounters(vector<string> & threadIds, vector<shared_ptr<Message>> * messages);
     void performRemoteChangeOnMessages(Task * task, bool updatesFolder, void (*applyInFolder)(IMAPSession * session, String * path, IndexSet * uids, vector<shared_ptr<Message>> messages, json & data));
+    void performRemoteChangeOnMessagesBatch(vector<shared_ptr<Task>> & tasks, string kind);
+    vector<RemoteChangeCommand> planRemoteChangeOnMessages(vector<shared_ptr<Task>> & tasks, vector<vector<shared_ptr<Message>>> & messages, string kind);
     void performLocalSaveDraft(Task * task);
     void performLocalDestroyDraft(Task * task);
     void performRemoteDestroyDraft(Task * task);
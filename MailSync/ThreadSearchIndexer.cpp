@@ -0,0 +1,435 @@
+//
+//  ThreadSearchIndexer.cpp
+//  MailSync
+//
+//  Copyright © 2017 Foundry 376. All rights reserved.
+//
+//  Use of this file is subject to the terms and conditions defined
+//  in 'LICENSE.md', which is part of the Mailspring-Sync package.
+//
+
+#include "ThreadSearchIndexer.hpp"
+#include "HTMLTextExtractor.hpp"
+#include "MailStoreTransaction.hpp"
+#include "MailUtils.hpp"
+#include "Message.hpp"
+#include "Thread.hpp"
+#include "constants.h"
+
+#include <unordered_set>
+#include <MailCore/MailCore.h>
+
+using namespace std::chrono;
+using namespace mailcore;
+
+#define SEARCH_INDEX_BATCH_SIZE         100
+#define SEARCH_INDEX_BODY_LENGTH        5000
+#define SEARCH_INDEX_DEBOUNCE           2        // seconds since the last thread was queued
+#define SEARCH_INDEX_MAX_DELAY          10       // seconds since the first thread was queued
+#define SEARCH_INDEX_SWEEP_INTERVAL     60
+#define SEARCH_INDEX_REPORT_INTERVAL    60 * 5
+
+// Singleton Implementation
+
+std::mutex _indexersMtx;
+map<string, ThreadSearchIndexer*> _indexers;
+
+ThreadSearchIndexer * ThreadSearchIndexerForAccountId(string aid) {
+    std::lock_guard<std::mutex> lock(_indexersMtx);
+    auto it = _indexers.find(aid);
+    return it == _indexers.end() ? nullptr : it->second;
+}
+
+void QueueThreadsForSearchIndexing(MailStore * store, string accountId, vector<string> threadIds) {
+    if (threadIds.size() == 0) {
+        return;
+    }
+    // Note: not a cached statement - each chunk size is a different query, and they would
+    // push the frequently used statements out of the statement cache.
+    for (auto & chunk : MailUtils::chunksOfVector(threadIds, 900)) {
+        SQLite::Statement queue(store->db(), "UPDATE Thread SET isSearchIndexed = ? WHERE id IN (" + MailUtils::qmarks(chunk.size()) + ")");
+        queue.bind(1, SEARCH_INDEX_STATE_QUEUED);
+        int ii = 2;
+        for (auto & id : chunk) {
+            queue.bind(ii++, id);
+        }
+        queue.exec();
+    }
+
+    auto indexer = ThreadSearchIndexerForAccountId(accountId);
+    if (indexer != nullptr) {
+        indexer->wake();
+    }
+}
+
+static string stringByAppendingOrSkipping(string input, string val) {
+    auto valWithSpace = " " + val;
+    if (input.find(valWithSpace) != std::string::npos) {
+        return input;
+    }
+    return input + valWithSpace;
+}
+
+static string stringByAppendingContacts(string input, json & contacts) {
+    for (auto & c : contacts) {
+        if (c.count("email")) { input = stringByAppendingOrSkipping(input, c["email"].get<string>()); }
+        if (c.count("name")) { input = stringByAppendingOrSkipping(input, c["name"].get<string>()); }
+    }
+    return input;
+}
+
+// Returns the distinct words in `text`, in the order they first appear. FTS5's tokenizer
+// never joins two words, so this produces exactly the same set of terms as `text` - which is
+// all we need to remove the document from the index later - in much less space than the
+// body of a long thread, which quotes its earlier messages. Case is folded for ASCII only,
+// since the tokenizer folds case anyway.
+static string vocabularyOf(const string & text) {
+    unordered_set<string> seen{};
+    string result = "";
+    size_t pos = 0;
+
+    while (pos < text.size()) {
+        size_t start = text.find_first_not_of(" \t\r\n", pos);
+        if (start == string::npos) {
+            break;
+        }
+        size_t end = text.find_first_of(" \t\r\n", start);
+        if (end == string::npos) {
+            end = text.size();
+        }
+        string word = text.substr(start, end - start);
+        for (auto & c : word) {
+            if (c >= 'A' && c <= 'Z') {
+                c = c - 'A' + 'a';
+            }
+        }
+        if (seen.insert(word).second) {
+            if (result.size() > 0) {
+                result += " ";
+            }
+            result += word;
+        }
+        pos = end;
+    }
+    return result;
+}
+
+struct ThreadSearchDocument {
+    string threadId;
+    uint64_t rowId;
+    string subject;
+    string to;
+    string from;
+    string categories;
+    string body;
+};
+
+ThreadSearchIndexer::ThreadSearchIndexer(string accountId) :
+    accountId(accountId),
+    logger(spdlog::get("logger")),
+    queued(true),
+    firstQueuedAt(system_clock::now()),
+    lastQueuedAt(system_clock::now()),
+    threadsIndexed(0),
+    batches(0),
+    contentBytes(0),
+    buildTime(0),
+    writeTime(0),
+    lastReport(system_clock::now())
+{
+    std::lock_guard<std::mutex> lock(_indexersMtx);
+    _indexers[accountId] = this;
+}
+
+// Called from all threads
+
+void ThreadSearchIndexer::wake() {
+    std::lock_guard<std::mutex> lock(mtx);
+    auto now = system_clock::now();
+    if (!queued) {
+        queued = true;
+        firstQueuedAt = now;
+    }
+    lastQueuedAt = now;
+    cv.notify_one();
+}
+
+// Called on dedicated thread
+
+void ThreadSearchIndexer::run() {
+    MailStore store;
+
+    // Threads we'd claimed but not finished indexing when we last quit.
+    {
+        MailStoreTransaction transaction{&store, "ThreadSearchIndexer:recover"};
+        SQLite::Statement recover(store.db(), "UPDATE Thread SET isSearchIndexed = ? WHERE accountId = ? AND isSearchIndexed = ?");
+        recover.bind(1, SEARCH_INDEX_STATE_QUEUED);
+        recover.bind(2, accountId);
+        recover.bind(3, SEARCH_INDEX_STATE_CLAIMED);
+        recover.exec();
+        transaction.commit();
+    }
+
+    while (true) {
+        {
+            // Wait until threads are queued and writes have settled. We also sweep periodically,
+            // because a thread can be queued by a transaction that commits after we've looked.
+            std::unique_lock<std::mutex> lck(mtx);
+            cv.wait_for(lck, seconds(SEARCH_INDEX_SWEEP_INTERVAL), [this]() { return queued; });
+            while (queued) {
+                auto deadline = min(lastQueuedAt + seconds(SEARCH_INDEX_DEBOUNCE), firstQueuedAt + seconds(SEARCH_INDEX_MAX_DELAY));
+                if (system_clock::now() >= deadline) {
+                    break;
+                }
+                cv.wait_until(lck, deadline);
+            }
+            queued = false;
+        }
+
+        try {
+            while (indexBatch(store) == SEARCH_INDEX_BATCH_SIZE) {
+                // keep going until the queue is empty
+            }
+        } catch (SQLite::Exception & ex) {
+            logger->error("ThreadSearchIndexer: {}", ex.what());
+        }
+        reportIfNecessary();
+    }
+}
+
+size_t ThreadSearchIndexer::indexBatch(MailStore & store) {
+    AutoreleasePool pool;
+    auto start = system_clock::now();
+
+    // Claim a batch of queued threads
+    vector<string> threadIds{};
+    {
+        MailStoreTransaction transaction{&store, "ThreadSearchIndexer:claim"};
+        SQLite::Statement find(store.db(), "SELECT id FROM Thread WHERE isSearchIndexed = ? AND accountId = ? LIMIT ?");
+        find.bind(1, SEARCH_INDEX_STATE_QUEUED);
+        find.bind(2, accountId);
+        find.bind(3, SEARCH_INDEX_BATCH_SIZE);
+        while (find.executeStep()) {
+            threadIds.push_back(find.getColumn("id").getString());
+        }
+        if (threadIds.size() == 0) {
+            return 0;
+        }
+        SQLite::Statement claim(store.db(), "UPDATE Thread SET isSearchIndexed = ? WHERE id IN (" + MailUtils::qmarks(threadIds.size()) + ")");
+        claim.bind(1, SEARCH_INDEX_STATE_CLAIMED);
+        int ii = 2;
+        for (auto & id : threadIds) {
+            claim.bind(ii++, id);
+        }
+        claim.exec();
+        transaction.commit();
+    }
+
+    // Build the documents outside of a transaction, so the sync workers aren't blocked
+    // while we flatten message bodies.
+    map<string, ThreadSearchDocument> docs{};
+    vector<string> ids = threadIds;
+    for (auto & thread : store.findLargeSet<Thread>("id", ids)) {
+        docs[thread->id()] = ThreadSearchDocument{thread->id(), thread->searchRowId(), thread->subject(), "", "", thread->categoriesSearchString(), ""};
+    }
+
+    ids = threadIds;
+    auto messages = store.findLargeSet<Message>("threadId", ids);
+    map<string, shared_ptr<Message>> messagesById{};
+    vector<string> messageIds{};
+    for (auto & msg : messages) {
+        auto doc = docs.find(msg->threadId());
+        if (doc == docs.end()) {
+            continue;
+        }
+        doc->second.to = stringByAppendingContacts(doc->second.to, msg->to());
+        doc->second.to = stringByAppendingContacts(doc->second.to, msg->cc());
+        doc->second.to = stringByAppendingContacts(doc->second.to, msg->bcc());
+        doc->second.from = stringByAppendingContacts(doc->second.from, msg->from());
+        messagesById[msg->id()] = msg;
+        messageIds.push_back(msg->id());
+    }
+
+    for (auto & chunk : MailUtils::chunksOfVector(messageIds, 500)) {
+        SQLite::Statement bodies(store.db(), "SELECT id, value FROM MessageBody WHERE id IN (" + MailUtils::qmarks(chunk.size()) + ")");
+        int ii = 1;
+        for (auto & id : chunk) {
+            bodies.bind(ii++, id);
+        }
+        while (bodies.executeStep()) {
+            string value = bodies.getColumn("value").getString();
+            if (value.size() == 0) {
+                continue; // placeholder for a body that's being fetched
+            }
+            auto & msg = messagesById[bodies.getColumn("id").getString()];
+            string text = msg->plaintext()
+                ? HTMLTextExtractor::textFromPlaintext(value, SEARCH_INDEX_BODY_LENGTH)
+                : HTMLTextExtractor::textFromHTML(value, SEARCH_INDEX_BODY_LENGTH);
+            auto & doc = docs[msg->threadId()];
+            doc.body = doc.body + " " + text;
+        }
+    }
+
+    auto built = system_clock::now();
+
+    // Write the batch. ThreadSearch is an external content table: we remove the old document
+    // from the index using the words saved in ThreadSearchContent, index the full text of the
+    // new one, and then save its words. This bypasses the ThreadSearchContent triggers.
+    {
+        MailStoreTransaction transaction{&store, "ThreadSearchIndexer:write"};
+        auto existing = store.cachedStatement("SELECT content_id, subject, to_, from_, categories, body FROM ThreadSearchContent WHERE id = ?");
+        auto remove = store.cachedStatement("INSERT INTO ThreadSearch (ThreadSearch, rowid, content_id, subject, to_, from_, categories, body) VALUES ('delete', ?, ?, ?, ?, ?, ?, ?)");
+        auto insert = store.cachedStatement("INSERT INTO ThreadSearch (rowid, content_id, subject, to_, from_, categories, body) VALUES (?, ?, ?, ?, ?, ?, ?)");
+        auto update = store.cachedStatement("UPDATE ThreadSearchContent SET subject = ?, to_ = ?, from_ = ?, categories = ?, body = ? WHERE id = ?");
+        auto indexed = store.cachedStatement("UPDATE Thread SET isSearchIndexed = ? WHERE id = ? AND isSearchIndexed = ?");
+
+        for (auto & id : threadIds) {
+            auto it = docs.find(id);
+            if (it != docs.end() && it->second.rowId) {
+                auto & doc = it->second;
+                existing->bind(1, (double)doc.rowId);
+                if (existing->executeStep()) {
+                    remove->bind(1, (double)doc.rowId);
+                    for (int col = 0; col < 6; col ++) {
+                        remove->bind(col + 2, existing->getColumn(col).getString());
+                    }
+                    remove->exec();
+                    remove->reset();
+                    existing->reset();
+
+                    insert->bind(1, (double)doc.rowId);
+                    insert->bind(2, doc.threadId);
+                    insert->bind(3, doc.subject);
+                    insert->bind(4, doc.to);
+                    insert->bind(5, doc.from);
+                    insert->bind(6, doc.categories);
+                    insert->bind(7, doc.body);
+                    insert->exec();
+                    insert->reset();
+
+                    update->bind(1, vocabularyOf(doc.subject));
+                    update->bind(2, vocabularyOf(doc.to));
+                    update->bind(3, vocabularyOf(doc.from));
+                    update->bind(4, vocabularyOf(doc.categories));
+                    update->bind(5, vocabularyOf(doc.body));
+                    update->bind(6, (double)doc.rowId);
+                    update->exec();
+                    update->reset();
+                    contentBytes += doc.body.size();
+                } else {
+                    existing->reset();
+                    logger->warn("ThreadSearchIndexer: thread {} has no search entry", id);
+                }
+            }
+            // Note: if the thread was queued again since we claimed it, it stays queued.
+            indexed->bind(1, SEARCH_INDEX_STATE_INDEXED);
+            indexed->bind(2, id);
+            indexed->bind(3, SEARCH_INDEX_STATE_CLAIMED);
+            indexed->exec();
+            indexed->reset();
+        }
+        transaction.commit();
+    }
+
+    auto end = system_clock::now();
+    threadsIndexed += threadIds.size();
+    batches += 1;
+    buildTime += duration_cast<milliseconds>(built - start);
+    writeTime += duration_cast<milliseconds>(end - built);
+    return threadIds.size();
+}
+
+// Re-indexes every thread in the account on the calling thread and logs how long it took,
+// the size of the search tables and the time taken by a few sample queries. Used by
+// `--mode reindex`, which lets us compare index size and speed across changes to the index.
+void ThreadSearchIndexer::reindexAll() {
+    MailStore store;
+    auto start = system_clock::now();
+
+    {
+        MailStoreTransaction transaction{&store, "ThreadSearchIndexer:reindexAll"};
+        SQLite::Statement queue(store.db(), "UPDATE Thread SET isSearchIndexed = ? WHERE accountId = ?");
+        queue.bind(1, SEARCH_INDEX_STATE_QUEUED);
+        queue.bind(2, accountId);
+        queue.exec();
+        transaction.commit();
+    }
+    while (indexBatch(store) > 0) {
+        // keep going until the queue is empty
+    }
+    long long ms = duration_cast<milliseconds>(system_clock::now() - start).count();
+    logger->info("Reindex: {} threads in {}ms ({}ms building documents, {}ms writing)", threadsIndexed, ms, buildTime.count(), writeTime.count());
+
+    SQLite::Statement indexSize(store.db(), "SELECT SUM(LENGTH(block)) FROM ThreadSearch_data");
+    SQLite::Statement contentSize(store.db(), "SELECT SUM(LENGTH(content_id) + LENGTH(subject) + LENGTH(to_) + LENGTH(from_) + LENGTH(categories) + LENGTH(body)) FROM ThreadSearchContent");
+    SQLite::Statement pages(store.db(), "PRAGMA page_count");
+    SQLite::Statement pageSize(store.db(), "PRAGMA page_size");
+    indexSize.executeStep();
+    contentSize.executeStep();
+    pages.executeStep();
+    pageSize.executeStep();
+    logger->info("Reindex: database is {}MB, search index {}KB, search content {}KB ({}KB of body text indexed)",
+                 pages.getColumn(0).getInt64() * pageSize.getColumn(0).getInt64() / 1048576,
+                 indexSize.getColumn(0).getInt64() / 1024, contentSize.getColumn(0).getInt64() / 1024, contentBytes / 1024);
+
+    for (string q : {"the", "meeting", "from_: a*", "\"thank you\""}) {
+        auto queryStart = system_clock::now();
+        SQLite::Statement query(store.db(), "SELECT COUNT(*) FROM ThreadSearch WHERE ThreadSearch MATCH ?");
+        query.bind(1, q);
+        query.executeStep();
+        long long queryMs = duration_cast<milliseconds>(system_clock::now() - queryStart).count();
+        logger->info("Reindex: query {} matched {} threads in {}ms", q, query.getColumn(0).getInt64(), queryMs);
+    }
+
+    benchmarkTextExtraction(store);
+}
+
+// Compares the HTMLTextExtractor with the flattenHTML + stripWhitespace it replaced, using
+// the largest message bodies in the account. These are mostly newsletters, which is where
+// text extraction is slowest, and they make a better corpus than anything we could ship.
+void ThreadSearchIndexer::benchmarkTextExtraction(MailStore & store) {
+    SQLite::Statement query(store.db(), "SELECT MessageBody.value FROM MessageBody INNER JOIN Message ON Message.id = MessageBody.id WHERE Message.accountId = ? ORDER BY LENGTH(MessageBody.value) DESC LIMIT 200");
+    query.bind(1, accountId);
+
+    size_t count = 0;
+    size_t bytes = 0;
+    microseconds extractorTime{0};
+    microseconds flattenTime{0};
+
+    while (query.executeStep()) {
+        string value = query.getColumn("value").getString();
+        if (value.size() == 0) {
+            continue;
+        }
+        count ++;
+        bytes += value.size();
+
+        auto start = system_clock::now();
+        HTMLTextExtractor::textFromHTML(value, SEARCH_INDEX_BODY_LENGTH);
+        auto extracted = system_clock::now();
+        {
+            AutoreleasePool pool;
+            AS_MCSTR(value)->flattenHTML()->stripWhitespace()->substringToIndex(SEARCH_INDEX_BODY_LENGTH);
+        }
+        auto flattened = system_clock::now();
+
+        extractorTime += duration_cast<microseconds>(extracted - start);
+        flattenTime += duration_cast<microseconds>(flattened - extracted);
+    }
+    logger->info("Reindex: extracted text from {} bodies ({}KB) in {}ms, flattenHTML took {}ms",
+                 count, bytes / 1024, extractorTime.count() / 1000, flattenTime.count() / 1000);
+}
+
+void ThreadSearchIndexer::reportIfNecessary() {
+    auto now = system_clock::now();
+    if (now - lastReport < seconds(SEARCH_INDEX_REPORT_INTERVAL)) {
+        return;
+    }
+    lastReport = now;
+
+    if (batches == 0) {
+        return;
+    }
+    logger->info("Search index: {} threads indexed in {} batches, {}ms building documents, {}ms writing",
+                 threadsIndexed, batches, buildTime.count(), writeTime.count());
+}
@@ -0,0 +1,87 @@
+//
+//  ThreadSearchIndexer.hpp
+//  MailSync
+//
+//  Copyright © 2017 Foundry 376. All rights reserved.
+//
+//  Use of this file is subject to the terms and conditions defined
+//  in 'LICENSE.md', which is part of the Mailspring-Sync package.
+//
+
+/*
+ The ThreadSearchIndexer maintains the ThreadSearch FTS5 table on its own thread,
+ so the sync workers don't pay to rewrite a thread's search document each time a
+ message or body is added to it. (For FTS5, an UPDATE is a delete and re-insert
+ of the whole document.)
+
+ Writers mark threads with `Thread.isSearchIndexed = 0` inside the transaction
+ that changes them and wake the indexer. The indexer waits for writes to settle,
+ claims a batch of queued threads, rebuilds each thread's document from its
+ messages and bodies outside of a transaction, and then writes the whole batch in
+ one transaction. A thread that's queued again while it's being indexed stays
+ queued and is picked up by the next batch.
+
+ ThreadSearch is an external content table. ThreadSearchContent holds the content_id
+ and only the distinct words of each column - enough for FTS5 to remove a document
+ from the index - so the body text isn't stored twice. Queries should only read
+ `content_id` from ThreadSearch: snippet() and highlight() would see the word lists,
+ and bm25() ranking is skewed by them. FTS5's 'rebuild' and 'integrity-check' read
+ the content table too, so the index is rebuilt by re-queueing every thread instead.
+*/
+#ifndef ThreadSearchIndexer_hpp
+#define ThreadSearchIndexer_hpp
+
+#include <stdio.h>
+#include <chrono>
+#include <condition_variable>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#include "MailStore.hpp"
+#include "spdlog/spdlog.h"
+
+using namespace std;
+
+// Values of Thread.isSearchIndexed. Threads that have never been queued are NULL,
+// which is treated the same as indexed.
+#define SEARCH_INDEX_STATE_QUEUED   0
+#define SEARCH_INDEX_STATE_INDEXED  1
+#define SEARCH_INDEX_STATE_CLAIMED  2
+
+class ThreadSearchIndexer {
+    string accountId;
+    shared_ptr<spdlog::logger> logger;
+
+    std::mutex mtx;
+    std::condition_variable cv;
+    bool queued;
+    chrono::system_clock::time_point firstQueuedAt;
+    chrono::system_clock::time_point lastQueuedAt;
+
+    uint64_t threadsIndexed;
+    uint64_t batches;
+    uint64_t contentBytes;
+    chrono::milliseconds buildTime;
+    chrono::milliseconds writeTime;
+    chrono::system_clock::time_point lastReport;
+
+    size_t indexBatch(MailStore & store);
+    void benchmarkTextExtraction(MailStore & store);
+    void reportIfNecessary();
+
+public:
+    ThreadSearchIndexer(string accountId);
+
+    void wake();
+    void run();
+    void reindexAll();
+};
+
+ThreadSearchIndexer * ThreadSearchIndexerForAccountId(string aid);
+
+// Marks the threads as needing to be indexed and wakes the account's indexer, if it
+// is running. Call this within the transaction that changes the threads.
+void QueueThreadsForSearchIndexing(MailStore * store, string accountId, vector<string> threadIds);
+
+#endif /* ThreadSearchIndexer_hpp */
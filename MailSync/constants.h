@@ -17,6 +17,8 @@
 #define AS_MCSTR(X)         mailcore::String::uniquedStringWithUTF8Characters(X.c_str())
 #define AS_WIDE_MCSTR(X)    mailcore::String::stringWithCharacters(X.c_str())
 
+#define BODY_SYNC_MAX_AGE   (24 * 60 * 60 * 30 * 3) // three months
+
 #if defined _WIN32 || defined __CYGWIN__
 static string FS_PATH_SEP = "\\";
 #else
@@ -30,13 +32,14 @@ static vector<string> ACCOUNT_RESET_QUERIES = {
     "DELETE FROM `ThreadCounts` WHERE `categoryId` IN (SELECT id FROM `Folder` WHERE `accountId` = ?)",
     "DELETE FROM `ThreadCounts` WHERE `categoryId` IN (SELECT id FROM `Label` WHERE `accountId` = ?)",
     "DELETE FROM `ThreadCategory` WHERE `id` IN (SELECT id FROM `Thread` WHERE `accountId` = ?)",
-    "DELETE FROM `ThreadSearch` WHERE `content_id` IN (SELECT id FROM `Thread` WHERE `accountId` = ?)",
+    "DELETE FROM `ThreadSearchContent` WHERE `content_id` IN (SELECT id FROM `Thread` WHERE `accountId` = ?)",
     "DELETE FROM `ThreadReference` WHERE `accountId` = ?",
     "DELETE FROM `Thread` WHERE `accountId` = ?",
     "DELETE FROM `File` WHERE `accountId` = ?",
     "DELETE FROM `Event` WHERE `accountId` = ?",
     "DELETE FROM `Label` WHERE `accountId` = ?",
     "DELETE FROM `MessageBody` WHERE `id` IN (SELECT id FROM `Message` WHERE `accountId` = ?)",
+    "DELETE FROM `BodyFetchQueue` WHERE `accountId` = ?",
     "DELETE FROM `Message` WHERE `accountId` = ?",
     "DELETE FROM `Task` WHERE `accountId` = ?",
     "DELETE FROM `Folder` WHERE `accountId` = ?",
@@ -213,6 +216,50 @@ static vector<string> V8_SETUP_QUERIES = {
     "CREATE TABLE `ContactBook` (`id` varchar(40),`accountId` varchar(40), `data` BLOB, `version` INTEGER, PRIMARY KEY (id));",
 };
 
+// ThreadSearch becomes an external content FTS5 table. ThreadSearchContent holds each thread's
+// content_id and the distinct words of each column, which is all FTS5 needs to remove a
+// document from the index, rather than a full copy of the indexed text. Writes go to
+// ThreadSearchContent and the triggers keep the index in sync, except for the
+// ThreadSearchIndexer which indexes the full text directly. (See ThreadSearchIndexer.cpp)
+//
+// IMPORTANT: Because the content table doesn't hold the indexed text, FTS5 features that
+// read it back give wrong results for this table:
+// - 'rebuild' would replace the index with one built from the word lists, and
+//   'integrity-check' reports the index as corrupt. Never run either one.
+// - snippet() and highlight() return fragments of the word lists.
+// - bm25() / rank are skewed: document lengths come from the word lists, and removing a
+//   document subtracts its distinct words rather than its real token count from the totals.
+// Queries should only match against ThreadSearch and read content_id. To rebuild the index,
+// set Thread.isSearchIndexed = 0 and let the ThreadSearchIndexer re-index every thread.
+//
+// At this point in the migration ThreadSearchContent still holds the full subject and
+// categories copied from the old table, so they're indexed with a plain INSERT rather than
+// 'rebuild'. Every thread is then re-indexed, which replaces them with word lists.
+static vector<string> V9_SETUP_QUERIES = {
+    "CREATE TABLE IF NOT EXISTS `ThreadSearchContent` (id INTEGER PRIMARY KEY, content_id VARCHAR(40), subject TEXT, to_ TEXT, from_ TEXT, categories TEXT, body TEXT)",
+    "INSERT INTO `ThreadSearchContent` (id, content_id, subject, to_, from_, categories, body) SELECT rowid, content_id, subject, '', '', categories, '' FROM `ThreadSearch`",
+    "DROP TABLE `ThreadSearch`",
+    "CREATE VIRTUAL TABLE `ThreadSearch` USING fts5(tokenize = 'porter unicode61', content_id UNINDEXED, subject, to_, from_, categories, body, content = 'ThreadSearchContent', content_rowid = 'id', columnsize = 0)",
+    "CREATE TRIGGER IF NOT EXISTS `ThreadSearchContentInsert` AFTER INSERT ON `ThreadSearchContent` BEGIN "
+        "INSERT INTO `ThreadSearch` (rowid, content_id, subject, to_, from_, categories, body) VALUES (new.id, new.content_id, new.subject, new.to_, new.from_, new.categories, new.body); END",
+    "CREATE TRIGGER IF NOT EXISTS `ThreadSearchContentDelete` AFTER DELETE ON `ThreadSearchContent` BEGIN "
+        "INSERT INTO `ThreadSearch` (ThreadSearch, rowid, content_id, subject, to_, from_, categories, body) VALUES ('delete', old.id, old.content_id, old.subject, old.to_, old.from_, old.categories, old.body); END",
+    "INSERT INTO `ThreadSearch` (rowid, content_id, subject, to_, from_, categories, body) SELECT id, content_id, subject, to_, from_, categories, body FROM `ThreadSearchContent`",
+    "UPDATE `Thread` SET isSearchIndexed = 0",
+};
+
+// BodyFetchQueue holds the messages whose bodies haven't been fetched, so the SyncWorker can
+// pick the next ones with an index scan instead of joining Message to MessageBody. Messages
+// are queued by Message::afterSave and removed when their body is fetched or claimed.
+// Priority is 1 for drafts, which are always wanted, and 0 for everything else. The initial
+// queue holds the missing bodies within the three month body sync window.
+static vector<string> V10_SETUP_QUERIES = {
+    "CREATE TABLE IF NOT EXISTS `BodyFetchQueue` (id VARCHAR(40) PRIMARY KEY, accountId VARCHAR(8), folderId VARCHAR(40), priority INTEGER, date DATETIME)",
+    "CREATE INDEX IF NOT EXISTS BodyFetchQueueNextIndex ON `BodyFetchQueue` (accountId, folderId, priority, date)",
+    "INSERT OR IGNORE INTO `BodyFetchQueue` (id, accountId, folderId, priority, date) SELECT Message.id, Message.accountId, Message.remoteFolderId, Message.draft, Message.date FROM Message LEFT JOIN MessageBody ON MessageBody.id = Message.id "
+        "WHERE MessageBody.id IS NULL AND Message.remoteUID > 0 AND (Message.draft = 1 OR Message.date > strftime('%s', 'now') - " + to_string(BODY_SYNC_MAX_AGE) + ")",
+};
+
 
 static map<string, string> COMMON_FOLDER_NAMES = {
     {"gel\xc3\xb6scht", "trash"},
@@ -35,6 +35,7 @@
 #include "SyncWorker.hpp"
 #include "MetadataWorker.hpp"
 #include "MetadataExpirationWorker.hpp"
+#include "ThreadSearchIndexer.hpp"
 #include "DAVWorker.hpp"
 #include "GoogleContactsWorker.hpp"
 #include "SyncException.hpp"
@@ -58,6 +59,7 @@ shared_ptr<GoogleContactsWorker> contactsWorker = nullptr;
 
 shared_ptr<MetadataWorker> metadataWorker = nullptr;
 shared_ptr<MetadataExpirationWorker> metadataExpirationWorker = nullptr;
+shared_ptr<ThreadSearchIndexer> searchIndexer = nullptr;
 
 bool bgWorkerShouldMarkAll = true;
 
@@ -66,6 +68,7 @@ std::thread * bgThread = nullptr;
 std::thread * calContactsThread = nullptr;
 std::thread * metadataThread = nullptr;
 std::thread * metadataExpirationThread = nullptr;
+std::thread * searchIndexerThread = nullptr;
 
 
 class AccumulatorLogger : public ConnectionLogger {
@@ -129,7 +132,7 @@ const option::Descriptor usage[] =
     {HELP,    0,"" , "help",    CArg::None,      "  --help  \tPrint usage and exit." },
     {IDENTITY,0,"a", "identity",CArg::Optional,  USAGE_IDENTITY },
     {ACCOUNT, 0,"a", "account", CArg::Optional,  "  --account, -a  \tRequired: Account JSON with credentials." },
-    {MODE,    0,"m", "mode",    CArg::Required,  "  --mode, -m  \tRequired: sync, test, reset, calendar, or migrate." },
+    {MODE,    0,"m", "mode",    CArg::Required,  "  --mode, -m  \tRequired: sync, test, reset, reindex, calendar, or migrate." },
     {ORPHAN,  0,"o", "orphan",  CArg::None,      "  --orphan, -o  \tOptional: allow the process to run without a parent bound to stdin." },
     {VERBOSE, 0,"v", "verbose", CArg::None,      "  --verbose, -v  \tOptional: log all IMAP and SMTP traffic for debugging purposes." },
     {0,0,0,0,0,0}
@@ -187,6 +190,7 @@ void runBackgroundSyncWorker() {
                     fgThread = new std::thread([&]() {
                         SetThreadName("foreground");
                         fgWorker = make_shared<SyncWorker>(bgWorker->account);
+                        fgWorker->setInteractiveWriter(true);
                         runForegroundSyncWorker();
                     });
                 }
@@ -385,52 +389,117 @@ int runSingleFunctionAndExit(std::function<void()> fn) {
 }
 
 
+#define TASK_BURST_MAX_SIZE 50
+
+void logCommandLatency(string type, DeltaStreamCommand & command, std::chrono::system_clock::time_point startedAt) {
+    auto now = std::chrono::system_clock::now();
+    long long total = std::chrono::duration_cast<std::chrono::milliseconds>(now - command.receivedAt).count();
+    long long waiting = std::chrono::duration_cast<std::chrono::milliseconds>(startedAt - command.receivedAt).count();
+    spdlog::get("logger")->info("stdin: {} handled in {}ms ({}ms waiting)", type, total, waiting);
+}
+
+// Commands that don't touch the database are handled on the stdin reader thread as soon
+// as they arrive, so they don't wait behind tasks the main thread is running. A packet
+// we can't read here is passed on to the main thread's queue, which ignores these types.
+bool handleCommandOnReaderThread(const json & packet) {
+    if (!packet.is_object() || !packet.count("type") || !packet["type"].is_string()) {
+        return false;
+    }
+    string type = packet["type"].get<string>();
+    auto startedAt = std::chrono::system_clock::now();
+
+    try {
+        if (type == "wake-workers") {
+            spdlog::get("logger")->info("Waking all workers...");
+
+            // mark that the background worker should mark all the folders as busy
+            // (on it's thread!)
+            bgWorkerShouldMarkAll = true;
+            
+            // Wake the workers
+            MailUtils::wakeAllWorkers();
+            
+            // interrupt the foreground worker's IDLE call, because our network
+            // connection may have been reset and it'll sit for a while otherwise
+            // and wake-workers is called when waking from sleep
+            if (fgWorker) fgWorker->idleInterrupt();
+
+        } else if (type == "need-bodies") {
+            // interrupt the foreground sync worker to do the remote part of the task
+            vector<string> ids{};
+            for (auto id : packet.at("ids")) {
+                ids.push_back(id.get<string>());
+            }
+            if (fgWorker) fgWorker->idleQueueBodiesToSync(ids);
+            if (fgWorker) fgWorker->idleInterrupt();
+
+        } else if (type == "ack-deltas") {
+            // the client reports how many bytes of deltas it has processed, so we
+            // can hold and coalesce deltas rather than flooding it when it's busy.
+            SharedDeltaStream()->acknowledge(packet.at("bytes").get<uint64_t>());
+            return true;
+
+        } else {
+            return false;
+        }
+    } catch (json::exception & e) {
+        spdlog::get("logger")->warn("stdin: {} is malformed, passing it on: {}", type, e.what());
+        return false;
+    }
+
+    long long ms = std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::system_clock::now() - startedAt).count();
+    spdlog::get("logger")->info("stdin: {} handled on reader thread in {}ms", type, ms);
+    return true;
+}
+
 void runListenOnMainThread(shared_ptr<Account> account) {
     MailStore store;
     TaskProcessor processor{account, &store, nullptr};
 
     store.setStreamDelay(5);
-
-    time_t lostCINAt = 0;
+    store.setInteractiveWriter(true);
 
     processor.cleanupTasksAfterLaunch();
+
+    SharedDeltaStream()->startReadingCommands(handleCommandOnReaderThread);
     
     while(true) {
         AutoreleasePool pool;
-        json packet = {};
-        try {
-            packet = SharedDeltaStream()->waitForJSON();
-        } catch (std::invalid_argument & ex) {
-            json resp = {{"error", ex.what()}};
-            spdlog::get("logger")->error(resp.dump());
-            cout << "\n" << resp.dump() << "\n";
-            continue;
-        }
+        DeltaStreamCommand command;
 
-        // cin is interrupted when the debugger attaches, and that's ok. If cin is
-        // disconnected for more than 30 seconds, it means we have been oprhaned and
-        // we should exit.
-        if (cin.good()) {
-            lostCINAt = 0;
-        } else {
-            if (lostCINAt == 0) {
-                lostCINAt = time(0);
-            }
-            if (time(0) - lostCINAt > 30) {
-                // note: don't run termination / stack trace handlers,
-                // just exit.
-                std::exit(141);
-            }
-			std::this_thread::sleep_for(std::chrono::microseconds(1000));
+        // If stdin has been closed, it means we have been orphaned and we should exit.
+        if (!SharedDeltaStream()->waitForCommand(command)) {
+            // note: don't run termination / stack trace handlers,
+            // just exit.
+            std::exit(141);
         }
 
         try {
+            json & packet = command.packet;
             string type = packet.count("type") ? packet["type"].get<string>() : "";
+            auto startedAt = std::chrono::system_clock::now();
 
             if (type == "queue-task") {
-                packet["task"]["v"] = 0;
-                Task task{packet["task"]};
-                processor.performLocal(&task);
+                // Tasks queued back to back (eg: when the user archives a selection one thread
+                // at a time) are run in a single transaction so we only wait for one commit.
+                // Each task's own transactions become savepoints, so a task that fails is
+                // still rolled back on its own.
+                vector<DeltaStreamCommand> burst{};
+                vector<shared_ptr<Task>> tasks{};
+                burst.push_back(std::move(command));
+                DeltaStreamCommand next;
+                while (burst.size() < TASK_BURST_MAX_SIZE && SharedDeltaStream()->nextQueuedCommand("queue-task", next)) {
+                    burst.push_back(std::move(next));
+                }
+
+                for (auto & queued : burst) {
+                    queued.packet["task"]["v"] = 0;
+                    tasks.push_back(make_shared<Task>(queued.packet["task"]));
+                }
+                processor.performLocalBatch(tasks);
+                for (auto & queued : burst) {
+                    logCommandLatency(type, queued, startedAt);
+                }
         
                 // interrupt the foreground sync worker to do the remote part of the task. We wait a short time
                 // because we want tasks queued back to back to run ASAP and not fight for locks with remote
@@ -447,6 +516,7 @@ void runListenOnMainThread(shared_ptr<Account> account) {
                     }).detach();
                     queuedForegroundWake = true;
                 }
+                continue;
             }
             
             if (type == "cancel-task") {
@@ -454,31 +524,14 @@ void runListenOnMainThread(shared_ptr<Account> account) {
                 // but if we're deleting a draft we want to dequeue saves, etc.
                 processor.cancel(packet["taskId"].get<string>());
             }
-            
-            if (type == "wake-workers") {
-                spdlog::get("logger")->info("Waking all workers...");
-
-                // mark that the background worker should mark all the folders as busy
-                // (on it's thread!)
-                bgWorkerShouldMarkAll = true;
-                
-                // Wake the workers
-                MailUtils::wakeAllWorkers();
-                
-                // interrupt the foreground worker's IDLE call, because our network
-                // connection may have been reset and it'll sit for a while otherwise
-                // and wake-workers is called when waking from sleep
-                if (fgWorker) fgWorker->idleInterrupt();
-            }
 
-            if (type == "need-bodies") {
-                // interrupt the foreground sync worker to do the remote part of the task
-                vector<string> ids{};
-                for (auto id : packet["ids"]) {
-                    ids.push_back(id.get<string>());
-                }
-                if (fgWorker) fgWorker->idleQueueBodiesToSync(ids);
-                if (fgWorker) fgWorker->idleInterrupt();
+            if (type == "set-delta-format") {
+                // the client can opt in to length-prefixed CBOR or MessagePack deltas,
+                // which are smaller and much cheaper for both sides to serialize, and
+                // to patch deltas containing only the keys of each model that changed.
+                string format = packet.count("format") ? packet["format"].get<string>() : DELTA_FORMAT_JSON;
+                bool patches = packet.count("patches") && packet["patches"].get<bool>();
+                SharedDeltaStream()->setFormat(format, patches);
             }
 
             if (type == "sync-calendar") {
@@ -500,6 +553,8 @@ void runListenOnMainThread(shared_ptr<Account> account) {
             if (type == "test-segfault") {
                 raise(SIGSEGV);
             }
+
+            logCommandLatency(type, command, startedAt);
         } catch (...) {
             exceptions::logCurrentExceptionWithStackTrace();
             abort();
@@ -600,6 +655,13 @@ string exectuablePath = argv[0];
         });
     }
 
+    if (mode == "reindex") {
+        return runSingleFunctionAndExit([&](){
+            ThreadSearchIndexer indexer{account->id()};
+            indexer.reindexAll();
+        });
+    }
+
 	// get the identity via param or stdin
     string identityJSON = "";
 	if (options[IDENTITY].count() > 0) {
@@ -679,6 +741,22 @@ string exectuablePath = argv[0];
     if (mode == "sync") {
         spdlog::get("logger")->info("------------- Starting Sync ({}) ---------------", account->emailAddress());
 
+        int eMaxLatency = atoi(MailUtils::getEnvUTF8("DELTA_MAX_LATENCY_MS").c_str());
+        int eMaxBatchSize = atoi(MailUtils::getEnvUTF8("DELTA_MAX_BATCH_SIZE").c_str());
+        if (eMaxLatency > 0 || eMaxBatchSize > 0) {
+            SharedDeltaStream()->setDispatchLimits(
+                eMaxLatency > 0 ? eMaxLatency : DELTA_DEFAULT_MAX_LATENCY_MS,
+                eMaxBatchSize > 0 ? eMaxBatchSize : DELTA_DEFAULT_MAX_BATCH_SIZE);
+        }
+
+        // Note: the indexer is created before the sync workers so it's registered before they
+        // queue threads for indexing. It runs on its own thread with its own MailStore.
+        searchIndexer = make_shared<ThreadSearchIndexer>(account->id());
+        searchIndexerThread = new std::thread([&]() {
+            SetThreadName("searchIndexer");
+            searchIndexer->run();
+        });
+
         fgThread = nullptr; // started after background iteration
         bgThread = new std::thread([&]() {
             SetThreadName("background");
@@ -134,6 +134,7 @@ namespace mailcore {
         IMAPCapabilityXOAuth2,
         IMAPCapabilityXYMHighestModseq,
         IMAPCapabilityGmail,
+        IMAPCapabilityListStatus,
     };
     
     enum POPCapability {
@@ -2941,6 +2941,103 @@ static void nstringDeallocator(char * bytes, unsigned int length) {
     mailimap_nstring_free(bytes);
 };
 
+struct msg_data_handler_data {
+    IMAPSession * session;
+    IMAPMessageDataCallback * callback;
+};
+
+static void msg_data_handler(struct mailimap_msg_att * msg_att, void * context)
+{
+    struct msg_data_handler_data * handler_data;
+    struct mailimap_msg_att_body_section * body_section;
+    clistiter * item_iter;
+    uint32_t uid;
+    
+    handler_data = (struct msg_data_handler_data *) context;
+    body_section = NULL;
+    uid = 0;
+    for(item_iter = clist_begin(msg_att->att_list) ; item_iter != NULL ; item_iter = clist_next(item_iter)) {
+        struct mailimap_msg_att_item * att_item;
+        
+        att_item = (struct mailimap_msg_att_item *) clist_content(item_iter);
+        if (att_item->att_type != MAILIMAP_MSG_ATT_ITEM_STATIC) {
+            continue;
+        }
+        if (att_item->att_data.att_static->att_type == MAILIMAP_MSG_ATT_UID) {
+            uid = att_item->att_data.att_static->att_data.att_uid;
+        }
+        else if (att_item->att_data.att_static->att_type == MAILIMAP_MSG_ATT_BODY_SECTION) {
+            body_section = att_item->att_data.att_static->att_data.att_body_section;
+        }
+    }
+    
+    if ((uid == 0) || (body_section == NULL)) {
+        return;
+    }
+    
+    AutoreleasePool * pool = new AutoreleasePool();
+    Data * data = Data::data();
+    if (body_section->sec_body_part != NULL) {
+        // take ownership of the literal rather than copying it, it would be freed after we return.
+        data->takeBytesOwnership(body_section->sec_body_part, (unsigned int) body_section->sec_length, nstringDeallocator);
+        body_section->sec_body_part = NULL;
+    }
+    handler_data->callback->messageDataFetched(handler_data->session, uid, data);
+    pool->release();
+}
+
+void IMAPSession::fetchMessagesDataByUID(String * folder, IndexSet * uids, IMAPMessageDataCallback * callback,
+                                         IMAPProgressCallback * progressCallback, ErrorCode * pError)
+{
+    struct mailimap_set * imapset;
+    struct mailimap_fetch_type * fetch_type;
+    struct msg_data_handler_data handler_data;
+    clist * fetch_result;
+    int r;
+    
+    selectIfNeeded(folder, pError);
+    if (* pError != ErrorNone)
+        return;
+    
+    imapset = setFromIndexSet(uids);
+    fetch_type = mailimap_fetch_type_new_fetch_att_list_empty();
+    mailimap_fetch_type_new_fetch_att_list_add(fetch_type, mailimap_fetch_att_new_uid());
+    mailimap_fetch_type_new_fetch_att_list_add(fetch_type, mailimap_fetch_att_new_body_peek_section(mailimap_section_new(NULL)));
+    
+    handler_data.session = this;
+    handler_data.callback = callback;
+    mailimap_set_msg_att_handler(mImap, msg_data_handler, &handler_data);
+    
+    mProgressItemsCount = 0;
+    mProgressCallback = progressCallback;
+    
+    fetch_result = NULL;
+    r = mailimap_uid_fetch(mImap, imapset, fetch_type, &fetch_result);
+    
+    mProgressCallback = NULL;
+    mailimap_set_msg_att_handler(mImap, NULL, NULL);
+    mailimap_fetch_type_free(fetch_type);
+    mailimap_set_free(imapset);
+    
+    if (r == MAILIMAP_ERROR_STREAM) {
+        mShouldDisconnect = true;
+        * pError = ErrorConnection;
+        return;
+    }
+    else if (r == MAILIMAP_ERROR_PARSE) {
+        mShouldDisconnect = true;
+        * pError = ErrorParse;
+        return;
+    }
+    else if (hasError(r)) {
+        * pError = ErrorFetch;
+        return;
+    }
+    
+    mailimap_fetch_list_free(fetch_result);
+    * pError = ErrorNone;
+}
+
 Data * IMAPSession::fetchNonDecodedMessageAttachment(String * folder, bool identifier_is_uid,
                                            uint32_t identifier, String * partID,
                                            bool wholePart, uint32_t offset, uint32_t length,
@@ -4269,6 +4366,9 @@ void IMAPSession::capabilitySetWithSessionState(IndexSet * capabilities)
     if (mailimap_has_extension(mImap, (char *)"XYMHIGHESTMODSEQ")) {
         capabilities->addIndex(IMAPCapabilityXYMHighestModseq);
     }
+    if (mailimap_has_extension(mImap, (char *)"LIST-STATUS")) {
+        capabilities->addIndex(IMAPCapabilityListStatus);
+    }
     applyCapabilities(capabilities);
 }
 
@@ -21,6 +21,15 @@ namespace mailcore {
     class IMAPSyncResult;
     class IMAPFolderStatus;
     class IMAPIdentity;
+    class IMAPSession;
+    
+    // Receives each message fetched by fetchMessagesDataByUID as soon as it has been
+    // read from the connection, while the rest of the response is still arriving.
+    class MAILCORE_EXPORT IMAPMessageDataCallback {
+    public:
+        virtual ~IMAPMessageDataCallback() {}
+        virtual void messageDataFetched(IMAPSession * session, uint32_t uid, Data * data) {}
+    };
     
     class MAILCORE_EXPORT IMAPSession : public Object {
     public:
@@ -123,6 +132,8 @@ namespace mailcore {
                                          IMAPProgressCallback * progressCallback, ErrorCode * pError);
         virtual Data * fetchMessageByNumber(String * folder, uint32_t number,
                                             IMAPProgressCallback * progressCallback, ErrorCode * pError);
+        virtual void fetchMessagesDataByUID(String * folder, IndexSet * uids, IMAPMessageDataCallback * callback,
+                                            IMAPProgressCallback * progressCallback, ErrorCode * pError);
         virtual Data * fetchMessageAttachmentByUID(String * folder, uint32_t uid, String * partID,
                                                    Encoding encoding, IMAPProgressCallback * progressCallback, ErrorCode * pError);
 